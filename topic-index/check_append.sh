@@ -0,0 +1,38 @@
+#!/bin/sh
+# Check that --append gives the same counts as indexing the joined text
+# once, for texts that stop on a sentence end still waiting for the next
+# word.  Usage: ./check_append.sh [./topic_index]
+bin=${1:-./topic_index}
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+check()
+{
+    printf '%s' "$1" > "$tmp/old"
+    printf '%s' "$2" > "$tmp/new"
+    printf '%s%s' "$1" "$2" > "$tmp/all"
+    rm -f "$tmp/index"
+    "$bin" --append "$tmp/old" --index "$tmp/index" > /dev/null &&
+        "$bin" --format tsv --top 50 --append "$tmp/new" --index "$tmp/index" the | cut -f 2- > "$tmp/appended" &&
+        "$bin" --format tsv --top 50 the "$tmp/all" | cut -f 2- > "$tmp/once" || status=1
+    if ! cmp -s "$tmp/appended" "$tmp/once"; then
+        echo "FAIL: '$1' + '$2'"
+        diff "$tmp/appended" "$tmp/once"
+        status=1
+    fi
+}
+
+check 'We met Dr.' ' Smith today. He is the best. '
+check 'It rained.' ' then it stopped. '
+check 'We met Dr.
+' 'Smith today. He is the best. '
+check 'Plan' ' A. Plan B. Done.'
+check 'She said "Stop!' '" and left. Then the rain came.'
+check 'error: disk full.' '
+warning: the king left.
+error: retry failed.
+'
+
+[ $status -eq 0 ] && echo "append: ok"
+exit $status
@@ -1,352 +1,8824 @@
+#define _POSIX_C_SOURCE 200809L /* fileno, strdup, mmap */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_MMAP 1
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_THREADS 1
+#include <pthread.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_DIRENT 1
+#include <dirent.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_PARTIAL_READS 1 /* read(2) for --every */
+#include <unistd.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_CLOCK 1 /* clock_gettime, getrusage */
+#include <sys/resource.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define TOPIC_INDEX_HAVE_SERVE 1 /* --serve: Unix sockets, signals */
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifdef TOPIC_INDEX_HAVE_ZSTD /* optional: -DTOPIC_INDEX_HAVE_ZSTD ... -lzstd */
+#include <zstd.h>
+#endif
 
 /*
  * topic_index – compute how much of a text is about a given topic and
- * report the top 5 most-used words (topic word + 4 others).
+ * report the most-used words (topic word + 4 others, or --top K others).
  *
  * Usage:
- *     topic_index <topic_word> [file]
+ *     topic_index [--mmap | --no-mmap] [--read-ahead N] [-j N] [--top K] [--stop-lang LANG[,LANG]]
+ *                 [--stop-words FILE] <topic_word> [file]
+ *     topic_index [options] (--topic WORD | --topics FILE)... [file]
+ *     topic_index [options] --batch <topic_word> (file | dir)...
+ *     topic_index [options] --list LIST <topic_word>
+ *     topic_index [options] --load-index INDEX <topic_word>
+ *     topic_index [options] --append FILE --index INDEX [<topic_word>]
+ *     topic_index --gen-corpus SIZE [--gen-words N] [--zipf S] [--seed N]
+ *     topic_index [options] --bench <topic_word> file
+ *     topic_index [options] --serve SOCKET (file | INDEX)...
+ *
+ * The second form scores the text against many topic words in one pass;
+ * --topic may be repeated and --topics reads one topic per line.
+ *
+ * Batch mode (--batch, or --list LIST with one path per line, "-" for
+ * stdin) prints one report per file; directories are walked in name order.
+ * The word table and lexer buffers are reused between documents, the table
+ * being emptied by a generation bump instead of being freed.  --corpus
+ * sums the batch into one report that also gives each word's document
+ * frequency, and --tfidf scores every document's topics against it (see
+ * run_corpus()).
+ *
+ * --format jsonl|tsv|bin selects a machine-readable report (see
+ * print_jsonl(), print_tsv(), print_bin()); --vocab adds every word.
+ * --window N[w|s|b] adds the topic counts of every N words, sentences or
+ * bytes (see lexer_window_to()).
+ *
+ * --save-index INDEX stores the counts of a document in an index file and
+ * --load-index INDEX reports from one instead of reading text (see
+ * save_index()).  --append FILE --index INDEX counts only FILE on top of
+ * the saved counts and rewrites INDEX; the topic word is optional there.
+ *
+ * --gen-corpus writes a synthetic Zipf-distributed corpus to stdout and
+ * --bench prints per-stage timings to stderr (see run_bench()).  --stats
+ * adds stage times and table counters to any run (see stats_print()).  --every
+ * N|Ns prints a report every N words or N seconds while one stream is
+ * read, from a top K kept as it is counted (see live_top_count()).
+ *
+ * --stem[=LANG] counts words by their stems (see stem_lookup()).  A topic
+ * of several words is a phrase; --ngrams N adds the top N-word phrases to
+ * the report (see lexer_gram()).
+ *
+ * --approx [--mem SIZE] counts in fixed memory with sketches instead of
+ * the word table, for unbounded streams (see approx_init()).
+ *
+ * --serve SOCKET loads documents and indexes once and answers topic and
+ * top-K queries about them on a Unix socket (see serve()).
  *
- * If no file is provided, input is read from stdin.  Only plain text
+ * If no file is provided, input is read from stdin.  Regular files are
+ * memory-mapped and tokenized in place where the platform supports it
+ * (--no-mmap forces the streaming reader, which reads --read-ahead
+ * buffers ahead on a thread of its own).  With -j N the input is cut
+ * into N chunks at word boundaries, each chunk is counted by its own
+ * thread into a private table, and the tables are merged in input order so
+ * the report matches a serial run exactly; --shared-table has the
+ * threads count into one table instead (see shared_count()).  gzip and zstd input is
+ * decompressed on the fly (see input_run()).  Only plain text
  * is processed – for other document formats the caller should convert
  * them to text (e.g. with `catdoc`, `pdftotext`, etc.) and pipe the
- * result into this program.
+ * result into this program.  Text is read as UTF-8 (see utf8_word_bits());
+ * --ascii limits words to ASCII letters and digits.
  *
- * The program follows the ANSI-C (C89) standard and attempts to avoid
+ * The program follows the ISO C99 standard and attempts to avoid
  * memory leaks and undefined behaviour.
  */
 
 #define INITIAL_BUF_SIZE 64
-#define HASH_SIZE 10007 /* prime # buckets for word hash table */
+#define TABLE_INITIAL_SIZE 1024  /* slots in a new word table (power of 2) */
+#define ARENA_FIRST_BLOCK (4 << 10) /* bytes in an arena's first block */
+#define ARENA_BLOCK_SIZE (1 << 20)  /* largest string arena block */
+#define READ_BLOCK_SIZE (1 << 16) /* bytes pulled from the input per read */
+#define MAX_THREADS 256
+#define DEFAULT_TOP_K 4 /* other words listed after the topic */
+#define MIN_CHUNK_SIZE (1 << 16)          /* smallest slice worth a thread */
+#define PARALLEL_BLOCK_SIZE (8 << 20)     /* per-thread bytes read from a stream */
+#define DEFAULT_READ_AHEAD 4              /* stream buffers kept in flight */
 
-/* A minimal stop-word list (common English words we want to ignore when
- * searching for the "top 4 other words").  The list can be extended. */
-static const char *STOP_WORDS[] = {
+/* Character classes for the lexer, indexed by byte value */
+#define CC_WORD 0x01 /* part of a word (isalnum) */
+#define CC_TERM 0x02 /* sentence terminator */
+
+/* Built-in stop-word packs (common words we want to ignore when searching
+ * for the "top 4 other words").  --stop-lang picks the packs and
+ * --stop-words adds words from a file.  Non-ASCII words are UTF-8. */
+static const char *const STOP_WORDS_EN[] = {
     "a", "an", "and", "are", "as", "at", "be", "by", "for", "from", "has", "he", "in",
     "is", "it", "its", "of", "on", "that", "the", "to", "was", "were", "will", "with",
-    "I", "you", "me", "my", "we", "our", "they", "their", "them", "this", "those",
+    "i", "you", "me", "my", "we", "our", "they", "their", "them", "this", "those",
     "these", "your", "yours", "his", "her", "hers", "him", "she", "who", "whom",
     "what", "which", "when", "where", "why", "how", "if", "or", "but", "not", NULL};
 
-/* Linked list node for each unique word */
-typedef struct WordEntry
+static const char *const STOP_WORDS_DE[] = {
+    "aber", "als", "am", "an", "auch", "auf", "aus", "bei", "bin", "bis", "da", "das",
+    "dass", "dem", "den", "der", "des", "die", "doch", "du", "durch", "ein", "eine",
+    "einem", "einen", "einer", "eines", "er", "es", "f\xc3\xbcr", "hat", "ich", "ihr",
+    "im", "in", "ist", "ja", "kann", "mit", "nach", "nicht", "noch", "nur", "ob", "oder",
+    "sich", "sie", "sind", "so", "um", "und", "uns", "von", "vor", "war", "was", "wie",
+    "wir", "wird", "zu", "zum", "zur", "\xc3\xbc" "ber", NULL};
+
+static const char *const STOP_WORDS_FR[] = {
+    "au", "aux", "avec", "ce", "ces", "dans", "de", "des", "du", "elle", "en", "est",
+    "et", "eux", "il", "ils", "je", "la", "le", "les", "leur", "lui", "ma", "mais",
+    "me", "mes", "moi", "mon", "ne", "nos", "notre", "nous", "on", "ou", "par", "pas",
+    "pour", "qu", "que", "qui", "sa", "se", "ses", "son", "sont", "sur", "ta", "te",
+    "tes", "toi", "ton", "tu", "un", "une", "vos", "votre", "vous", "\xc3\xa0",
+    "\xc3\xa9t\xc3\xa9", NULL};
+
+static const struct
 {
-    char *word;             /* lower-case word */
-    long count;             /* total occurrences */
-    long sentence_count;    /* number of sentences containing the word */
-    long last_sentence_id;  /* helper to avoid double counting within a sentence */
-    struct WordEntry *next; /* next in bucket list */
-} WordEntry;
+    const char *lang;
+    const char *const *words;
+} STOP_PACKS[] = {{"en", STOP_WORDS_EN}, {"de", STOP_WORDS_DE}, {"fr", STOP_WORDS_FR}, {NULL, NULL}};
+
+/* Abbreviations whose '.' does not end a sentence: titles and
+ * references that are followed by a name or a number (see
+ * sentence_word_kind()).  Ones that often end a sentence, such as "etc",
+ * are left out; a lower-case word after them carries the sentence on
+ * anyway.  At most ABBREV_MAX_LEN letters.
+ *
+ * A single lower-case letter before a '.' holds like them (the "g" of
+ * "e.g.").  A single capital other than "I" is an initial, and holds the
+ * sentence open only while another initial or a name follows it (J. R.
+ * Smith, J. Smith): a digit or an opening quote after it ends the
+ * sentence.  Right after a capitalised word, a capital and a lower-case
+ * letter (Plan, not PLAN), the letter is a label instead (Plan A. Plan
+ * B., Vitamin C.) and its '.' ends the sentence as usual; a middle
+ * initial (John F. Kennedy) is split the same way, WILLIAM H. SEWARD is
+ * not. */
+static const char *const ABBREVIATIONS[] = {
+    "mr", "mrs", "ms", "mx", "dr", "prof", "rev", "hon", "st", "sr", "jr", "gen", "col",
+    "capt", "cmdr", "lt", "sgt", "gov", "sen", "messrs", "fig", "figs", "vol", "vols",
+    "pp", "ch", "eq", "cf", "vs", "viz", "approx", "ca", "dept", "univ",
+    "hr", "fr", "nr", "mme", "mlle", NULL};
 
-static WordEntry *hash_table[HASH_SIZE];
+#define ABBREV_MAX_LEN 6
 
-/* simple hash – djb2 */
-static unsigned long hash_word(const char *s)
+/* What a sentence terminator seen since the last word start means; the
+ * lexer decides at the next word (see sentence_ends()) */
+enum
 {
-    unsigned long h = 5381UL;
-    int c;
-    while ((c = (unsigned char)*s++) != 0)
+    SENT_NONE,   /* none seen */
+    SENT_END,    /* ends the sentence unless the next word carries it on */
+    SENT_HOLD,   /* a '.' after an abbreviation or a lower-case letter */
+    SENT_INITIAL /* a '.' after an initial: held if a letter follows */
+};
+
+#define WORD_STOP 0x01  /* WordTable::flags: word is a stop word */
+#define WORD_TOPIC 0x02 /* WordTable::flags: word is one of the topics */
+#define WORD_FIRST 0x04 /* WordTable::flags: counted in sentence 0 (see merge_word_table()) */
+
+#define WORD_NONE UINT32_MAX /* no such entry */
+
+/* One slot of the open-addressing word table: the full hash and the
+ * number of the entry, whose fields live in the table's dense arrays.
+ * Four slots share a cache line.  A slot is in use only while its gen
+ * matches the table's, so the table is emptied by bumping the table's
+ * generation. */
+typedef struct
+{
+    uint64_t hash; /* full hash_word() value */
+    uint32_t id;   /* entry number, in order of arrival */
+    unsigned gen;  /* WordTable::gen when the slot was filled */
+} WordSlot;
+
+/* The high bits of a 32-bit counter that wrapped */
+typedef struct
+{
+    size_t key; /* COUNTER_MAX * entry + COUNTER_* */
+    uint64_t high;
+} WordCarry;
+
+enum
+{
+    COUNTER_WORDS,
+    COUNTER_SENTENCES,
+    COUNTER_DOCS, /* only in a corpus table (word_table_count_docs()) */
+    COUNTER_MAX
+};
+
+/* A word and its counts as a report shows them */
+typedef struct
+{
+    const char *word;
+    size_t len;
+    long count;
+    long sentence_count;
+    long docs; /* documents containing the word, in a corpus report */
+} WordRow;
+
+/* Bump allocator for small strings (stop words, topics, n-gram rows):
+ * an allocation is a pointer increment and freeing releases one block per
+ * ARENA_BLOCK_SIZE bytes.  Blocks double from ARENA_FIRST_BLOCK, so an
+ * arena holding a few words never costs an mmap. */
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t cap;
+} ArenaBlock; /* followed by cap bytes of storage */
+
+typedef struct
+{
+    ArenaBlock *head;     /* block currently allocated from */
+    unsigned long blocks; /* blocks allocated over the arena's life */
+} Arena;
+
+/* Robin Hood hash table: linear probing where an insert takes the slot of
+ * any entry closer to its home slot than the new one is, which keeps probe
+ * sequences short even at high load.  Grows by doubling.
+ *
+ * The entries are stored as a structure of arrays indexed by entry
+ * number, so a scan over every count (top K, merges) streams through
+ * contiguous memory and growing the slots never moves them.  Counts are
+ * 32 bits; the rare counter that wraps keeps its high bits in carries.
+ * Words are NUL-terminated strings at offsets into one pool. */
+typedef struct
+{
+    WordSlot *slots;
+    size_t mask; /* capacity - 1 */
+    size_t size; /* entries in use, numbered 0 to size - 1 */
+    unsigned gen;              /* current generation, never 0 */
+    size_t cap;                /* entries the arrays below have room for */
+    uint32_t *counts;          /* total occurrences, low 32 bits */
+    uint32_t *sentence_counts; /* sentences containing the word, low 32 bits */
+    uint32_t *doc_counts;      /* documents containing the word, low 32 bits; NULL but in a corpus table */
+    long *last_sentence_ids;   /* helper to avoid double counting within a sentence */
+    uint64_t *word_offs;       /* lower-case word in pool */
+    unsigned char *flags;      /* WORD_* bits */
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+    WordCarry *carries;
+    size_t ncarries;
+    size_t carries_cap;
+    unsigned long grows;      /* doublings so far */
+    unsigned long pool_grows; /* times the pool or the arrays were reallocated */
+} WordTable;
+
+#define SLOT_LIVE(t, e) ((e)->gen == (t)->gen)
+
+static WordTable word_table;
+static int shared_table; /* set by --shared-table (see shared_count()) */
+
+typedef struct SharedWorker SharedWorker;
+typedef struct ReadAhead ReadAhead;
+
+static unsigned char char_class[256];
+static unsigned char lower_table[256];
+
+/*
+ * Byte classification kernels.  classify_block() turns 64 input bytes
+ * into two bitmasks, bit i describing byte i: one for word (alnum) bytes
+ * and one for sentence terminators.  The lexer then walks word boundaries
+ * with bit operations instead of testing every byte.  SSE2 (x86-64
+ * baseline), AVX2 (picked at run time) and NEON (AArch64) versions sit in
+ * front of a table-driven scalar fallback; -DTOPIC_INDEX_NO_SIMD forces
+ * the fallback.  All of them treat only ASCII letters and digits as word
+ * bytes, as isalnum() does in the C locale, and flag bytes above 0x7f in
+ * a third mask: the lexer decodes those (see utf8_word_bits()) only in
+ * the windows where that mask is not empty.
+ */
+#if !defined(TOPIC_INDEX_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define TOPIC_INDEX_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(TOPIC_INDEX_HAVE_SSE2) && defined(__GNUC__)
+#define TOPIC_INDEX_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if !defined(TOPIC_INDEX_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define TOPIC_INDEX_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define CLASSIFY_WIDTH 64
+
+typedef void (*ClassifyFn)(const unsigned char *p, uint64_t *word, uint64_t *term, uint64_t *high);
+
+static void classify_scalar(const unsigned char *p, uint64_t *word, uint64_t *term, uint64_t *high)
+{
+    uint64_t w = 0, t = 0, h = 0;
+    int i;
+    for (i = CLASSIFY_WIDTH - 1; i >= 0; --i)
     {
-        h = ((h << 5) + h) + (unsigned long)c; /* h*33 + c */
+        unsigned cc = char_class[p[i]];
+        w = (w << 1) | (cc & CC_WORD);
+        t = (t << 1) | ((cc & CC_TERM) >> 1);
+        h = (h << 1) | (p[i] >> 7);
     }
-    return h % HASH_SIZE;
+    *word = w & ~h;
+    *term = t;
+    *high = h;
 }
 
-static void *xmalloc(size_t n)
+#ifdef TOPIC_INDEX_HAVE_SSE2
+/* bytes in [lo, lo + n): shift the range down to start at -128 so one
+ * signed compare does the unsigned range test */
+#define SSE2_IN_RANGE(v, lo, n) \
+    _mm_cmplt_epi8(_mm_add_epi8((v), _mm_set1_epi8((char)(0x80 - (lo)))), _mm_set1_epi8((char)((n) - 0x80)))
+
+static void classify_sse2(const unsigned char *p, uint64_t *word, uint64_t *term, uint64_t *high)
 {
-    void *p = malloc(n);
-    if (!p)
+    const __m128i fold = _mm_set1_epi8(0x20);
+    uint64_t w = 0, t = 0, h = 0;
+    int i;
+    for (i = 0; i < CLASSIFY_WIDTH; i += 16)
     {
-        fprintf(stderr, "topic_index: out of memory\n");
-        exit(EXIT_FAILURE);
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        __m128i alpha = SSE2_IN_RANGE(_mm_or_si128(v, fold), 'a', 26);
+        __m128i digit = SSE2_IN_RANGE(v, '0', 10);
+        __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+                                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('!'))),
+                                    _mm_cmpeq_epi8(v, _mm_set1_epi8('?')));
+        w |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_or_si128(alpha, digit)) << i;
+        t |= (uint64_t)(unsigned)_mm_movemask_epi8(stop) << i;
+        h |= (uint64_t)(unsigned)_mm_movemask_epi8(v) << i;
     }
-    return p;
+    *word = w;
+    *term = t;
+    *high = h;
 }
+#endif
 
-static int is_stop_word(const char *word)
+#ifdef TOPIC_INDEX_HAVE_AVX2
+#define AVX2_IN_RANGE(v, lo, n) \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)((n) - 0x80)), _mm256_add_epi8((v), _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+__attribute__((target("avx2"))) static void classify_avx2(const unsigned char *p, uint64_t *word, uint64_t *term,
+                                                          uint64_t *high)
+{
+    const __m256i fold = _mm256_set1_epi8(0x20);
+    uint64_t w = 0, t = 0, h = 0;
+    int i;
+    for (i = 0; i < CLASSIFY_WIDTH; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + i));
+        __m256i alpha = AVX2_IN_RANGE(_mm256_or_si256(v, fold), 'a', 26);
+        __m256i digit = AVX2_IN_RANGE(v, '0', 10);
+        __m256i stop = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('.')),
+                                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('!'))),
+                                       _mm256_cmpeq_epi8(v, _mm256_set1_epi8('?')));
+        w |= (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_or_si256(alpha, digit)) << i;
+        t |= (uint64_t)(unsigned)_mm256_movemask_epi8(stop) << i;
+        h |= (uint64_t)(unsigned)_mm256_movemask_epi8(v) << i;
+    }
+    *word = w;
+    *term = t;
+    *high = h;
+}
+#endif
+
+#ifdef TOPIC_INDEX_HAVE_NEON
+/* NEON has no movemask: weight each lane by its bit and add pairwise
+ * until the four 16-lane masks have become one 64-bit word */
+static uint64_t neon_movemask64(uint8x16_t m0, uint8x16_t m1, uint8x16_t m2, uint8x16_t m3)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t bits = vld1q_u8(weights);
+    uint8x16_t s0 = vpaddq_u8(vandq_u8(m0, bits), vandq_u8(m1, bits));
+    uint8x16_t s1 = vpaddq_u8(vandq_u8(m2, bits), vandq_u8(m3, bits));
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+
+static void classify_neon(const unsigned char *p, uint64_t *word, uint64_t *term, uint64_t *high)
+{
+    uint8x16_t w[4], t[4], h[4];
+    int i;
+    for (i = 0; i < 4; ++i)
+    {
+        uint8x16_t v = vld1q_u8(p + 16 * i);
+        uint8x16_t alpha = vcltq_u8(vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a')), vdupq_n_u8(26));
+        uint8x16_t digit = vcltq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(10));
+        w[i] = vorrq_u8(alpha, digit);
+        t[i] = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('.')), vceqq_u8(v, vdupq_n_u8('!'))),
+                        vceqq_u8(v, vdupq_n_u8('?')));
+        h[i] = vcgeq_u8(v, vdupq_n_u8(0x80));
+    }
+    *word = neon_movemask64(w[0], w[1], w[2], w[3]);
+    *term = neon_movemask64(t[0], t[1], t[2], t[3]);
+    *high = neon_movemask64(h[0], h[1], h[2], h[3]);
+}
+#endif
+
+static ClassifyFn classify_block = classify_scalar;
+
+/* Copy n bytes, lower-casing ASCII letters 16 at a time where possible */
+static void lower_copy(char *dst, const char *src, size_t n)
+{
+    size_t i = 0;
+#if defined(TOPIC_INDEX_HAVE_SSE2)
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(src + i));
+        __m128i upper = SSE2_IN_RANGE(v, 'A', 26);
+        _mm_storeu_si128((__m128i *)(void *)(dst + i), _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+    }
+#elif defined(TOPIC_INDEX_HAVE_NEON)
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t *)src + i);
+        uint8x16_t upper = vcltq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8(26));
+        vst1q_u8((uint8_t *)dst + i, vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20))));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = (char)lower_table[(unsigned char)src[i]];
+}
+
+/* index of the lowest set bit; m must not be 0 */
+static unsigned lowest_bit(uint64_t m)
+{
+#if defined(__GNUC__)
+    return (unsigned)__builtin_ctzll(m);
+#else
+    unsigned n = 0;
+    while (!(m & 1))
+    {
+        m >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+/*
+ * UTF-8 words.  Unless --ascii is given, a multi-byte sequence is part of
+ * a word when it decodes to a letter, mark or number, and words are
+ * compared after simple case folding (so "Über" and "über" are one word).
+ * The tables below are searched only to fill flat maps on first use and
+ * for rare code points: the Basic Multilingual Plane has a flat word bitmap, case
+ * folding below UTF8_FOLD_FAST (Latin, Greek, Cyrillic, Armenian) a flat
+ * map, and 256-code-point pages without any folding – CJK, Hangul, most
+ * scripts – a bit that skips the search.  Malformed sequences separate
+ * words.
+ */
+#define UTF8_WORD_FAST 0x10000 /* code points in the word bitmap */
+#define UTF8_FOLD_FAST 0x800   /* code points in the flat fold map */
+
+/* Code points above ASCII that belong to words: Unicode general
+ * categories L (letters), M (marks) and N (numbers), as [first, last]
+ * ranges generated from the Unicode 14.0.0 character database */
+static const uint32_t UTF8_WORD_RANGES[][2] = {
+    {0xaa, 0xaa}, {0xb2, 0xb3}, {0xb5, 0xb5}, {0xb9, 0xba}, {0xbc, 0xbe}, {0xc0, 0xd6}, {0xd8, 0xf6}, {0xf8, 0x2c1},
+    {0x2c6, 0x2d1}, {0x2e0, 0x2e4}, {0x2ec, 0x2ec}, {0x2ee, 0x2ee}, {0x300, 0x374}, {0x376, 0x377}, {0x37a, 0x37d},
+    {0x37f, 0x37f}, {0x386, 0x386}, {0x388, 0x38a}, {0x38c, 0x38c}, {0x38e, 0x3a1}, {0x3a3, 0x3f5}, {0x3f7, 0x481},
+    {0x483, 0x52f}, {0x531, 0x556}, {0x559, 0x559}, {0x560, 0x588}, {0x591, 0x5bd}, {0x5bf, 0x5bf}, {0x5c1, 0x5c2},
+    {0x5c4, 0x5c5}, {0x5c7, 0x5c7}, {0x5d0, 0x5ea}, {0x5ef, 0x5f2}, {0x610, 0x61a}, {0x620, 0x669}, {0x66e, 0x6d3},
+    {0x6d5, 0x6dc}, {0x6df, 0x6e8}, {0x6ea, 0x6fc}, {0x6ff, 0x6ff}, {0x710, 0x74a}, {0x74d, 0x7b1}, {0x7c0, 0x7f5},
+    {0x7fa, 0x7fa}, {0x7fd, 0x7fd}, {0x800, 0x82d}, {0x840, 0x85b}, {0x860, 0x86a}, {0x870, 0x887}, {0x889, 0x88e},
+    {0x898, 0x8e1}, {0x8e3, 0x963}, {0x966, 0x96f}, {0x971, 0x983}, {0x985, 0x98c}, {0x98f, 0x990}, {0x993, 0x9a8},
+    {0x9aa, 0x9b0}, {0x9b2, 0x9b2}, {0x9b6, 0x9b9}, {0x9bc, 0x9c4}, {0x9c7, 0x9c8}, {0x9cb, 0x9ce}, {0x9d7, 0x9d7},
+    {0x9dc, 0x9dd}, {0x9df, 0x9e3}, {0x9e6, 0x9f1}, {0x9f4, 0x9f9}, {0x9fc, 0x9fc}, {0x9fe, 0x9fe}, {0xa01, 0xa03},
+    {0xa05, 0xa0a}, {0xa0f, 0xa10}, {0xa13, 0xa28}, {0xa2a, 0xa30}, {0xa32, 0xa33}, {0xa35, 0xa36}, {0xa38, 0xa39},
+    {0xa3c, 0xa3c}, {0xa3e, 0xa42}, {0xa47, 0xa48}, {0xa4b, 0xa4d}, {0xa51, 0xa51}, {0xa59, 0xa5c}, {0xa5e, 0xa5e},
+    {0xa66, 0xa75}, {0xa81, 0xa83}, {0xa85, 0xa8d}, {0xa8f, 0xa91}, {0xa93, 0xaa8}, {0xaaa, 0xab0}, {0xab2, 0xab3},
+    {0xab5, 0xab9}, {0xabc, 0xac5}, {0xac7, 0xac9}, {0xacb, 0xacd}, {0xad0, 0xad0}, {0xae0, 0xae3}, {0xae6, 0xaef},
+    {0xaf9, 0xaff}, {0xb01, 0xb03}, {0xb05, 0xb0c}, {0xb0f, 0xb10}, {0xb13, 0xb28}, {0xb2a, 0xb30}, {0xb32, 0xb33},
+    {0xb35, 0xb39}, {0xb3c, 0xb44}, {0xb47, 0xb48}, {0xb4b, 0xb4d}, {0xb55, 0xb57}, {0xb5c, 0xb5d}, {0xb5f, 0xb63},
+    {0xb66, 0xb6f}, {0xb71, 0xb77}, {0xb82, 0xb83}, {0xb85, 0xb8a}, {0xb8e, 0xb90}, {0xb92, 0xb95}, {0xb99, 0xb9a},
+    {0xb9c, 0xb9c}, {0xb9e, 0xb9f}, {0xba3, 0xba4}, {0xba8, 0xbaa}, {0xbae, 0xbb9}, {0xbbe, 0xbc2}, {0xbc6, 0xbc8},
+    {0xbca, 0xbcd}, {0xbd0, 0xbd0}, {0xbd7, 0xbd7}, {0xbe6, 0xbf2}, {0xc00, 0xc0c}, {0xc0e, 0xc10}, {0xc12, 0xc28},
+    {0xc2a, 0xc39}, {0xc3c, 0xc44}, {0xc46, 0xc48}, {0xc4a, 0xc4d}, {0xc55, 0xc56}, {0xc58, 0xc5a}, {0xc5d, 0xc5d},
+    {0xc60, 0xc63}, {0xc66, 0xc6f}, {0xc78, 0xc7e}, {0xc80, 0xc83}, {0xc85, 0xc8c}, {0xc8e, 0xc90}, {0xc92, 0xca8},
+    {0xcaa, 0xcb3}, {0xcb5, 0xcb9}, {0xcbc, 0xcc4}, {0xcc6, 0xcc8}, {0xcca, 0xccd}, {0xcd5, 0xcd6}, {0xcdd, 0xcde},
+    {0xce0, 0xce3}, {0xce6, 0xcef}, {0xcf1, 0xcf2}, {0xd00, 0xd0c}, {0xd0e, 0xd10}, {0xd12, 0xd44}, {0xd46, 0xd48},
+    {0xd4a, 0xd4e}, {0xd54, 0xd63}, {0xd66, 0xd78}, {0xd7a, 0xd7f}, {0xd81, 0xd83}, {0xd85, 0xd96}, {0xd9a, 0xdb1},
+    {0xdb3, 0xdbb}, {0xdbd, 0xdbd}, {0xdc0, 0xdc6}, {0xdca, 0xdca}, {0xdcf, 0xdd4}, {0xdd6, 0xdd6}, {0xdd8, 0xddf},
+    {0xde6, 0xdef}, {0xdf2, 0xdf3}, {0xe01, 0xe3a}, {0xe40, 0xe4e}, {0xe50, 0xe59}, {0xe81, 0xe82}, {0xe84, 0xe84},
+    {0xe86, 0xe8a}, {0xe8c, 0xea3}, {0xea5, 0xea5}, {0xea7, 0xebd}, {0xec0, 0xec4}, {0xec6, 0xec6}, {0xec8, 0xecd},
+    {0xed0, 0xed9}, {0xedc, 0xedf}, {0xf00, 0xf00}, {0xf18, 0xf19}, {0xf20, 0xf33}, {0xf35, 0xf35}, {0xf37, 0xf37},
+    {0xf39, 0xf39}, {0xf3e, 0xf47}, {0xf49, 0xf6c}, {0xf71, 0xf84}, {0xf86, 0xf97}, {0xf99, 0xfbc}, {0xfc6, 0xfc6},
+    {0x1000, 0x1049}, {0x1050, 0x109d}, {0x10a0, 0x10c5}, {0x10c7, 0x10c7}, {0x10cd, 0x10cd}, {0x10d0, 0x10fa},
+    {0x10fc, 0x1248}, {0x124a, 0x124d}, {0x1250, 0x1256}, {0x1258, 0x1258}, {0x125a, 0x125d}, {0x1260, 0x1288},
+    {0x128a, 0x128d}, {0x1290, 0x12b0}, {0x12b2, 0x12b5}, {0x12b8, 0x12be}, {0x12c0, 0x12c0}, {0x12c2, 0x12c5},
+    {0x12c8, 0x12d6}, {0x12d8, 0x1310}, {0x1312, 0x1315}, {0x1318, 0x135a}, {0x135d, 0x135f}, {0x1369, 0x137c},
+    {0x1380, 0x138f}, {0x13a0, 0x13f5}, {0x13f8, 0x13fd}, {0x1401, 0x166c}, {0x166f, 0x167f}, {0x1681, 0x169a},
+    {0x16a0, 0x16ea}, {0x16ee, 0x16f8}, {0x1700, 0x1715}, {0x171f, 0x1734}, {0x1740, 0x1753}, {0x1760, 0x176c},
+    {0x176e, 0x1770}, {0x1772, 0x1773}, {0x1780, 0x17d3}, {0x17d7, 0x17d7}, {0x17dc, 0x17dd}, {0x17e0, 0x17e9},
+    {0x17f0, 0x17f9}, {0x180b, 0x180d}, {0x180f, 0x1819}, {0x1820, 0x1878}, {0x1880, 0x18aa}, {0x18b0, 0x18f5},
+    {0x1900, 0x191e}, {0x1920, 0x192b}, {0x1930, 0x193b}, {0x1946, 0x196d}, {0x1970, 0x1974}, {0x1980, 0x19ab},
+    {0x19b0, 0x19c9}, {0x19d0, 0x19da}, {0x1a00, 0x1a1b}, {0x1a20, 0x1a5e}, {0x1a60, 0x1a7c}, {0x1a7f, 0x1a89},
+    {0x1a90, 0x1a99}, {0x1aa7, 0x1aa7}, {0x1ab0, 0x1ace}, {0x1b00, 0x1b4c}, {0x1b50, 0x1b59}, {0x1b6b, 0x1b73},
+    {0x1b80, 0x1bf3}, {0x1c00, 0x1c37}, {0x1c40, 0x1c49}, {0x1c4d, 0x1c7d}, {0x1c80, 0x1c88}, {0x1c90, 0x1cba},
+    {0x1cbd, 0x1cbf}, {0x1cd0, 0x1cd2}, {0x1cd4, 0x1cfa}, {0x1d00, 0x1f15}, {0x1f18, 0x1f1d}, {0x1f20, 0x1f45},
+    {0x1f48, 0x1f4d}, {0x1f50, 0x1f57}, {0x1f59, 0x1f59}, {0x1f5b, 0x1f5b}, {0x1f5d, 0x1f5d}, {0x1f5f, 0x1f7d},
+    {0x1f80, 0x1fb4}, {0x1fb6, 0x1fbc}, {0x1fbe, 0x1fbe}, {0x1fc2, 0x1fc4}, {0x1fc6, 0x1fcc}, {0x1fd0, 0x1fd3},
+    {0x1fd6, 0x1fdb}, {0x1fe0, 0x1fec}, {0x1ff2, 0x1ff4}, {0x1ff6, 0x1ffc}, {0x2070, 0x2071}, {0x2074, 0x2079},
+    {0x207f, 0x2089}, {0x2090, 0x209c}, {0x20d0, 0x20f0}, {0x2102, 0x2102}, {0x2107, 0x2107}, {0x210a, 0x2113},
+    {0x2115, 0x2115}, {0x2119, 0x211d}, {0x2124, 0x2124}, {0x2126, 0x2126}, {0x2128, 0x2128}, {0x212a, 0x212d},
+    {0x212f, 0x2139}, {0x213c, 0x213f}, {0x2145, 0x2149}, {0x214e, 0x214e}, {0x2150, 0x2189}, {0x2460, 0x249b},
+    {0x24ea, 0x24ff}, {0x2776, 0x2793}, {0x2c00, 0x2ce4}, {0x2ceb, 0x2cf3}, {0x2cfd, 0x2cfd}, {0x2d00, 0x2d25},
+    {0x2d27, 0x2d27}, {0x2d2d, 0x2d2d}, {0x2d30, 0x2d67}, {0x2d6f, 0x2d6f}, {0x2d7f, 0x2d96}, {0x2da0, 0x2da6},
+    {0x2da8, 0x2dae}, {0x2db0, 0x2db6}, {0x2db8, 0x2dbe}, {0x2dc0, 0x2dc6}, {0x2dc8, 0x2dce}, {0x2dd0, 0x2dd6},
+    {0x2dd8, 0x2dde}, {0x2de0, 0x2dff}, {0x2e2f, 0x2e2f}, {0x3005, 0x3007}, {0x3021, 0x302f}, {0x3031, 0x3035},
+    {0x3038, 0x303c}, {0x3041, 0x3096}, {0x3099, 0x309a}, {0x309d, 0x309f}, {0x30a1, 0x30fa}, {0x30fc, 0x30ff},
+    {0x3105, 0x312f}, {0x3131, 0x318e}, {0x3192, 0x3195}, {0x31a0, 0x31bf}, {0x31f0, 0x31ff}, {0x3220, 0x3229},
+    {0x3248, 0x324f}, {0x3251, 0x325f}, {0x3280, 0x3289}, {0x32b1, 0x32bf}, {0x3400, 0x4dbf}, {0x4e00, 0xa48c},
+    {0xa4d0, 0xa4fd}, {0xa500, 0xa60c}, {0xa610, 0xa62b}, {0xa640, 0xa672}, {0xa674, 0xa67d}, {0xa67f, 0xa6f1},
+    {0xa717, 0xa71f}, {0xa722, 0xa788}, {0xa78b, 0xa7ca}, {0xa7d0, 0xa7d1}, {0xa7d3, 0xa7d3}, {0xa7d5, 0xa7d9},
+    {0xa7f2, 0xa827}, {0xa82c, 0xa82c}, {0xa830, 0xa835}, {0xa840, 0xa873}, {0xa880, 0xa8c5}, {0xa8d0, 0xa8d9},
+    {0xa8e0, 0xa8f7}, {0xa8fb, 0xa8fb}, {0xa8fd, 0xa92d}, {0xa930, 0xa953}, {0xa960, 0xa97c}, {0xa980, 0xa9c0},
+    {0xa9cf, 0xa9d9}, {0xa9e0, 0xa9fe}, {0xaa00, 0xaa36}, {0xaa40, 0xaa4d}, {0xaa50, 0xaa59}, {0xaa60, 0xaa76},
+    {0xaa7a, 0xaac2}, {0xaadb, 0xaadd}, {0xaae0, 0xaaef}, {0xaaf2, 0xaaf6}, {0xab01, 0xab06}, {0xab09, 0xab0e},
+    {0xab11, 0xab16}, {0xab20, 0xab26}, {0xab28, 0xab2e}, {0xab30, 0xab5a}, {0xab5c, 0xab69}, {0xab70, 0xabea},
+    {0xabec, 0xabed}, {0xabf0, 0xabf9}, {0xac00, 0xd7a3}, {0xd7b0, 0xd7c6}, {0xd7cb, 0xd7fb}, {0xf900, 0xfa6d},
+    {0xfa70, 0xfad9}, {0xfb00, 0xfb06}, {0xfb13, 0xfb17}, {0xfb1d, 0xfb28}, {0xfb2a, 0xfb36}, {0xfb38, 0xfb3c},
+    {0xfb3e, 0xfb3e}, {0xfb40, 0xfb41}, {0xfb43, 0xfb44}, {0xfb46, 0xfbb1}, {0xfbd3, 0xfd3d}, {0xfd50, 0xfd8f},
+    {0xfd92, 0xfdc7}, {0xfdf0, 0xfdfb}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfe70, 0xfe74}, {0xfe76, 0xfefc},
+    {0xff10, 0xff19}, {0xff21, 0xff3a}, {0xff41, 0xff5a}, {0xff66, 0xffbe}, {0xffc2, 0xffc7}, {0xffca, 0xffcf},
+    {0xffd2, 0xffd7}, {0xffda, 0xffdc}, {0x10000, 0x1000b}, {0x1000d, 0x10026}, {0x10028, 0x1003a},
+    {0x1003c, 0x1003d}, {0x1003f, 0x1004d}, {0x10050, 0x1005d}, {0x10080, 0x100fa}, {0x10107, 0x10133},
+    {0x10140, 0x10178}, {0x1018a, 0x1018b}, {0x101fd, 0x101fd}, {0x10280, 0x1029c}, {0x102a0, 0x102d0},
+    {0x102e0, 0x102fb}, {0x10300, 0x10323}, {0x1032d, 0x1034a}, {0x10350, 0x1037a}, {0x10380, 0x1039d},
+    {0x103a0, 0x103c3}, {0x103c8, 0x103cf}, {0x103d1, 0x103d5}, {0x10400, 0x1049d}, {0x104a0, 0x104a9},
+    {0x104b0, 0x104d3}, {0x104d8, 0x104fb}, {0x10500, 0x10527}, {0x10530, 0x10563}, {0x10570, 0x1057a},
+    {0x1057c, 0x1058a}, {0x1058c, 0x10592}, {0x10594, 0x10595}, {0x10597, 0x105a1}, {0x105a3, 0x105b1},
+    {0x105b3, 0x105b9}, {0x105bb, 0x105bc}, {0x10600, 0x10736}, {0x10740, 0x10755}, {0x10760, 0x10767},
+    {0x10780, 0x10785}, {0x10787, 0x107b0}, {0x107b2, 0x107ba}, {0x10800, 0x10805}, {0x10808, 0x10808},
+    {0x1080a, 0x10835}, {0x10837, 0x10838}, {0x1083c, 0x1083c}, {0x1083f, 0x10855}, {0x10858, 0x10876},
+    {0x10879, 0x1089e}, {0x108a7, 0x108af}, {0x108e0, 0x108f2}, {0x108f4, 0x108f5}, {0x108fb, 0x1091b},
+    {0x10920, 0x10939}, {0x10980, 0x109b7}, {0x109bc, 0x109cf}, {0x109d2, 0x10a03}, {0x10a05, 0x10a06},
+    {0x10a0c, 0x10a13}, {0x10a15, 0x10a17}, {0x10a19, 0x10a35}, {0x10a38, 0x10a3a}, {0x10a3f, 0x10a48},
+    {0x10a60, 0x10a7e}, {0x10a80, 0x10a9f}, {0x10ac0, 0x10ac7}, {0x10ac9, 0x10ae6}, {0x10aeb, 0x10aef},
+    {0x10b00, 0x10b35}, {0x10b40, 0x10b55}, {0x10b58, 0x10b72}, {0x10b78, 0x10b91}, {0x10ba9, 0x10baf},
+    {0x10c00, 0x10c48}, {0x10c80, 0x10cb2}, {0x10cc0, 0x10cf2}, {0x10cfa, 0x10d27}, {0x10d30, 0x10d39},
+    {0x10e60, 0x10e7e}, {0x10e80, 0x10ea9}, {0x10eab, 0x10eac}, {0x10eb0, 0x10eb1}, {0x10f00, 0x10f27},
+    {0x10f30, 0x10f54}, {0x10f70, 0x10f85}, {0x10fb0, 0x10fcb}, {0x10fe0, 0x10ff6}, {0x11000, 0x11046},
+    {0x11052, 0x11075}, {0x1107f, 0x110ba}, {0x110c2, 0x110c2}, {0x110d0, 0x110e8}, {0x110f0, 0x110f9},
+    {0x11100, 0x11134}, {0x11136, 0x1113f}, {0x11144, 0x11147}, {0x11150, 0x11173}, {0x11176, 0x11176},
+    {0x11180, 0x111c4}, {0x111c9, 0x111cc}, {0x111ce, 0x111da}, {0x111dc, 0x111dc}, {0x111e1, 0x111f4},
+    {0x11200, 0x11211}, {0x11213, 0x11237}, {0x1123e, 0x1123e}, {0x11280, 0x11286}, {0x11288, 0x11288},
+    {0x1128a, 0x1128d}, {0x1128f, 0x1129d}, {0x1129f, 0x112a8}, {0x112b0, 0x112ea}, {0x112f0, 0x112f9},
+    {0x11300, 0x11303}, {0x11305, 0x1130c}, {0x1130f, 0x11310}, {0x11313, 0x11328}, {0x1132a, 0x11330},
+    {0x11332, 0x11333}, {0x11335, 0x11339}, {0x1133b, 0x11344}, {0x11347, 0x11348}, {0x1134b, 0x1134d},
+    {0x11350, 0x11350}, {0x11357, 0x11357}, {0x1135d, 0x11363}, {0x11366, 0x1136c}, {0x11370, 0x11374},
+    {0x11400, 0x1144a}, {0x11450, 0x11459}, {0x1145e, 0x11461}, {0x11480, 0x114c5}, {0x114c7, 0x114c7},
+    {0x114d0, 0x114d9}, {0x11580, 0x115b5}, {0x115b8, 0x115c0}, {0x115d8, 0x115dd}, {0x11600, 0x11640},
+    {0x11644, 0x11644}, {0x11650, 0x11659}, {0x11680, 0x116b8}, {0x116c0, 0x116c9}, {0x11700, 0x1171a},
+    {0x1171d, 0x1172b}, {0x11730, 0x1173b}, {0x11740, 0x11746}, {0x11800, 0x1183a}, {0x118a0, 0x118f2},
+    {0x118ff, 0x11906}, {0x11909, 0x11909}, {0x1190c, 0x11913}, {0x11915, 0x11916}, {0x11918, 0x11935},
+    {0x11937, 0x11938}, {0x1193b, 0x11943}, {0x11950, 0x11959}, {0x119a0, 0x119a7}, {0x119aa, 0x119d7},
+    {0x119da, 0x119e1}, {0x119e3, 0x119e4}, {0x11a00, 0x11a3e}, {0x11a47, 0x11a47}, {0x11a50, 0x11a99},
+    {0x11a9d, 0x11a9d}, {0x11ab0, 0x11af8}, {0x11c00, 0x11c08}, {0x11c0a, 0x11c36}, {0x11c38, 0x11c40},
+    {0x11c50, 0x11c6c}, {0x11c72, 0x11c8f}, {0x11c92, 0x11ca7}, {0x11ca9, 0x11cb6}, {0x11d00, 0x11d06},
+    {0x11d08, 0x11d09}, {0x11d0b, 0x11d36}, {0x11d3a, 0x11d3a}, {0x11d3c, 0x11d3d}, {0x11d3f, 0x11d47},
+    {0x11d50, 0x11d59}, {0x11d60, 0x11d65}, {0x11d67, 0x11d68}, {0x11d6a, 0x11d8e}, {0x11d90, 0x11d91},
+    {0x11d93, 0x11d98}, {0x11da0, 0x11da9}, {0x11ee0, 0x11ef6}, {0x11fb0, 0x11fb0}, {0x11fc0, 0x11fd4},
+    {0x12000, 0x12399}, {0x12400, 0x1246e}, {0x12480, 0x12543}, {0x12f90, 0x12ff0}, {0x13000, 0x1342e},
+    {0x14400, 0x14646}, {0x16800, 0x16a38}, {0x16a40, 0x16a5e}, {0x16a60, 0x16a69}, {0x16a70, 0x16abe},
+    {0x16ac0, 0x16ac9}, {0x16ad0, 0x16aed}, {0x16af0, 0x16af4}, {0x16b00, 0x16b36}, {0x16b40, 0x16b43},
+    {0x16b50, 0x16b59}, {0x16b5b, 0x16b61}, {0x16b63, 0x16b77}, {0x16b7d, 0x16b8f}, {0x16e40, 0x16e96},
+    {0x16f00, 0x16f4a}, {0x16f4f, 0x16f87}, {0x16f8f, 0x16f9f}, {0x16fe0, 0x16fe1}, {0x16fe3, 0x16fe4},
+    {0x16ff0, 0x16ff1}, {0x17000, 0x187f7}, {0x18800, 0x18cd5}, {0x18d00, 0x18d08}, {0x1aff0, 0x1aff3},
+    {0x1aff5, 0x1affb}, {0x1affd, 0x1affe}, {0x1b000, 0x1b122}, {0x1b150, 0x1b152}, {0x1b164, 0x1b167},
+    {0x1b170, 0x1b2fb}, {0x1bc00, 0x1bc6a}, {0x1bc70, 0x1bc7c}, {0x1bc80, 0x1bc88}, {0x1bc90, 0x1bc99},
+    {0x1bc9d, 0x1bc9e}, {0x1cf00, 0x1cf2d}, {0x1cf30, 0x1cf46}, {0x1d165, 0x1d169}, {0x1d16d, 0x1d172},
+    {0x1d17b, 0x1d182}, {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0x1d242, 0x1d244}, {0x1d2e0, 0x1d2f3},
+    {0x1d360, 0x1d378}, {0x1d400, 0x1d454}, {0x1d456, 0x1d49c}, {0x1d49e, 0x1d49f}, {0x1d4a2, 0x1d4a2},
+    {0x1d4a5, 0x1d4a6}, {0x1d4a9, 0x1d4ac}, {0x1d4ae, 0x1d4b9}, {0x1d4bb, 0x1d4bb}, {0x1d4bd, 0x1d4c3},
+    {0x1d4c5, 0x1d505}, {0x1d507, 0x1d50a}, {0x1d50d, 0x1d514}, {0x1d516, 0x1d51c}, {0x1d51e, 0x1d539},
+    {0x1d53b, 0x1d53e}, {0x1d540, 0x1d544}, {0x1d546, 0x1d546}, {0x1d54a, 0x1d550}, {0x1d552, 0x1d6a5},
+    {0x1d6a8, 0x1d6c0}, {0x1d6c2, 0x1d6da}, {0x1d6dc, 0x1d6fa}, {0x1d6fc, 0x1d714}, {0x1d716, 0x1d734},
+    {0x1d736, 0x1d74e}, {0x1d750, 0x1d76e}, {0x1d770, 0x1d788}, {0x1d78a, 0x1d7a8}, {0x1d7aa, 0x1d7c2},
+    {0x1d7c4, 0x1d7cb}, {0x1d7ce, 0x1d7ff}, {0x1da00, 0x1da36}, {0x1da3b, 0x1da6c}, {0x1da75, 0x1da75},
+    {0x1da84, 0x1da84}, {0x1da9b, 0x1da9f}, {0x1daa1, 0x1daaf}, {0x1df00, 0x1df1e}, {0x1e000, 0x1e006},
+    {0x1e008, 0x1e018}, {0x1e01b, 0x1e021}, {0x1e023, 0x1e024}, {0x1e026, 0x1e02a}, {0x1e100, 0x1e12c},
+    {0x1e130, 0x1e13d}, {0x1e140, 0x1e149}, {0x1e14e, 0x1e14e}, {0x1e290, 0x1e2ae}, {0x1e2c0, 0x1e2f9},
+    {0x1e7e0, 0x1e7e6}, {0x1e7e8, 0x1e7eb}, {0x1e7ed, 0x1e7ee}, {0x1e7f0, 0x1e7fe}, {0x1e800, 0x1e8c4},
+    {0x1e8c7, 0x1e8d6}, {0x1e900, 0x1e94b}, {0x1e950, 0x1e959}, {0x1ec71, 0x1ecab}, {0x1ecad, 0x1ecaf},
+    {0x1ecb1, 0x1ecb4}, {0x1ed01, 0x1ed2d}, {0x1ed2f, 0x1ed3d}, {0x1ee00, 0x1ee03}, {0x1ee05, 0x1ee1f},
+    {0x1ee21, 0x1ee22}, {0x1ee24, 0x1ee24}, {0x1ee27, 0x1ee27}, {0x1ee29, 0x1ee32}, {0x1ee34, 0x1ee37},
+    {0x1ee39, 0x1ee39}, {0x1ee3b, 0x1ee3b}, {0x1ee42, 0x1ee42}, {0x1ee47, 0x1ee47}, {0x1ee49, 0x1ee49},
+    {0x1ee4b, 0x1ee4b}, {0x1ee4d, 0x1ee4f}, {0x1ee51, 0x1ee52}, {0x1ee54, 0x1ee54}, {0x1ee57, 0x1ee57},
+    {0x1ee59, 0x1ee59}, {0x1ee5b, 0x1ee5b}, {0x1ee5d, 0x1ee5d}, {0x1ee5f, 0x1ee5f}, {0x1ee61, 0x1ee62},
+    {0x1ee64, 0x1ee64}, {0x1ee67, 0x1ee6a}, {0x1ee6c, 0x1ee72}, {0x1ee74, 0x1ee77}, {0x1ee79, 0x1ee7c},
+    {0x1ee7e, 0x1ee7e}, {0x1ee80, 0x1ee89}, {0x1ee8b, 0x1ee9b}, {0x1eea1, 0x1eea3}, {0x1eea5, 0x1eea9},
+    {0x1eeab, 0x1eebb}, {0x1f100, 0x1f10c}, {0x1fbf0, 0x1fbf9}, {0x20000, 0x2a6df}, {0x2a700, 0x2b738},
+    {0x2b740, 0x2b81d}, {0x2b820, 0x2cea1}, {0x2ceb0, 0x2ebe0}, {0x2f800, 0x2fa1d}, {0x30000, 0x3134a},
+    {0xe0100, 0xe01ef}
+};
+
+/* Simple case folding (CaseFolding.txt status C and S) as runs
+ * {first, last, delta, step}: every step-th code point from first to last
+ * folds to itself plus delta */
+static const int32_t UTF8_FOLD_RUNS[][4] = {
+    {0xb5, 0xb5, 775, 1}, {0xc0, 0xd6, 32, 1}, {0xd8, 0xde, 32, 1}, {0x100, 0x12e, 1, 2}, {0x132, 0x136, 1, 2},
+    {0x139, 0x147, 1, 2}, {0x14a, 0x176, 1, 2}, {0x178, 0x178, -121, 1}, {0x179, 0x17d, 1, 2},
+    {0x17f, 0x17f, -268, 1}, {0x181, 0x181, 210, 1}, {0x182, 0x184, 1, 2}, {0x186, 0x186, 206, 1},
+    {0x187, 0x187, 1, 1}, {0x189, 0x18a, 205, 1}, {0x18b, 0x18b, 1, 1}, {0x18e, 0x18e, 79, 1}, {0x18f, 0x18f, 202, 1},
+    {0x190, 0x190, 203, 1}, {0x191, 0x191, 1, 1}, {0x193, 0x193, 205, 1}, {0x194, 0x194, 207, 1},
+    {0x196, 0x196, 211, 1}, {0x197, 0x197, 209, 1}, {0x198, 0x198, 1, 1}, {0x19c, 0x19c, 211, 1},
+    {0x19d, 0x19d, 213, 1}, {0x19f, 0x19f, 214, 1}, {0x1a0, 0x1a4, 1, 2}, {0x1a6, 0x1a6, 218, 1},
+    {0x1a7, 0x1a7, 1, 1}, {0x1a9, 0x1a9, 218, 1}, {0x1ac, 0x1ac, 1, 1}, {0x1ae, 0x1ae, 218, 1}, {0x1af, 0x1af, 1, 1},
+    {0x1b1, 0x1b2, 217, 1}, {0x1b3, 0x1b5, 1, 2}, {0x1b7, 0x1b7, 219, 1}, {0x1b8, 0x1b8, 1, 1}, {0x1bc, 0x1bc, 1, 1},
+    {0x1c4, 0x1c4, 2, 1}, {0x1c5, 0x1c5, 1, 1}, {0x1c7, 0x1c7, 2, 1}, {0x1c8, 0x1c8, 1, 1}, {0x1ca, 0x1ca, 2, 1},
+    {0x1cb, 0x1db, 1, 2}, {0x1de, 0x1ee, 1, 2}, {0x1f1, 0x1f1, 2, 1}, {0x1f2, 0x1f4, 1, 2}, {0x1f6, 0x1f6, -97, 1},
+    {0x1f7, 0x1f7, -56, 1}, {0x1f8, 0x21e, 1, 2}, {0x220, 0x220, -130, 1}, {0x222, 0x232, 1, 2},
+    {0x23a, 0x23a, 10795, 1}, {0x23b, 0x23b, 1, 1}, {0x23d, 0x23d, -163, 1}, {0x23e, 0x23e, 10792, 1},
+    {0x241, 0x241, 1, 1}, {0x243, 0x243, -195, 1}, {0x244, 0x244, 69, 1}, {0x245, 0x245, 71, 1}, {0x246, 0x24e, 1, 2},
+    {0x345, 0x345, 116, 1}, {0x370, 0x372, 1, 2}, {0x376, 0x376, 1, 1}, {0x37f, 0x37f, 116, 1}, {0x386, 0x386, 38, 1},
+    {0x388, 0x38a, 37, 1}, {0x38c, 0x38c, 64, 1}, {0x38e, 0x38f, 63, 1}, {0x391, 0x3a1, 32, 1}, {0x3a3, 0x3ab, 32, 1},
+    {0x3c2, 0x3c2, 1, 1}, {0x3cf, 0x3cf, 8, 1}, {0x3d0, 0x3d0, -30, 1}, {0x3d1, 0x3d1, -25, 1},
+    {0x3d5, 0x3d5, -15, 1}, {0x3d6, 0x3d6, -22, 1}, {0x3d8, 0x3ee, 1, 2}, {0x3f0, 0x3f0, -54, 1},
+    {0x3f1, 0x3f1, -48, 1}, {0x3f4, 0x3f4, -60, 1}, {0x3f5, 0x3f5, -64, 1}, {0x3f7, 0x3f7, 1, 1},
+    {0x3f9, 0x3f9, -7, 1}, {0x3fa, 0x3fa, 1, 1}, {0x3fd, 0x3ff, -130, 1}, {0x400, 0x40f, 80, 1},
+    {0x410, 0x42f, 32, 1}, {0x460, 0x480, 1, 2}, {0x48a, 0x4be, 1, 2}, {0x4c0, 0x4c0, 15, 1}, {0x4c1, 0x4cd, 1, 2},
+    {0x4d0, 0x52e, 1, 2}, {0x531, 0x556, 48, 1}, {0x10a0, 0x10c5, 7264, 1}, {0x10c7, 0x10c7, 7264, 1},
+    {0x10cd, 0x10cd, 7264, 1}, {0x13f8, 0x13fd, -8, 1}, {0x1c80, 0x1c80, -6222, 1}, {0x1c81, 0x1c81, -6221, 1},
+    {0x1c82, 0x1c82, -6212, 1}, {0x1c83, 0x1c84, -6210, 1}, {0x1c85, 0x1c85, -6211, 1}, {0x1c86, 0x1c86, -6204, 1},
+    {0x1c87, 0x1c87, -6180, 1}, {0x1c88, 0x1c88, 35267, 1}, {0x1c90, 0x1cba, -3008, 1}, {0x1cbd, 0x1cbf, -3008, 1},
+    {0x1e00, 0x1e94, 1, 2}, {0x1e9b, 0x1e9b, -58, 1}, {0x1e9e, 0x1e9e, -7615, 1}, {0x1ea0, 0x1efe, 1, 2},
+    {0x1f08, 0x1f0f, -8, 1}, {0x1f18, 0x1f1d, -8, 1}, {0x1f28, 0x1f2f, -8, 1}, {0x1f38, 0x1f3f, -8, 1},
+    {0x1f48, 0x1f4d, -8, 1}, {0x1f59, 0x1f5f, -8, 2}, {0x1f68, 0x1f6f, -8, 1}, {0x1f88, 0x1f8f, -8, 1},
+    {0x1f98, 0x1f9f, -8, 1}, {0x1fa8, 0x1faf, -8, 1}, {0x1fb8, 0x1fb9, -8, 1}, {0x1fba, 0x1fbb, -74, 1},
+    {0x1fbc, 0x1fbc, -9, 1}, {0x1fbe, 0x1fbe, -7173, 1}, {0x1fc8, 0x1fcb, -86, 1}, {0x1fcc, 0x1fcc, -9, 1},
+    {0x1fd8, 0x1fd9, -8, 1}, {0x1fda, 0x1fdb, -100, 1}, {0x1fe8, 0x1fe9, -8, 1}, {0x1fea, 0x1feb, -112, 1},
+    {0x1fec, 0x1fec, -7, 1}, {0x1ff8, 0x1ff9, -128, 1}, {0x1ffa, 0x1ffb, -126, 1}, {0x1ffc, 0x1ffc, -9, 1},
+    {0x2126, 0x2126, -7517, 1}, {0x212a, 0x212a, -8383, 1}, {0x212b, 0x212b, -8262, 1}, {0x2132, 0x2132, 28, 1},
+    {0x2160, 0x216f, 16, 1}, {0x2183, 0x2183, 1, 1}, {0x24b6, 0x24cf, 26, 1}, {0x2c00, 0x2c2f, 48, 1},
+    {0x2c60, 0x2c60, 1, 1}, {0x2c62, 0x2c62, -10743, 1}, {0x2c63, 0x2c63, -3814, 1}, {0x2c64, 0x2c64, -10727, 1},
+    {0x2c67, 0x2c6b, 1, 2}, {0x2c6d, 0x2c6d, -10780, 1}, {0x2c6e, 0x2c6e, -10749, 1}, {0x2c6f, 0x2c6f, -10783, 1},
+    {0x2c70, 0x2c70, -10782, 1}, {0x2c72, 0x2c72, 1, 1}, {0x2c75, 0x2c75, 1, 1}, {0x2c7e, 0x2c7f, -10815, 1},
+    {0x2c80, 0x2ce2, 1, 2}, {0x2ceb, 0x2ced, 1, 2}, {0x2cf2, 0x2cf2, 1, 1}, {0xa640, 0xa66c, 1, 2},
+    {0xa680, 0xa69a, 1, 2}, {0xa722, 0xa72e, 1, 2}, {0xa732, 0xa76e, 1, 2}, {0xa779, 0xa77b, 1, 2},
+    {0xa77d, 0xa77d, -35332, 1}, {0xa77e, 0xa786, 1, 2}, {0xa78b, 0xa78b, 1, 1}, {0xa78d, 0xa78d, -42280, 1},
+    {0xa790, 0xa792, 1, 2}, {0xa796, 0xa7a8, 1, 2}, {0xa7aa, 0xa7aa, -42308, 1}, {0xa7ab, 0xa7ab, -42319, 1},
+    {0xa7ac, 0xa7ac, -42315, 1}, {0xa7ad, 0xa7ad, -42305, 1}, {0xa7ae, 0xa7ae, -42308, 1},
+    {0xa7b0, 0xa7b0, -42258, 1}, {0xa7b1, 0xa7b1, -42282, 1}, {0xa7b2, 0xa7b2, -42261, 1}, {0xa7b3, 0xa7b3, 928, 1},
+    {0xa7b4, 0xa7c2, 1, 2}, {0xa7c4, 0xa7c4, -48, 1}, {0xa7c5, 0xa7c5, -42307, 1}, {0xa7c6, 0xa7c6, -35384, 1},
+    {0xa7c7, 0xa7c9, 1, 2}, {0xa7d0, 0xa7d0, 1, 1}, {0xa7d6, 0xa7d8, 1, 2}, {0xa7f5, 0xa7f5, 1, 1},
+    {0xab70, 0xabbf, -38864, 1}, {0xff21, 0xff3a, 32, 1}, {0x10400, 0x10427, 40, 1}, {0x104b0, 0x104d3, 40, 1},
+    {0x10570, 0x1057a, 39, 1}, {0x1057c, 0x1058a, 39, 1}, {0x1058c, 0x10592, 39, 1}, {0x10594, 0x10595, 39, 1},
+    {0x10c80, 0x10cb2, 64, 1}, {0x118a0, 0x118bf, 32, 1}, {0x16e40, 0x16e5f, 32, 1}, {0x1e900, 0x1e921, 34, 1}
+};
+
+static int utf8_words = 1;                                      /* cleared by --ascii */
+static unsigned char utf8_word_fast[UTF8_WORD_FAST / 8];        /* bit per code point */
+static unsigned char utf8_word_ready[UTF8_WORD_FAST / 256 / 8]; /* pages of utf8_word_fast filled in */
+static uint16_t utf8_fold_fast[UTF8_FOLD_FAST];
+static unsigned char utf8_fold_pages[0x110000 / 256 / 8]; /* pages with folding */
+static int utf8_fold_ready;                               /* utf8_fold_fast and _pages filled in */
+
+static int utf8_is_word_slow(uint32_t cp)
 {
-    const char **sw = STOP_WORDS;
-    while (*sw)
+    size_t lo = 0, hi = sizeof(UTF8_WORD_RANGES) / sizeof(UTF8_WORD_RANGES[0]);
+    while (lo < hi)
     {
-        if (strcmp(*sw, word) == 0)
+        size_t mid = (lo + hi) / 2;
+        if (cp < UTF8_WORD_RANGES[mid][0])
+            hi = mid;
+        else if (cp > UTF8_WORD_RANGES[mid][1])
+            lo = mid + 1;
+        else
             return 1;
-        ++sw;
     }
     return 0;
 }
 
-/* Obtain or create the word entry */
-static WordEntry *get_word_entry(const char *word, long current_sentence)
+static uint32_t utf8_fold_slow(uint32_t cp)
 {
-    unsigned long h = hash_word(word);
-    WordEntry *e = hash_table[h];
-    while (e)
+    size_t lo = 0, hi = sizeof(UTF8_FOLD_RUNS) / sizeof(UTF8_FOLD_RUNS[0]);
+    while (lo < hi)
     {
-        if (strcmp(e->word, word) == 0)
-            break;
-        e = e->next;
+        size_t mid = (lo + hi) / 2;
+        const int32_t *run = UTF8_FOLD_RUNS[mid];
+        if (cp < (uint32_t)run[0])
+            hi = mid;
+        else if (cp > (uint32_t)run[1])
+            lo = mid + 1;
+        else
+            return (cp - (uint32_t)run[0]) % (uint32_t)run[3] == 0 ? (uint32_t)((int32_t)cp + run[2]) : cp;
+    }
+    return cp;
+}
+
+/* The flat maps are filled on first use, the word bitmap one 256-code-
+ * point page at a time: building all of it costs more than counting a
+ * short document, and most text only ever looks up a page or two
+ * (punctuation, say).  Nothing here is locked, so utf8_maps_init() fills
+ * everything before any thread that may decode is started. */
+static void utf8_word_page(uint32_t page)
+{
+    size_t n = sizeof(UTF8_WORD_RANGES) / sizeof(UTF8_WORD_RANGES[0]);
+    size_t lo = 0, hi = n;
+    uint32_t first = page << 8, last = first + 255;
+    while (lo < hi)
+    {
+        /* first range that ends in or after the page */
+        size_t mid = (lo + hi) / 2;
+        if (UTF8_WORD_RANGES[mid][1] < first)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    if (!e)
+    for (; lo < n && UTF8_WORD_RANGES[lo][0] <= last; ++lo)
     {
-        e = (WordEntry *)xmalloc(sizeof(WordEntry));
-        e->word = strdup(word);
-        if (!e->word)
-        {
-            fprintf(stderr, "topic_index: out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-        e->count = 0;
-        e->sentence_count = 0;
-        e->last_sentence_id = -1;
-        e->next = hash_table[h];
-        hash_table[h] = e;
+        uint32_t cp = UTF8_WORD_RANGES[lo][0] > first ? UTF8_WORD_RANGES[lo][0] : first;
+        uint32_t end = UTF8_WORD_RANGES[lo][1] < last ? UTF8_WORD_RANGES[lo][1] : last;
+        for (; cp <= end; ++cp)
+            utf8_word_fast[cp >> 3] |= (unsigned char)(1u << (cp & 7));
     }
+    utf8_word_ready[page >> 3] |= (unsigned char)(1u << (page & 7));
+}
 
-    /* update counts */
-    e->count += 1;
-    if (e->last_sentence_id != current_sentence)
+static void utf8_fold_init(void)
+{
+    size_t i;
+    uint32_t cp;
+    for (i = 0; i < sizeof(UTF8_FOLD_RUNS) / sizeof(UTF8_FOLD_RUNS[0]); ++i)
+        for (cp = (uint32_t)UTF8_FOLD_RUNS[i][0] >> 8; cp <= (uint32_t)UTF8_FOLD_RUNS[i][1] >> 8; ++cp)
+            utf8_fold_pages[cp >> 3] |= (unsigned char)(1u << (cp & 7));
+    for (cp = 0; cp < UTF8_FOLD_FAST; ++cp)
+        utf8_fold_fast[cp] = (uint16_t)cp;
+    for (i = 0; i < sizeof(UTF8_FOLD_RUNS) / sizeof(UTF8_FOLD_RUNS[0]) && UTF8_FOLD_RUNS[i][0] < UTF8_FOLD_FAST; ++i)
     {
-        e->sentence_count += 1;
-        e->last_sentence_id = current_sentence;
+        const int32_t *run = UTF8_FOLD_RUNS[i];
+        for (cp = (uint32_t)run[0]; cp <= (uint32_t)run[1] && cp < UTF8_FOLD_FAST; cp += (uint32_t)run[3])
+            utf8_fold_fast[cp] = (uint16_t)((int32_t)cp + run[2]);
     }
-    return e;
+    utf8_fold_ready = 1;
+}
+
+static void utf8_maps_init(void)
+{
+    uint32_t page;
+    for (page = 0; page < UTF8_WORD_FAST >> 8; ++page)
+        if (!((utf8_word_ready[page >> 3] >> (page & 7)) & 1))
+            utf8_word_page(page);
+    if (!utf8_fold_ready)
+        utf8_fold_init();
 }
 
-static void free_hash_table(void)
+static int utf8_is_word(uint32_t cp)
 {
-    unsigned long i;
-    for (i = 0; i < HASH_SIZE; ++i)
+    if (cp < UTF8_WORD_FAST)
     {
-        WordEntry *e = hash_table[i];
-        while (e)
-        {
-            WordEntry *next = e->next;
-            free(e->word);
-            free(e);
-            e = next;
-        }
+        if (!((utf8_word_ready[cp >> 11] >> ((cp >> 8) & 7)) & 1))
+            utf8_word_page(cp >> 8);
+        return (utf8_word_fast[cp >> 3] >> (cp & 7)) & 1;
     }
+    return utf8_is_word_slow(cp);
 }
 
-/* Structure used for sorting the top words */
-typedef struct
+static uint32_t utf8_fold(uint32_t cp)
 {
-    WordEntry *entry;
-} WordPtr;
+    if (!utf8_fold_ready)
+        utf8_fold_init();
+    if (cp < UTF8_FOLD_FAST)
+        return utf8_fold_fast[cp];
+    if (!((utf8_fold_pages[cp >> 11] >> ((cp >> 8) & 7)) & 1))
+        return cp;
+    return utf8_fold_slow(cp);
+}
 
-static int cmp_wordptr_count(const void *a, const void *b)
+/* length of the sequence a lead byte starts, 0 for any other byte */
+static size_t utf8_seq_len(unsigned c)
 {
-    const WordPtr *wa = (const WordPtr *)a;
-    const WordPtr *wb = (const WordPtr *)b;
-    if (wa->entry->count < wb->entry->count)
-        return 1;
-    if (wa->entry->count > wb->entry->count)
-        return -1;
+    if (c >= 0xc2 && c < 0xe0)
+        return 2;
+    if (c >= 0xe0 && c < 0xf0)
+        return 3;
+    if (c >= 0xf0 && c < 0xf5)
+        return 4;
     return 0;
 }
 
-int main(int argc, char *argv[])
+/* Decode the sequence at p (n > 0 bytes readable).  Returns the code point
+ * and sets *len, or returns -1 for a malformed or truncated sequence. */
+static long utf8_decode(const unsigned char *p, size_t n, size_t *len)
+{
+    static const uint32_t MIN[5] = {0, 0, 0x80, 0x800, 0x10000};
+    size_t need = utf8_seq_len(p[0]), k;
+    uint32_t cp;
+    if (p[0] < 0x80)
+    {
+        *len = 1;
+        return p[0];
+    }
+    if (need == 0 || n < need)
+        return -1;
+    cp = p[0] & (0x7f >> need);
+    for (k = 1; k < need; ++k)
+    {
+        if ((p[k] & 0xc0) != 0x80)
+            return -1;
+        cp = (cp << 6) | (p[k] & 0x3f);
+    }
+    if (cp < MIN[need] || cp > 0x10ffff || (cp >= 0xd800 && cp < 0xe000))
+        return -1;
+    *len = need;
+    return (long)cp;
+}
+
+/* bytes of s that do not start a character, to pad it by characters */
+static int utf8_extra_bytes(const char *s)
 {
-    FILE *fp = NULL;
-    const char *topic = NULL;
+    int n = 0;
+    for (; *s; ++s)
+        n += ((unsigned char)*s & 0xc0) == 0x80;
+    return n;
+}
 
-    if (argc < 2)
+static size_t utf8_encode(uint32_t cp, unsigned char *out)
+{
+    if (cp < 0x80)
     {
-        fprintf(stderr, "Usage: %s <topic_word> [file]\n", argv[0]);
-        return EXIT_FAILURE;
+        out[0] = (unsigned char)cp;
+        return 1;
+    }
+    if (cp < 0x800)
+    {
+        out[0] = (unsigned char)(0xc0 | cp >> 6);
+        out[1] = (unsigned char)(0x80 | (cp & 0x3f));
+        return 2;
     }
+    if (cp < 0x10000)
+    {
+        out[0] = (unsigned char)(0xe0 | cp >> 12);
+        out[1] = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (unsigned char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (unsigned char)(0xf0 | cp >> 18);
+    out[1] = (unsigned char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (unsigned char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (unsigned char)(0x80 | (cp & 0x3f));
+    return 4;
+}
 
-    topic = argv[1];
+/* Fold a word for the table into dst, which needs FOLD_ROOM(len) bytes:
+ * ASCII through lower_table, other code points by simple case folding
+ * (ASCII only with --ascii).  Returns the folded length. */
+#define FOLD_ROOM(len) ((len) / 2 * 3 + 2)
 
-    if (argc >= 3)
+static size_t fold_word(char *dst, const char *src, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char *d = (unsigned char *)dst;
+    size_t i = 0;
+    while (i < len)
     {
-        fp = fopen(argv[2], "r");
-        if (!fp)
+        size_t n;
+        long cp;
+        if (s[i] < 0x80 || !utf8_words || (cp = utf8_decode(s + i, len - i, &n)) < 0)
         {
-            perror("fopen");
-            return EXIT_FAILURE;
+            *d++ = lower_table[s[i++]];
+            continue;
         }
+        d += utf8_encode(utf8_fold((uint32_t)cp), d);
+        i += n;
     }
-    else
+    return (size_t)(d - (unsigned char *)dst);
+}
+
+/* Word bits for the high bytes of the CLASSIFY_WIDTH window at base (avail
+ * bytes readable from there): every byte of a sequence that decodes to a
+ * word character.  *spill holds the word bits a sequence from the previous
+ * window left in this one, and receives those for the next. */
+static uint64_t utf8_word_bits(const unsigned char *base, size_t avail, uint64_t high, uint64_t *spill)
+{
+    uint64_t w = *spill;
+    high &= ~w;
+    *spill = 0;
+    while (high)
     {
-        fp = stdin;
+        unsigned i = lowest_bit(high);
+        size_t len;
+        long cp = utf8_decode(base + i, avail - i, &len);
+        uint64_t bits;
+        if (cp < 0)
+        {
+            high &= high - 1; /* stray or malformed byte: not a word byte */
+            continue;
+        }
+        bits = (((uint64_t)1 << len) - 1) << i;
+        if (utf8_is_word((uint32_t)cp))
+        {
+            w |= bits;
+            if (i + len > CLASSIFY_WIDTH)
+                *spill = (((uint64_t)1 << len) - 1) >> (CLASSIFY_WIDTH - i);
+        }
+        high &= ~bits;
     }
+    return w;
+}
 
-    /* Processing variables */
+/* Precompute the byte classification so the lexer needs one table lookup
+ * per byte instead of isalnum()/tolower() calls, and pick the widest
+ * classification kernel the CPU supports.  Bytes above 0x7f count as word
+ * bytes here, which keeps lex_parallel() from cutting inside a UTF-8
+ * sequence; the lexer itself decides about them. */
+static void init_char_tables(void)
+{
     int c;
-    char *buf = (char *)xmalloc(INITIAL_BUF_SIZE);
-    size_t buf_cap = INITIAL_BUF_SIZE;
-    size_t buf_len = 0;
+    for (c = 0; c < 256; ++c)
+    {
+        char_class[c] = 0;
+        if (isalnum(c) || c >= 0x80)
+            char_class[c] |= CC_WORD;
+        if (c == '.' || c == '!' || c == '?')
+            char_class[c] |= CC_TERM;
+        lower_table[c] = (unsigned char)tolower(c);
+    }
+#if defined(TOPIC_INDEX_HAVE_AVX2)
+    classify_block = __builtin_cpu_supports("avx2") ? classify_avx2 : classify_sse2;
+#elif defined(TOPIC_INDEX_HAVE_SSE2)
+    classify_block = classify_sse2;
+#elif defined(TOPIC_INDEX_HAVE_NEON)
+    classify_block = classify_neon;
+#endif
+}
+
+#define HASH_SECRET0 0xa0761d6478bd642fULL
+#define HASH_SECRET1 0xe7037ed1a0b428dbULL
+
+/* full 64x64->128 bit multiply, folded back to 64 bits by xor */
+static uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 u128;
+    u128 r = (u128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a, hb = b >> 32, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), lo, hi;
+    uint64_t c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
+}
+
+/* Unaligned loads with ASCII case folding: every word byte is a letter or
+ * a digit, and for those c | 0x20 is the lower-case form.  For other
+ * bytes the fold only merges values word_equal() tells apart, which costs
+ * an occasional compare, never a missed match. */
+static uint64_t hash_read8(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v | 0x2020202020202020ULL;
+}
 
-    long total_words = 0;
-    long total_sentences = 0;
-    long current_sentence_id = 0;
+static uint64_t hash_read4(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v | 0x20202020UL;
+}
 
-    while ((c = fgetc(fp)) != EOF)
+/* wyhash-style hash over the case-folded bytes: words of up to 16 bytes
+ * (nearly all of them) cost a few overlapping loads and two multiplies,
+ * and no byte is read twice on a per-character path.  A slice is hashed
+ * straight out of the input without copying it first. */
+static uint64_t hash_word(const char *s, size_t len)
+{
+    uint64_t seed = HASH_SECRET0, a, b;
+    if (len <= 16)
     {
-        if (isalnum(c))
+        if (len >= 4)
         {
-            /* add char to buffer */
-            if (buf_len + 1 >= buf_cap)
-            {
-                buf_cap *= 2;
-                buf = (char *)realloc(buf, buf_cap);
-                if (!buf)
-                {
-                    fprintf(stderr, "topic_index: out of memory\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            buf[buf_len++] = (char)tolower(c);
+            size_t q = (len >> 3) << 2;
+            a = (hash_read4(s) << 32) | hash_read4(s + q);
+            b = (hash_read4(s + len - 4) << 32) | hash_read4(s + len - 4 - q);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)((unsigned char)s[0] | 0x20) << 16) | ((uint64_t)((unsigned char)s[len >> 1] | 0x20) << 8) |
+                (uint64_t)((unsigned char)s[len - 1] | 0x20);
+            b = 0;
         }
         else
         {
-            /* Non-word character: finish word if buffer not empty */
-            if (buf_len > 0)
-            {
-                buf[buf_len] = '\0';
-                get_word_entry(buf, current_sentence_id);
-                total_words += 1;
-                buf_len = 0;
-            }
-            /* Sentence boundary? */
-            if (c == '.' || c == '!' || c == '?')
-            {
-                total_sentences += 1;
-                current_sentence_id = total_sentences; /* next sentence id */
-            }
+            a = b = 0;
         }
     }
-    /* flush last buffered word */
-    if (buf_len > 0)
+    else
     {
-        buf[buf_len] = '\0';
-        get_word_entry(buf, current_sentence_id);
-        total_words += 1;
-        buf_len = 0;
+        const char *p = s;
+        size_t i = len;
+        while (i > 16)
+        {
+            seed = hash_mix(hash_read8(p) ^ HASH_SECRET1, hash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read8(p + i - 16);
+        b = hash_read8(p + i - 8);
     }
-    free(buf);
-
-    if (fp != stdin)
-        fclose(fp);
+    return hash_mix(HASH_SECRET1 ^ len, hash_mix(a ^ HASH_SECRET1, b ^ seed));
+}
 
-    if (total_sentences == 0 && total_words > 0)
+/* compare a lower-case key against a slice of any case */
+static int word_equal(const char *key, size_t key_len, const char *word, size_t len)
+{
+    if (key_len != len)
+        return 0;
+    while (len--)
     {
-        /* treat entire text as one sentence if no terminator found */
-        total_sentences = 1;
+        if ((unsigned char)*key++ != lower_table[(unsigned char)*word++])
+            return 0;
     }
+    return 1;
+}
 
-    /* Collect word pointers for sorting */
-    WordPtr *array = NULL;
-    size_t array_size = 0;
-    size_t i;
-    for (i = 0; i < HASH_SIZE; ++i)
+static void *xmalloc(size_t n)
+{
+    void *p = malloc(n);
+    if (!p)
     {
-        WordEntry *e = hash_table[i];
-        while (e)
-        {
-            array = (WordPtr *)realloc(array, (array_size + 1) * sizeof(WordPtr));
-            if (!array)
-            {
-                fprintf(stderr, "topic_index: out of memory\n");
-                exit(EXIT_FAILURE);
-            }
-            array[array_size].entry = e;
-            array_size += 1;
-            e = e->next;
-        }
+        fprintf(stderr, "topic_index: out of memory\n");
+        exit(EXIT_FAILURE);
     }
+    return p;
+}
 
-    qsort(array, array_size, sizeof(WordPtr), cmp_wordptr_count);
-
-    /* Prepare topic word lower-cased */
-    char *topic_lc = strdup(topic);
-    if (!topic_lc)
+static void *xcalloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (!p)
     {
         fprintf(stderr, "topic_index: out of memory\n");
         exit(EXIT_FAILURE);
     }
+    return p;
+}
+
+static char *arena_alloc(Arena *a, size_t n)
+{
+    ArenaBlock *b = a->head;
+    char *p;
+    if (!b || b->cap - b->used < n)
+    {
+        size_t cap = !b ? ARENA_FIRST_BLOCK : b->cap < ARENA_BLOCK_SIZE ? 2 * b->cap : ARENA_BLOCK_SIZE;
+        if (cap < n)
+            cap = n;
+        b = (ArenaBlock *)xmalloc(sizeof(ArenaBlock) + cap);
+        b->next = a->head;
+        b->used = 0;
+        b->cap = cap;
+        a->head = b;
+        a->blocks += 1;
+    }
+    p = (char *)(b + 1) + b->used;
+    b->used += n;
+    return p;
+}
+
+static void arena_free(Arena *a)
+{
+    while (a->head)
+    {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+/* Stop words compiled into a perfect hash (hash and displace): keys are
+ * grouped into buckets by their low hash bits and each bucket gets a
+ * displacement that sends all of its keys to distinct free slots, so a
+ * lookup is one displacement read, one slot read and one compare. */
+typedef struct
+{
+    const char *word; /* lower-case key, NULL in unused slots */
+    size_t len;
+    uint64_t hash; /* hash_word(word) */
+} StopKey;
+
+typedef struct
+{
+    StopKey *slots;
+    unsigned long *disp; /* per-bucket displacement */
+    size_t mask;         /* slots - 1 */
+    size_t nbuckets;     /* power of 2 */
+    StopKey *pending;    /* words added since the last build */
+    size_t npending;
+    size_t pending_cap;
+    Arena strings;
+} StopSet;
+
+static StopSet stop_words;
+
+static size_t stop_slot(const StopSet *s, uint64_t h)
+{
+    unsigned long d = s->disp[h & (s->nbuckets - 1)];
+    return (size_t)(hash_mix(h ^ d, HASH_SECRET0) & s->mask);
+}
+
+static int stop_set_contains(const StopSet *s, uint64_t h, const char *word, size_t len)
+{
+    const StopKey *k;
+    if (!s->slots)
+        return 0;
+    k = &s->slots[stop_slot(s, h)];
+    return k->word && k->hash == h && word_equal(k->word, k->len, word, len);
+}
+
+/* queue a word (any case) for the next stop_set_build() */
+static void stop_set_add(StopSet *s, const char *word, size_t len)
+{
+    StopKey *k;
+    char *copy;
+    if (len == 0)
+        return;
+    if (s->npending == s->pending_cap)
     {
-        char *p = topic_lc;
-        while (*p)
+        s->pending_cap = s->pending_cap ? s->pending_cap * 2 : 64;
+        s->pending = (StopKey *)realloc(s->pending, s->pending_cap * sizeof(StopKey));
+        if (!s->pending)
         {
-            *p = (char)tolower((unsigned char)*p);
-            ++p;
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
         }
     }
+    copy = arena_alloc(&s->strings, FOLD_ROOM(len) + 1);
+    len = fold_word(copy, word, len);
+    copy[len] = '\0';
+    k = &s->pending[s->npending++];
+    k->word = copy;
+    k->len = len;
+    k->hash = hash_word(copy, len);
+}
 
-    /* Find topic entry */
-    WordEntry *topic_entry = NULL;
+static int stop_add_pack(StopSet *s, const char *lang)
+{
+    size_t i;
+    for (i = 0; STOP_PACKS[i].lang; ++i)
     {
-        unsigned long h = hash_word(topic_lc);
-        WordEntry *e = hash_table[h];
-        while (e)
+        if (strcmp(STOP_PACKS[i].lang, lang) == 0)
         {
-            if (strcmp(e->word, topic_lc) == 0)
-            {
-                topic_entry = e;
-                break;
-            }
-            e = e->next;
+            const char *const *w;
+            for (w = STOP_PACKS[i].words; *w; ++w)
+                stop_set_add(s, *w, strlen(*w));
+            return 1;
         }
     }
+    return 0;
+}
 
-    /* Gather top 4 non-stop-words excluding topic */
-    WordEntry *top4[4] = {NULL, NULL, NULL, NULL};
-    size_t found = 0;
-    for (i = 0; i < array_size && found < 4; ++i)
+/* Read a word list file and pass every item to add().  Items are
+ * whitespace-separated, or whole (trimmed) lines when by_line is set; '#'
+ * starts a comment that runs to the end of the line. */
+static void read_word_list(const char *path, int by_line,
+                           void (*add)(void *ctx, const char *item, size_t len), void *ctx)
+{
+    FILE *fp = fopen(path, "r");
+    char item[256];
+    size_t len = 0;
+    int c, comment = 0;
+    if (!fp)
     {
-        WordEntry *e = array[i].entry;
-        if (e == topic_entry)
-            continue; /* skip topic */
-        if (is_stop_word(e->word))
-            continue; /* skip stop words */
-        top4[found++] = e;
+        perror(path);
+        exit(EXIT_FAILURE);
     }
+    do
+    {
+        c = fgetc(fp);
+        if (c == '#')
+            comment = 1;
+        if (c == EOF || c == '\n' || (!by_line && isspace(c)))
+        {
+            while (len > 0 && isspace((unsigned char)item[len - 1]))
+                --len;
+            if (len > 0)
+                add(ctx, item, len);
+            len = 0;
+            if (c == '\n')
+                comment = 0;
+        }
+        else if (!comment && len < sizeof(item) && (len > 0 || !isspace(c)))
+            item[len++] = (char)c;
+    } while (c != EOF);
+    fclose(fp);
+}
+
+static void stop_add_item(void *ctx, const char *word, size_t len)
+{
+    stop_set_add((StopSet *)ctx, word, len);
+}
+
+/* Add whitespace-separated stop words from a file */
+static void stop_add_file(StopSet *s, const char *path)
+{
+    read_word_list(path, 0, stop_add_item, s);
+}
+
+/* Find a displacement for every bucket, largest buckets first.  Returns 0
+ * if some bucket cannot be placed, in which case the caller retries with
+ * more slots. */
+static int stop_try_place(StopSet *s, const StopKey *keys, const size_t *start, const size_t *order)
+{
+    size_t b, i, j;
+    for (b = 0; b < s->nbuckets; ++b)
+    {
+        size_t bucket = order[b];
+        size_t lo = start[bucket], hi = start[bucket + 1];
+        unsigned long d;
+        if (lo == hi)
+            break; /* remaining buckets are empty */
+        for (d = 0; d < 4096; ++d)
+        {
+            s->disp[bucket] = d;
+            for (i = lo; i < hi; ++i)
+            {
+                size_t slot = stop_slot(s, keys[i].hash);
+                if (s->slots[slot].word)
+                    break;
+                for (j = lo; j < i; ++j)
+                {
+                    if (stop_slot(s, keys[j].hash) == slot)
+                        break;
+                }
+                if (j < i)
+                    break;
+            }
+            if (i == hi)
+                break;
+        }
+        if (d == 4096)
+            return 0;
+        for (i = lo; i < hi; ++i)
+            s->slots[stop_slot(s, keys[i].hash)] = keys[i];
+    }
+    return 1;
+}
+
+/* Compile every queued word into the perfect-hash table */
+static void stop_set_build(StopSet *s)
+{
+    size_t n = s->npending, i, j, nslots = 8;
+    size_t *start, *order, *fill;
+    StopKey *keys;
+
+    s->nbuckets = 1;
+    while (s->nbuckets * 4 < n)
+        s->nbuckets *= 2;
+
+    /* group the keys by bucket (counting sort), dropping duplicates */
+    start = (size_t *)xcalloc(s->nbuckets + 1, sizeof(size_t));
+    fill = (size_t *)xcalloc(s->nbuckets, sizeof(size_t));
+    order = (size_t *)xmalloc(s->nbuckets * sizeof(size_t));
+    keys = (StopKey *)xmalloc((n ? n : 1) * sizeof(StopKey));
+    for (i = 0; i < n; ++i)
+        start[(s->pending[i].hash & (s->nbuckets - 1)) + 1] += 1;
+    for (i = 0; i < s->nbuckets; ++i)
+        start[i + 1] += start[i];
+    for (i = 0; i < n; ++i)
+    {
+        const StopKey *k = &s->pending[i];
+        size_t bucket = k->hash & (s->nbuckets - 1);
+        StopKey *first = &keys[start[bucket]];
+        for (j = 0; j < fill[bucket]; ++j)
+        {
+            if (first[j].hash == k->hash && strcmp(first[j].word, k->word) == 0)
+                break;
+        }
+        if (j == fill[bucket])
+            first[fill[bucket]++] = *k;
+    }
+    /* close the gaps the duplicates left */
+    for (i = 0, n = 0; i < s->nbuckets; ++i)
+    {
+        memmove(&keys[n], &keys[start[i]], fill[i] * sizeof(StopKey));
+        start[i] = n;
+        n += fill[i];
+    }
+    start[s->nbuckets] = n;
+
+    /* largest buckets are placed first, while the table is emptiest */
+    for (i = 0; i < s->nbuckets; ++i)
+    {
+        size_t size = start[i + 1] - start[i];
+        j = i;
+        while (j > 0 && start[order[j - 1] + 1] - start[order[j - 1]] < size)
+        {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = i;
+    }
+
+    while (nslots < n * 2)
+        nslots *= 2;
+    s->disp = (unsigned long *)xcalloc(s->nbuckets, sizeof(unsigned long));
+    for (;;)
+    {
+        s->slots = (StopKey *)xcalloc(nslots, sizeof(StopKey));
+        s->mask = nslots - 1;
+        if (stop_try_place(s, keys, start, order))
+            break;
+        free(s->slots);
+        nslots *= 2;
+    }
+    free(keys);
+    free(start);
+    free(fill);
+    free(order);
+}
+
+static void stop_set_free(StopSet *s)
+{
+    free(s->slots);
+    free(s->disp);
+    free(s->pending);
+    arena_free(&s->strings);
+}
+
+/* ABBREVIATIONS as a hash set of their bytes packed into an integer,
+ * linearly probed; 0 marks a free slot.  Filled by abbreviations_build(). */
+#define ABBREV_SLOTS 128
+static uint64_t abbreviations[ABBREV_SLOTS];
+
+/* the ASCII word packed a byte per letter, lower-cased */
+static uint64_t abbrev_key(const char *word, size_t len)
+{
+    uint64_t k = 0;
+    size_t i;
+    for (i = 0; i < len; ++i)
+        k = (k << 8) | lower_table[(unsigned char)word[i]];
+    return k;
+}
+
+static size_t abbrev_slot(uint64_t k)
+{
+    return (size_t)((k * HASH_SECRET1) >> 57); /* top 7 bits: ABBREV_SLOTS */
+}
+
+static void abbreviations_build(void)
+{
+    const char *const *w;
+    for (w = ABBREVIATIONS; *w; ++w)
+    {
+        uint64_t k = abbrev_key(*w, strlen(*w));
+        size_t slot = abbrev_slot(k);
+        while (abbreviations[slot] && abbreviations[slot] != k)
+            slot = (slot + 1) & (ABBREV_SLOTS - 1);
+        abbreviations[slot] = k;
+    }
+}
+
+/* The kind of a '.' right after word, an ASCII word of any case: a single
+ * capital other than "I" is an initial (J. R. R. Tolkien) unless
+ * after_name, the word before it being capitalised, a single lower-case
+ * letter holds ("g" in "e.g."; see ABBREVIATIONS), and the abbreviations
+ * are looked up in their set */
+static int sentence_word_kind(const char *word, size_t len, int after_name)
+{
+    uint64_t k;
+    size_t slot;
+    if (len == 1)
+    {
+        unsigned c = (unsigned char)word[0];
+        if (c - 'A' < 26u && c != 'I')
+            return after_name ? SENT_END : SENT_INITIAL;
+        return c - 'a' < 26u && c != 'i' ? SENT_HOLD : SENT_END;
+    }
+    if (len > ABBREV_MAX_LEN)
+        return SENT_END;
+    k = abbrev_key(word, len);
+    for (slot = abbrev_slot(k); abbreviations[slot]; slot = (slot + 1) & (ABBREV_SLOTS - 1))
+    {
+        if (abbreviations[slot] == k)
+            return SENT_HOLD;
+    }
+    return SENT_END;
+}
+
+/* Does a terminator of the given kind end its sentence?  prev is the byte
+ * before the next word and first that word's first byte, and newline says
+ * whether a line break lies between the terminator and that word; a word
+ * that follows the terminator directly (3.14, example.com) has been ruled
+ * out.  An opening quote or bracket starts a new sentence, a lower-case
+ * word on the same line carries the old one on ("Stop!" she said), and a
+ * new line always starts a new one (log lines). */
+static int sentence_ends(int kind, unsigned prev, unsigned first, int newline)
+{
+    if (kind == SENT_HOLD)
+        return 0;
+    /* ASCII, then the last UTF-8 bytes of “ „ ‘ « ¿ ¡ */
+    if (prev == '"' || prev == '\'' || prev == '(' || prev == '[' || prev == 0x9c || prev == 0x9e || prev == 0x98 ||
+        prev == 0xab || prev == 0xbf || prev == 0xa1)
+        return 1;
+    if (kind == SENT_INITIAL)
+        return first < 0x80 && (first | 0x20) - 'a' >= 26u; /* not a letter: no name follows */
+    return newline || first - 'a' >= 26u;
+}
+
+static void word_table_room(WordTable *t, size_t cap)
+{
+    t->counts = (uint32_t *)realloc(t->counts, cap * sizeof(uint32_t));
+    t->sentence_counts = (uint32_t *)realloc(t->sentence_counts, cap * sizeof(uint32_t));
+    t->last_sentence_ids = (long *)realloc(t->last_sentence_ids, cap * sizeof(long));
+    t->word_offs = (uint64_t *)realloc(t->word_offs, cap * sizeof(uint64_t));
+    t->flags = (unsigned char *)realloc(t->flags, cap);
+    if (t->doc_counts)
+    {
+        t->doc_counts = (uint32_t *)realloc(t->doc_counts, cap * sizeof(uint32_t));
+        if (!t->doc_counts)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (!t->counts || !t->sentence_counts || !t->last_sentence_ids || !t->word_offs || !t->flags)
+    {
+        fprintf(stderr, "topic_index: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    t->cap = cap;
+    t->pool_grows += 1;
+}
+
+static void word_table_init(WordTable *t)
+{
+    t->slots = (WordSlot *)xcalloc(TABLE_INITIAL_SIZE, sizeof(WordSlot));
+    t->mask = TABLE_INITIAL_SIZE - 1;
+    t->size = 0;
+    t->gen = 1;
+    t->cap = 0;
+    t->counts = NULL;
+    t->sentence_counts = NULL;
+    t->doc_counts = NULL;
+    t->last_sentence_ids = NULL;
+    t->word_offs = NULL;
+    t->flags = NULL;
+    t->pool_cap = TABLE_INITIAL_SIZE * 8;
+    t->pool = (char *)xmalloc(t->pool_cap);
+    t->pool_len = 0;
+    t->carries = NULL;
+    t->ncarries = 0;
+    t->carries_cap = 0;
+    t->grows = 0;
+    t->pool_grows = 0;
+    word_table_room(t, TABLE_INITIAL_SIZE);
+}
+
+/* Empty the table for the next document.  Slots are invalidated by moving
+ * to a new generation rather than cleared; only a table left far too big
+ * by an earlier document is reallocated. */
+static void word_table_reset(WordTable *t)
+{
+    t->pool_len = 0;
+    t->ncarries = 0;
+    if (t->mask + 1 > 4 * TABLE_INITIAL_SIZE && t->size * 32 < t->mask + 1)
+    {
+        free(t->slots);
+        t->slots = (WordSlot *)xcalloc(TABLE_INITIAL_SIZE, sizeof(WordSlot));
+        t->mask = TABLE_INITIAL_SIZE - 1;
+        t->gen = 1;
+    }
+    else if (++t->gen == 0)
+    {
+        /* generation counter wrapped: clear for real */
+        memset(t->slots, 0, (t->mask + 1) * sizeof(WordSlot));
+        t->gen = 1;
+    }
+    t->size = 0;
+}
+
+/* how far the entry in slot i sits from its home slot */
+#define PROBE_DISTANCE(t, e, i) (((i) - ((e)->hash & (t)->mask)) & (t)->mask)
+
+/* Put a slot for an entry that is not in the table yet into it,
+ * displacing richer slots as needed */
+static void place_slot(WordTable *t, WordSlot s)
+{
+    size_t i = s.hash & t->mask;
+    size_t dist = 0;
+    for (;;)
+    {
+        WordSlot *slot = &t->slots[i];
+        size_t d;
+        if (!SLOT_LIVE(t, slot))
+        {
+            *slot = s;
+            return;
+        }
+        d = PROBE_DISTANCE(t, slot, i);
+        if (d < dist)
+        {
+            WordSlot tmp = *slot;
+            *slot = s;
+            s = tmp;
+            dist = d;
+        }
+        i = (i + 1) & t->mask;
+        ++dist;
+    }
+}
+
+/* Only the slots move; entry numbers and the arrays stay as they are */
+static void grow_word_table(WordTable *t)
+{
+    WordSlot *old = t->slots;
+    size_t old_cap = t->mask + 1;
+    unsigned old_gen = t->gen;
+    size_t i;
+    t->slots = (WordSlot *)xcalloc(old_cap * 2, sizeof(WordSlot));
+    t->mask = old_cap * 2 - 1;
+    t->gen = 1;
+    t->grows += 1;
+    for (i = 0; i < old_cap; ++i)
+    {
+        if (old[i].gen == old_gen)
+        {
+            old[i].gen = 1;
+            place_slot(t, old[i]);
+        }
+    }
+    free(old);
+}
+
+/* grow until n entries fit under the load limit */
+static void word_table_reserve(WordTable *t, size_t n)
+{
+    while (n * 5 > (t->mask + 1) * 4)
+        grow_word_table(t);
+    if (n > t->cap)
+        word_table_room(t, n);
+}
+
+/* Entries are added in pool order, so a word ends where the next begins */
+static size_t word_len(const WordTable *t, uint32_t id)
+{
+    uint64_t end = (size_t)id + 1 < t->size ? t->word_offs[id + 1] : (uint64_t)t->pool_len;
+    return (size_t)(end - t->word_offs[id]) - 1;
+}
+
+static const char *word_text(const WordTable *t, uint32_t id)
+{
+    return t->pool + t->word_offs[id];
+}
+
+/* Keep a document count per word too, for a table that sums documents */
+static void word_table_count_docs(WordTable *t)
+{
+    t->doc_counts = (uint32_t *)xcalloc(t->cap, sizeof(uint32_t));
+}
+
+/* The carry of a counter of entry id; NULL if it has none and create is 0 */
+static uint64_t *word_carry(WordTable *t, uint32_t id, int counter, int create)
+{
+    size_t key = COUNTER_MAX * (size_t)id + (size_t)counter, i;
+    for (i = 0; i < t->ncarries; ++i)
+        if (t->carries[i].key == key)
+            return &t->carries[i].high;
+    if (!create)
+        return NULL;
+    if (t->ncarries == t->carries_cap)
+    {
+        t->carries_cap = t->carries_cap ? t->carries_cap * 2 : 8;
+        t->carries = (WordCarry *)realloc(t->carries, t->carries_cap * sizeof(WordCarry));
+        if (!t->carries)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t->carries[t->ncarries].key = key;
+    t->carries[t->ncarries].high = 0;
+    return &t->carries[t->ncarries++].high;
+}
+
+/* a COUNTER_* value of entry id */
+static long word_counter(const WordTable *t, uint32_t id, int counter)
+{
+    uint64_t v = counter == COUNTER_WORDS       ? t->counts[id]
+                 : counter == COUNTER_SENTENCES ? t->sentence_counts[id]
+                                                : t->doc_counts[id];
+    if (t->ncarries > 0)
+    {
+        const uint64_t *high = word_carry((WordTable *)t, id, counter, 0);
+        if (high)
+            v += *high << 32;
+    }
+    return (long)v;
+}
+
+static void set_word_counter(WordTable *t, uint32_t id, int counter, long v)
+{
+    uint64_t *high = word_carry(t, id, counter, ((uint64_t)v >> 32) != 0);
+    if (counter == COUNTER_WORDS)
+        t->counts[id] = (uint32_t)v;
+    else if (counter == COUNTER_SENTENCES)
+        t->sentence_counts[id] = (uint32_t)v;
+    else
+        t->doc_counts[id] = (uint32_t)v;
+    if (high)
+        *high = (uint64_t)v >> 32;
+}
+
+/* Report order: higher count first, ties broken alphabetically so the
+ * report does not depend on the table layout (e.g. on how many threads
+ * built it) */
+static int ranks_before(const WordTable *t, uint32_t a, uint32_t b)
+{
+    long ca = word_counter(t, a, COUNTER_WORDS), cb = word_counter(t, b, COUNTER_WORDS);
+    if (ca != cb)
+        return ca > cb;
+    return strcmp(word_text(t, a), word_text(t, b)) < 0;
+}
+
+static WordRow word_row(const WordTable *t, uint32_t id)
+{
+    WordRow r;
+    r.word = word_text(t, id);
+    r.len = word_len(t, id);
+    r.count = word_counter(t, id, COUNTER_WORDS);
+    r.sentence_count = word_counter(t, id, COUNTER_SENTENCES);
+    r.docs = t->doc_counts ? word_counter(t, id, COUNTER_DOCS) : 0;
+    return r;
+}
+
+/* Probe for a word; WORD_NONE when absent.  A Robin Hood probe can stop
+ * as soon as it meets an entry closer to home than the word would be. */
+static uint32_t lookup_hashed(const WordTable *t, uint64_t h, const char *word, size_t len)
+{
+    size_t i = h & t->mask;
+    size_t dist = 0;
+    for (;;)
+    {
+        const WordSlot *slot = &t->slots[i];
+        if (!SLOT_LIVE(t, slot) || PROBE_DISTANCE(t, slot, i) < dist)
+            return WORD_NONE;
+        if (slot->hash == h && word_equal(word_text(t, slot->id), word_len(t, slot->id), word, len))
+            return slot->id;
+        i = (i + 1) & t->mask;
+        ++dist;
+    }
+}
+
+/* Look up a word given as a (pointer, length) slice of any case */
+static uint32_t find_word_entry(const WordTable *t, const char *word, size_t len)
+{
+    return lookup_hashed(t, hash_word(word, len), word, len);
+}
+
+/* Entry whose full hash is h, WORD_NONE when absent: phrases keep their
+ * words only as hashes */
+static uint32_t find_hashed_entry(const WordTable *t, uint64_t h)
+{
+    size_t i = h & t->mask;
+    size_t dist = 0;
+    for (;;)
+    {
+        const WordSlot *slot = &t->slots[i];
+        if (!SLOT_LIVE(t, slot) || PROBE_DISTANCE(t, slot, i) < dist)
+            return WORD_NONE;
+        if (slot->hash == h)
+            return slot->id;
+        i = (i + 1) & t->mask;
+        ++dist;
+    }
+}
+
+/* Obtain or create the entry for a slice whose hash is already known,
+ * without counting it.  Entry numbers stay valid until the table is
+ * reset; a word's text may move when the pool grows. */
+static uint32_t intern_hashed(WordTable *t, uint64_t h, const char *word, size_t len)
+{
+    uint32_t id = lookup_hashed(t, h, word, len);
+    WordSlot s;
+    if (id != WORD_NONE)
+        return id;
+
+    /* keep the load factor at or below 0.8 */
+    if ((t->size + 1) * 5 > (t->mask + 1) * 4)
+        grow_word_table(t);
+    if (t->size == t->cap)
+    {
+        if (t->cap >= WORD_NONE / 2)
+        {
+            fprintf(stderr, "topic_index: too many distinct words\n");
+            exit(EXIT_FAILURE);
+        }
+        word_table_room(t, t->cap * 2);
+    }
+    if (t->pool_len + len + 1 > t->pool_cap)
+    {
+        while (t->pool_len + len + 1 > t->pool_cap)
+            t->pool_cap *= 2;
+        t->pool = (char *)realloc(t->pool, t->pool_cap);
+        t->pool_grows += 1;
+        if (!t->pool)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    id = (uint32_t)t->size++;
+    t->word_offs[id] = t->pool_len;
+    lower_copy(t->pool + t->pool_len, word, len);
+    t->pool[t->pool_len + len] = '\0';
+    t->pool_len += len + 1;
+    t->counts[id] = 0;
+    t->sentence_counts[id] = 0;
+    if (t->doc_counts)
+        t->doc_counts[id] = 0;
+    t->last_sentence_ids[id] = -1;
+    t->flags[id] = stop_set_contains(&stop_words, h, word, len) ? WORD_STOP : 0;
+    s.hash = h;
+    s.id = id;
+    s.gen = t->gen;
+    place_slot(t, s);
+    return id;
+}
+
+/* Obtain or create the entry for a (pointer, length) slice, without
+ * counting it */
+static uint32_t intern_word(WordTable *t, const char *word, size_t len)
+{
+    return intern_hashed(t, hash_word(word, len), word, len);
+}
+
+/* count one occurrence of entry id in the given sentence */
+static void count_entry(WordTable *t, uint32_t id, long current_sentence)
+{
+    if (++t->counts[id] == 0)
+        *word_carry(t, id, COUNTER_WORDS, 1) += 1;
+    if (t->last_sentence_ids[id] != current_sentence)
+    {
+        if (++t->sentence_counts[id] == 0)
+            *word_carry(t, id, COUNTER_SENTENCES, 1) += 1;
+        if (current_sentence == 0)
+            t->flags[id] |= WORD_FIRST;
+        t->last_sentence_ids[id] = current_sentence;
+    }
+}
+
+/* Fold the counts of one chunk's table into dst.  Sentence ids in src are
+ * local to the chunk and become global by adding sentence_base; a word
+ * counted in the chunk's sentence 0 (the one running across the cut) that
+ * dst last saw in that same sentence must not be counted twice. */
+static void merge_word_table(WordTable *dst, const WordTable *src, long sentence_base)
+{
+    size_t i;
+    /* Make room first: src is walked in slot order, i.e. sorted by hash,
+     * and feeding sorted keys into a smaller table piles them into one
+     * ever-growing cluster. */
+    word_table_reserve(dst, dst->size + src->size);
+    for (i = 0; i <= src->mask; ++i)
+    {
+        const WordSlot *s = &src->slots[i];
+        uint32_t e, m;
+        long sentences;
+        if (!SLOT_LIVE(src, s))
+            continue;
+        e = s->id;
+        m = intern_hashed(dst, s->hash, word_text(src, e), word_len(src, e));
+        sentences = word_counter(dst, m, COUNTER_SENTENCES) + word_counter(src, e, COUNTER_SENTENCES);
+        if ((src->flags[e] & WORD_FIRST) && dst->last_sentence_ids[m] == sentence_base)
+            sentences -= 1;
+        if ((src->flags[e] & WORD_FIRST) && sentence_base == 0)
+            dst->flags[m] |= WORD_FIRST;
+        set_word_counter(dst, m, COUNTER_WORDS, word_counter(dst, m, COUNTER_WORDS) + word_counter(src, e, COUNTER_WORDS));
+        set_word_counter(dst, m, COUNTER_SENTENCES, sentences);
+        dst->last_sentence_ids[m] = sentence_base + src->last_sentence_ids[e];
+    }
+}
+
+/* Add the counts of src to a corpus table: a single document's (each of
+ * its words then occurs in one more document) or another corpus table's */
+static void add_word_table(WordTable *dst, const WordTable *src)
+{
+    size_t i;
+    word_table_reserve(dst, dst->size + src->size); /* as in merge_word_table() */
+    for (i = 0; i <= src->mask; ++i)
+    {
+        const WordSlot *s = &src->slots[i];
+        uint32_t e, m;
+        int c;
+        if (!SLOT_LIVE(src, s))
+            continue;
+        e = s->id;
+        m = intern_hashed(dst, s->hash, word_text(src, e), word_len(src, e));
+        for (c = COUNTER_WORDS; c < COUNTER_MAX; ++c)
+        {
+            long add = c == COUNTER_DOCS && !src->doc_counts ? 1 : word_counter(src, e, c);
+            set_word_counter(dst, m, c, word_counter(dst, m, c) + add);
+        }
+    }
+}
+
+static void free_word_table(WordTable *t)
+{
+    free(t->slots);
+    free(t->counts);
+    free(t->sentence_counts);
+    free(t->doc_counts);
+    free(t->last_sentence_ids);
+    free(t->word_offs);
+    free(t->flags);
+    free(t->pool);
+    free(t->carries);
+    t->slots = NULL;
+    t->counts = NULL;
+    t->sentence_counts = NULL;
+    t->doc_counts = NULL;
+    t->last_sentence_ids = NULL;
+    t->word_offs = NULL;
+    t->flags = NULL;
+    t->pool = NULL;
+    t->carries = NULL;
+    t->size = 0;
+}
+
+/*
+ * Shared word table (--shared-table).  Instead of a table per -j worker
+ * and a merge, every worker counts into the document's one table.  A word
+ * the table already holds is looked up there, since nothing moves its
+ * slots while the workers run, and its counters are bumped with relaxed
+ * atomic adds.  A new word goes into an index of its own (linear probing,
+ * a slot claimed with a compare-and-swap, the text in the claiming
+ * worker's arena); once the index is half full, the worker about to claim
+ * a slot doubles it while the others wait at their next word.  The chunks
+ * are cut at sentence ends (chunk_cut()), so each sentence is read by one
+ * worker, which keeps the words seen in its current sentence in a small
+ * set of its own: sentence counts stay exact with no shared per-word
+ * state.  shared_flush() then adds the new words to the table in one pass.
+ */
+#if defined(TOPIC_INDEX_HAVE_THREADS) && defined(__GNUC__)
+#define TOPIC_INDEX_HAVE_SHARED_TABLE 1
+
+#define SHARED_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SHARED_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SHARED_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define SHARED_FIRST_SLOTS 4096
+
+enum
+{
+    SHARED_EMPTY,
+    SHARED_BUSY, /* claimed, being filled in */
+    SHARED_READY
+};
+
+typedef struct
+{
+    uint64_t hash;
+    const char *word; /* lower-cased, in the arena of the worker that added it */
+    uint32_t len;
+    int state;        /* SHARED_*, leaves SHARED_EMPTY by compare-and-swap */
+    uint64_t count;
+    uint64_t sentence_count;
+} SharedSlot;
+
+typedef struct
+{
+    WordTable *table;   /* the words it held before; only counters change */
+    SharedSlot *slots;  /* the words new to it */
+    size_t mask;
+    size_t used;        /* slots claimed */
+    int grow;           /* a worker is waiting to double the slots */
+    int running;        /* workers not done yet */
+    int parked;         /* workers waiting for the doubling */
+    unsigned long grows;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} SharedTable;
+
+/* A word counted in the worker's current sentence */
+typedef struct
+{
+    uint64_t hash;
+    const char *word; /* the text's address stands for the word */
+    long sentence;    /* the sentence id + 1, so 0 is a free slot */
+} SeenSlot;
+
+struct SharedWorker
+{
+    SharedTable *shared;
+    Arena strings;
+    SeenSlot *seen;   /* slots of another sentence count as free */
+    size_t seen_mask;
+    size_t seen_len;  /* words in seen for seen_sentence */
+    long seen_sentence;
+};
+
+static void shared_init(SharedTable *sh, WordTable *t, int nworkers)
+{
+    sh->table = t;
+    sh->slots = (SharedSlot *)xcalloc(SHARED_FIRST_SLOTS, sizeof(SharedSlot));
+    sh->mask = SHARED_FIRST_SLOTS - 1;
+    sh->used = 0;
+    sh->grow = 0;
+    sh->running = nworkers;
+    sh->parked = 0;
+    sh->grows = 0;
+    pthread_mutex_init(&sh->lock, NULL);
+    pthread_cond_init(&sh->cond, NULL);
+}
+
+static void shared_free(SharedTable *sh)
+{
+    free(sh->slots);
+    sh->slots = NULL;
+    pthread_mutex_destroy(&sh->lock);
+    pthread_cond_destroy(&sh->cond);
+}
+
+static void shared_worker_init(SharedWorker *w, SharedTable *sh)
+{
+    w->shared = sh;
+    w->strings.head = NULL;
+    w->strings.blocks = 0;
+    w->seen = (SeenSlot *)xcalloc(64, sizeof(SeenSlot));
+    w->seen_mask = 63;
+    w->seen_len = 0;
+    w->seen_sentence = 0;
+}
+
+static void shared_worker_free(SharedWorker *w)
+{
+    arena_free(&w->strings);
+    free(w->seen);
+    w->seen = NULL;
+}
+
+/* Wait while another worker doubles the slots */
+static void shared_park(SharedTable *sh)
+{
+    pthread_mutex_lock(&sh->lock);
+    sh->parked += 1;
+    pthread_cond_broadcast(&sh->cond);
+    while (SHARED_LOAD(&sh->grow))
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    sh->parked -= 1;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Double the slots of a full index whose mask was mask, once every other
+ * running worker is parked; if another worker got there first, wait for
+ * it instead */
+static void shared_grow(SharedTable *sh, size_t mask)
+{
+    SharedSlot *old;
+    size_t i;
+    pthread_mutex_lock(&sh->lock);
+    if (SHARED_LOAD(&sh->grow) || sh->mask != mask)
+    {
+        pthread_mutex_unlock(&sh->lock);
+        shared_park(sh);
+        return;
+    }
+    SHARED_STORE(&sh->grow, 1);
+    while (sh->parked < sh->running - 1)
+        pthread_cond_wait(&sh->cond, &sh->lock);
+    old = sh->slots;
+    sh->slots = (SharedSlot *)xcalloc(2 * (mask + 1), sizeof(SharedSlot));
+    sh->mask = 2 * mask + 1;
+    for (i = 0; i <= mask; ++i)
+    {
+        size_t j;
+        if (old[i].state != SHARED_READY)
+            continue;
+        for (j = old[i].hash & sh->mask; sh->slots[j].state != SHARED_EMPTY; j = (j + 1) & sh->mask)
+            ;
+        sh->slots[j] = old[i];
+    }
+    free(old);
+    sh->grows += 1;
+    SHARED_STORE(&sh->grow, 0);
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* A worker has counted its chunk */
+static void shared_done(SharedTable *sh)
+{
+    pthread_mutex_lock(&sh->lock);
+    sh->running -= 1;
+    pthread_cond_broadcast(&sh->cond);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* a counter of the table wrapped */
+static void shared_carry(SharedTable *sh, uint32_t id, int counter)
+{
+    pthread_mutex_lock(&sh->lock);
+    *word_carry(sh->table, id, counter, 1) += 1;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Is this the word's first occurrence in the worker's sentence? */
+static int shared_seen(SharedWorker *w, uint64_t h, const char *word, long sentence)
+{
+    size_t i;
+    if (sentence + 1 != w->seen_sentence)
+    {
+        w->seen_sentence = sentence + 1;
+        w->seen_len = 0;
+    }
+    for (i = h & w->seen_mask; w->seen[i].sentence == w->seen_sentence; i = (i + 1) & w->seen_mask)
+        if (w->seen[i].word == word)
+            return 0;
+    w->seen[i].hash = h;
+    w->seen[i].word = word;
+    w->seen[i].sentence = w->seen_sentence;
+    if (++w->seen_len * 2 > w->seen_mask + 1)
+    {
+        /* a long sentence: keep its words in twice the slots */
+        SeenSlot *old = w->seen;
+        size_t n = w->seen_mask + 1, j;
+        w->seen = (SeenSlot *)xcalloc(2 * n, sizeof(SeenSlot));
+        w->seen_mask = 2 * n - 1;
+        for (j = 0; j < n; ++j)
+        {
+            if (old[j].sentence != w->seen_sentence)
+                continue;
+            for (i = old[j].hash & w->seen_mask; w->seen[i].sentence; i = (i + 1) & w->seen_mask)
+                ;
+            w->seen[i] = old[j];
+        }
+        free(old);
+    }
+    return 1;
+}
+
+/* The index slot holding a word new to the table, added if need be;
+ * NULL if the index had to grow first */
+static SharedSlot *shared_slot(SharedWorker *w, uint64_t h, const char *word, size_t len)
+{
+    SharedTable *sh = w->shared;
+    size_t mask = sh->mask, i = h & mask;
+    for (;;)
+    {
+        SharedSlot *s = &sh->slots[i];
+        int state = SHARED_LOAD(&s->state);
+        if (state == SHARED_EMPTY)
+        {
+            int expected = SHARED_EMPTY;
+            char *copy;
+            if (SHARED_LOAD(&sh->used) * 2 >= mask + 1)
+            {
+                shared_grow(sh, mask);
+                return NULL;
+            }
+            if (!__atomic_compare_exchange_n(&s->state, &expected, SHARED_BUSY, 0, __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                continue; /* taken meanwhile: look at it again */
+            copy = arena_alloc(&w->strings, len + 1);
+            lower_copy(copy, word, len);
+            copy[len] = '\0';
+            s->hash = h;
+            s->word = copy;
+            s->len = (uint32_t)len;
+            s->count = 0;
+            s->sentence_count = 0;
+            SHARED_ADD(&sh->used, 1);
+            SHARED_STORE(&s->state, SHARED_READY);
+            return s;
+        }
+        while (state == SHARED_BUSY)
+            state = SHARED_LOAD(&s->state);
+        if (s->hash == h && word_equal(s->word, s->len, word, len))
+            return s;
+        i = (i + 1) & mask;
+    }
+}
+
+/* Count one occurrence of a word in the worker's sentence */
+static void shared_count(SharedWorker *w, uint64_t h, const char *word, size_t len, long sentence)
+{
+    SharedTable *sh = w->shared;
+    WordTable *t = sh->table;
+    uint32_t id;
+    SharedSlot *s;
+    if (SHARED_LOAD(&sh->grow))
+        shared_park(sh);
+    id = lookup_hashed(t, h, word, len);
+    if (id != WORD_NONE)
+    {
+        if (SHARED_ADD(&t->counts[id], 1) == UINT32_MAX)
+            shared_carry(sh, id, COUNTER_WORDS);
+        if (shared_seen(w, h, word_text(t, id), sentence) && SHARED_ADD(&t->sentence_counts[id], 1) == UINT32_MAX)
+            shared_carry(sh, id, COUNTER_SENTENCES);
+        return;
+    }
+    do
+        s = shared_slot(w, h, word, len);
+    while (!s); /* NULL: it waited for the slots to be doubled */
+    SHARED_ADD(&s->count, 1);
+    if (shared_seen(w, h, s->word, sentence))
+        SHARED_ADD(&s->sentence_count, 1);
+}
+
+/* Add the new words to the table, once the workers are done */
+static void shared_flush(SharedTable *sh)
+{
+    WordTable *t = sh->table;
+    size_t i;
+    word_table_reserve(t, t->size + sh->used); /* as in merge_word_table() */
+    for (i = 0; i <= sh->mask; ++i)
+    {
+        const SharedSlot *s = &sh->slots[i];
+        uint32_t id;
+        if (s->state != SHARED_READY)
+            continue;
+        id = intern_hashed(t, s->hash, s->word, s->len);
+        set_word_counter(t, id, COUNTER_WORDS, (long)s->count);
+        set_word_counter(t, id, COUNTER_SENTENCES, (long)s->sentence_count);
+    }
+    t->grows += sh->grows;
+}
+#else
+static void shared_count(SharedWorker *w, uint64_t h, const char *word, size_t len, long sentence)
+{
+    (void)w, (void)h, (void)word, (void)len, (void)sentence;
+}
+#endif
+
+/*
+ * Running top K (--every).  The K best-ranked plain words so far are kept
+ * in a min-heap as they are counted, so a snapshot copies K entries
+ * rather than scanning the table.  Every other plain word ranks below the
+ * heap's root: a word in the heap that is counted again can only rise, so
+ * it sifts down, and any other word can only draw level with the root,
+ * after which it replaces it.  pos[] gives each entry's place in the heap.
+ */
+typedef struct
+{
+    uint32_t *heap;   /* weakest first */
+    size_t len;
+    size_t cap;       /* K */
+    uint32_t *pos;    /* heap index + 1 of each entry, 0 if not in it */
+    size_t pos_cap;
+    const char **topic_keys; /* single-word topics, at their hash */
+    size_t topic_mask;
+    long every;       /* words between snapshots, 0 if timed */
+    long next;        /* the word count due for the next one */
+    void (*snapshot)(void *arg, int due); /* due: the words are up, else a block has been read */
+    void *arg;
+} LiveTop;
+
+static void live_top_init(LiveTop *lt, size_t k, size_t topics)
+{
+    size_t cap = 16;
+    while (cap < topics * 2)
+        cap *= 2;
+    lt->heap = (uint32_t *)xmalloc((k ? k : 1) * sizeof(uint32_t));
+    lt->len = 0;
+    lt->cap = k;
+    lt->pos = NULL;
+    lt->pos_cap = 0;
+    lt->topic_keys = (const char **)xcalloc(cap, sizeof(const char *));
+    lt->topic_mask = cap - 1;
+    lt->every = 0;
+    lt->next = 0;
+    lt->snapshot = NULL;
+    lt->arg = NULL;
+}
+
+static void live_top_free(LiveTop *lt)
+{
+    free(lt->heap);
+    free(lt->pos);
+    free(lt->topic_keys);
+}
+
+/* key is kept out of the heap (lower-case, NUL-terminated, not copied) */
+static void live_top_topic(LiveTop *lt, const char *key, size_t len)
+{
+    size_t i;
+    for (i = hash_word(key, len) & lt->topic_mask; lt->topic_keys[i]; i = (i + 1) & lt->topic_mask)
+        if (strcmp(lt->topic_keys[i], key) == 0)
+            return;
+    lt->topic_keys[i] = key;
+}
+
+/* May entry e go in the heap?  A topic found here is tagged so the
+ * lookup is made once per topic. */
+static int live_top_plain(LiveTop *lt, WordTable *t, uint32_t e)
+{
+    const char *word = word_text(t, e);
+    size_t i;
+    if (t->flags[e] & (WORD_STOP | WORD_TOPIC))
+        return 0;
+    for (i = hash_word(word, word_len(t, e)) & lt->topic_mask; lt->topic_keys[i]; i = (i + 1) & lt->topic_mask)
+    {
+        if (strcmp(lt->topic_keys[i], word) == 0)
+        {
+            t->flags[e] |= WORD_TOPIC;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void live_top_put(LiveTop *lt, size_t i, uint32_t e)
+{
+    lt->heap[i] = e;
+    lt->pos[e] = (uint32_t)i + 1;
+}
+
+/* entry e at heap index i ranks higher than it did */
+static void live_top_sift_down(LiveTop *lt, const WordTable *t, size_t i, uint32_t e)
+{
+    for (;;)
+    {
+        size_t weakest = i, l = 2 * i + 1, r = l + 1;
+        uint32_t w = e;
+        if (l < lt->len && ranks_before(t, w, lt->heap[l]))
+            weakest = l, w = lt->heap[l];
+        if (r < lt->len && ranks_before(t, w, lt->heap[r]))
+            weakest = r, w = lt->heap[r];
+        if (weakest == i)
+            break;
+        live_top_put(lt, i, w);
+        i = weakest;
+    }
+    live_top_put(lt, i, e);
+}
+
+/* Entry e of t has just been counted once more */
+static void live_top_count(LiveTop *lt, WordTable *t, uint32_t e)
+{
+    size_t i;
+    if (e >= lt->pos_cap)
+    {
+        size_t cap = t->cap > e ? t->cap : (size_t)e + 1;
+        lt->pos = (uint32_t *)realloc(lt->pos, cap * sizeof(uint32_t));
+        if (!lt->pos)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(lt->pos + lt->pos_cap, 0, (cap - lt->pos_cap) * sizeof(uint32_t));
+        lt->pos_cap = cap;
+    }
+    if (lt->pos[e])
+    {
+        live_top_sift_down(lt, t, lt->pos[e] - 1, e);
+        return;
+    }
+    if (lt->len < lt->cap)
+    {
+        if (!live_top_plain(lt, t, e))
+            return;
+        /* sift up */
+        for (i = lt->len++; i > 0 && ranks_before(t, lt->heap[(i - 1) / 2], e); i = (i - 1) / 2)
+            live_top_put(lt, i, lt->heap[(i - 1) / 2]);
+        live_top_put(lt, i, e);
+    }
+    else if (lt->cap > 0 && ranks_before(t, e, lt->heap[0]) && live_top_plain(lt, t, e))
+    {
+        lt->pos[lt->heap[0]] = 0;
+        live_top_sift_down(lt, t, 0, e);
+    }
+}
+
+/*
+ * Approximate counting (--approx, --mem SIZE).  Memory stays fixed however
+ * long the input runs:
+ *  - a Count-Min Sketch with conservative update estimates every word's
+ *    count, and a second one the number of sentences containing it;
+ *  - Space-Saving keeps the k heaviest words seen so far, so any word that
+ *    makes up more than 1/k of the text is among them;
+ *  - the topic words are counted exactly in a small table of their own;
+ *  - a small open-addressing table of (sentence, hash tag) stamps stands
+ *    in for a per-sentence set, so a word bumps the sentence sketch once
+ *    per sentence; stamps of earlier sentences count as free slots, so it
+ *    is never cleared, and a sentence too crowded to find a slot in a few
+ *    probes is counted again, keeping the estimate on the high side.
+ * After the input, the topics and the tracked words are written into the
+ * word table with their counts, and the report is built from it as usual.
+ */
+#define CMS_DEPTH 4                 /* rows: estimates hold with p = 1 - e^-4 */
+#define SENTENCE_STAMPS (1UL << 16) /* power of 2 */
+#define STAMP_PROBES 8
+#define DEFAULT_APPROX_MEM (64UL << 20)
+
+typedef struct
+{
+    char *word; /* lower-case */
+    size_t len, cap;
+    uint64_t hash;
+    long count; /* never below the true count */
+    long err;   /* count minus err never exceeds it */
+    size_t pos; /* index in the heap */
+} HeavyItem;
+
+typedef struct
+{
+    uint32_t *words;     /* CMS_DEPTH rows of width counters */
+    uint32_t *sentences; /* the same, counting sentences */
+    size_t width;        /* power of 2 */
+    HeavyItem *items;
+    size_t nitems, k;
+    size_t *heap;  /* item indices, min-heap on count */
+    size_t *index; /* item index + 1 by hash, linear probing; 0 free */
+    size_t index_mask;
+    uint64_t *stamps; /* (sentence id + 1) << 32 | hash tag */
+    WordTable exact;  /* the topic words */
+    long total;       /* words that went into the sketch */
+} Approx;
+
+/* add one to the sketch, raising only the rows at the current minimum */
+static uint32_t cms_add(uint32_t *rows, size_t width, uint64_t h)
+{
+    uint32_t *cell[CMS_DEPTH];
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, m = UINT32_MAX;
+    int i;
+    for (i = 0; i < CMS_DEPTH; ++i)
+    {
+        cell[i] = &rows[(size_t)i * width + ((h1 + (uint32_t)i * h2) & (width - 1))];
+        if (*cell[i] < m)
+            m = *cell[i];
+    }
+    if (m == UINT32_MAX)
+        return m; /* saturated */
+    ++m;
+    for (i = 0; i < CMS_DEPTH; ++i)
+        if (*cell[i] < m)
+            *cell[i] = m;
+    return m;
+}
+
+static uint32_t cms_estimate(const uint32_t *rows, size_t width, uint64_t h)
+{
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, m = UINT32_MAX;
+    int i;
+    for (i = 0; i < CMS_DEPTH; ++i)
+    {
+        uint32_t c = rows[(size_t)i * width + ((h1 + (uint32_t)i * h2) & (width - 1))];
+        if (c < m)
+            m = c;
+    }
+    return m;
+}
+
+/* Split mem between the sketches (3/4) and the Space-Saving items (1/4,
+ * at least enough for keep words) */
+static void approx_init(Approx *a, uint64_t mem, size_t keep)
+{
+    uint64_t sketch = mem - mem / 4 - SENTENCE_STAMPS * sizeof(uint64_t);
+    a->width = 1024;
+    while ((uint64_t)a->width * 2 * 2 * CMS_DEPTH * sizeof(uint32_t) <= sketch)
+        a->width *= 2;
+    a->k = (size_t)(mem / 4 / 128);
+    if (a->k < keep)
+        a->k = keep;
+    if (a->k < 1024)
+        a->k = 1024;
+    a->words = (uint32_t *)xcalloc(a->width * CMS_DEPTH, sizeof(uint32_t));
+    a->sentences = (uint32_t *)xcalloc(a->width * CMS_DEPTH, sizeof(uint32_t));
+    a->items = (HeavyItem *)xcalloc(a->k, sizeof(HeavyItem));
+    a->nitems = 0;
+    a->heap = (size_t *)xmalloc(a->k * sizeof(size_t));
+    a->index_mask = 1;
+    while (a->index_mask < 2 * a->k)
+        a->index_mask *= 2;
+    a->index = (size_t *)xcalloc(a->index_mask, sizeof(size_t));
+    a->index_mask -= 1;
+    a->stamps = (uint64_t *)xcalloc(SENTENCE_STAMPS, sizeof(uint64_t));
+    word_table_init(&a->exact);
+    a->total = 0;
+}
+
+/* count word exactly, outside the sketch */
+static void approx_exact(Approx *a, const char *word, size_t len)
+{
+    intern_word(&a->exact, word, len);
+}
+
+static void approx_free(Approx *a)
+{
+    size_t i;
+    for (i = 0; i < a->nitems; ++i)
+        free(a->items[i].word);
+    free(a->items);
+    free(a->heap);
+    free(a->index);
+    free(a->words);
+    free(a->sentences);
+    free(a->stamps);
+    free_word_table(&a->exact);
+}
+
+static void heavy_swap(Approx *a, size_t i, size_t j)
+{
+    size_t t = a->heap[i];
+    a->heap[i] = a->heap[j];
+    a->heap[j] = t;
+    a->items[a->heap[i]].pos = i;
+    a->items[a->heap[j]].pos = j;
+}
+
+static void heavy_sift_down(Approx *a, size_t i)
+{
+    for (;;)
+    {
+        size_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < a->nitems && a->items[a->heap[l]].count < a->items[a->heap[m]].count)
+            m = l;
+        if (r < a->nitems && a->items[a->heap[r]].count < a->items[a->heap[m]].count)
+            m = r;
+        if (m == i)
+            return;
+        heavy_swap(a, i, m);
+        i = m;
+    }
+}
+
+/* slot in the index holding item, or the free slot where it would go */
+static size_t heavy_slot(const Approx *a, uint64_t h, const char *word, size_t len)
+{
+    size_t i = (size_t)h & a->index_mask;
+    while (a->index[i])
+    {
+        const HeavyItem *it = &a->items[a->index[i] - 1];
+        if (it->hash == h && word_equal(it->word, it->len, word, len))
+            break;
+        i = (i + 1) & a->index_mask;
+    }
+    return i;
+}
+
+/* drop an index slot, shifting later entries of its cluster back */
+static void heavy_unindex(Approx *a, size_t i)
+{
+    size_t j = i;
+    for (;;)
+    {
+        size_t home;
+        j = (j + 1) & a->index_mask;
+        if (!a->index[j])
+            break;
+        home = (size_t)a->items[a->index[j] - 1].hash & a->index_mask;
+        /* the entry at j may fill the hole at i unless its home lies
+         * cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            a->index[i] = a->index[j];
+            i = j;
+        }
+    }
+    a->index[i] = 0;
+}
+
+/* Space-Saving: count a tracked word, or let it replace the least counted
+ * one, inheriting that count as its error */
+static void heavy_offer(Approx *a, uint64_t h, const char *word, size_t len)
+{
+    size_t slot = heavy_slot(a, h, word, len);
+    HeavyItem *it;
+    size_t idx;
+    if (a->index[slot])
+    {
+        it = &a->items[a->index[slot] - 1];
+        it->count += 1;
+        heavy_sift_down(a, it->pos);
+        return;
+    }
+    if (a->nitems < a->k)
+    {
+        /* a count of 1 is never above the heap's minimum: append at the
+         * end, then float up */
+        size_t i = a->nitems++;
+        idx = i;
+        it = &a->items[idx];
+        it->count = 1;
+        it->err = 0;
+        it->pos = i;
+        a->heap[i] = idx;
+        while (i > 0 && a->items[a->heap[(i - 1) / 2]].count > 1)
+        {
+            heavy_swap(a, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+    else
+    {
+        idx = a->heap[0];
+        it = &a->items[idx];
+        heavy_unindex(a, heavy_slot(a, it->hash, it->word, it->len));
+        slot = heavy_slot(a, h, word, len);
+        it->err = it->count;
+        it->count += 1;
+    }
+    if (len + 1 > it->cap)
+    {
+        it->cap = len + 1 > 16 ? len + 1 : 16;
+        free(it->word);
+        it->word = (char *)xmalloc(it->cap);
+    }
+    lower_copy(it->word, word, len);
+    it->word[len] = '\0';
+    it->len = len;
+    it->hash = h;
+    a->index[slot] = idx + 1;
+    heavy_sift_down(a, it->pos);
+}
+
+/* first time this sentence that the word with hash h is seen? */
+static int approx_new_in_sentence(Approx *a, uint64_t h, long current_sentence)
+{
+    uint64_t sentence = (uint64_t)(uint32_t)(current_sentence + 1) << 32;
+    uint64_t key = sentence | (h >> 32);
+    size_t i = (size_t)(h >> 16) & (SENTENCE_STAMPS - 1);
+    int n;
+    for (n = 0; n < STAMP_PROBES; ++n)
+    {
+        uint64_t *s = &a->stamps[i];
+        if (*s == key)
+            return 0;
+        if ((*s & ~(uint64_t)0xffffffffUL) != sentence)
+        {
+            *s = key; /* left over from an earlier sentence */
+            return 1;
+        }
+        i = (i + 1) & (SENTENCE_STAMPS - 1);
+    }
+    return 1;
+}
+
+static void approx_add_hashed(Approx *a, uint64_t h, const char *word, size_t len, long current_sentence)
+{
+    uint32_t e = lookup_hashed(&a->exact, h, word, len);
+    if (e != WORD_NONE)
+    {
+        count_entry(&a->exact, e, current_sentence);
+        return;
+    }
+    a->total += 1;
+    cms_add(a->words, a->width, h);
+    if (approx_new_in_sentence(a, h, current_sentence))
+        cms_add(a->sentences, a->width, h);
+    heavy_offer(a, h, word, len);
+}
+
+/* Write the topics and the tracked words into t with their counts; a
+ * tracked word gets the smaller of its two overestimates, and no more
+ * sentences than the text has */
+static void approx_finish(Approx *a, WordTable *t, long sentences)
+{
+    size_t i;
+    for (i = 0; i <= a->exact.mask; ++i)
+    {
+        const WordSlot *s = &a->exact.slots[i];
+        uint32_t m;
+        if (!SLOT_LIVE(&a->exact, s) || word_counter(&a->exact, s->id, COUNTER_WORDS) == 0)
+            continue;
+        m = intern_hashed(t, s->hash, word_text(&a->exact, s->id), word_len(&a->exact, s->id));
+        set_word_counter(t, m, COUNTER_WORDS, word_counter(&a->exact, s->id, COUNTER_WORDS));
+        set_word_counter(t, m, COUNTER_SENTENCES, word_counter(&a->exact, s->id, COUNTER_SENTENCES));
+        t->last_sentence_ids[m] = a->exact.last_sentence_ids[s->id];
+    }
+    for (i = 0; i < a->nitems; ++i)
+    {
+        const HeavyItem *it = &a->items[i];
+        uint32_t m = intern_hashed(t, it->hash, it->word, it->len);
+        long cms = (long)cms_estimate(a->words, a->width, it->hash);
+        long sent = (long)cms_estimate(a->sentences, a->width, it->hash);
+        long count = cms < it->count ? cms : it->count;
+        if (sent > count)
+            sent = count;
+        if (sent > sentences)
+            sent = sentences;
+        set_word_counter(t, m, COUNTER_WORDS, count);
+        set_word_counter(t, m, COUNTER_SENTENCES, sent);
+    }
+}
+
+/* Bounds for the report: with probability 1 - e^-CMS_DEPTH a count is at
+ * most error above the true one, and every word counted more than floor
+ * times is listed */
+static void approx_bounds(const Approx *a, long *error, long *floor, double *confidence)
+{
+    *error = (long)ceil(2.718281828459045 / (double)a->width * (double)a->total);
+    *floor = (long)(a->total / (long)a->k);
+    *confidence = 1.0 - exp(-(double)CMS_DEPTH);
+}
+
+/*
+ * Stemming (--stem).  Between the lexer and the table every word is
+ * replaced by its stem, so "car" and "cars" are counted as one word.
+ * Stemmers work in place on a lower-case word and return its new length
+ * (never longer); STEMMERS lists the ones --stem=LANG can select.  Stop
+ * words are not stemmed, so the stop lists keep matching.
+ */
+typedef size_t (*StemFn)(char *word, size_t len);
+
+/* Porter's algorithm (M. F. Porter, "An algorithm for suffix stripping",
+ * 1980), as in his reference implementation: b[0, k] is the word and j
+ * the end of the stem a matched suffix leaves. */
+typedef struct
+{
+    char *b;
+    int k, j;
+} Porter;
+
+static int porter_cons(const Porter *p, int i)
+{
+    switch (p->b[i])
+    {
+    case 'a':
+    case 'e':
+    case 'i':
+    case 'o':
+    case 'u':
+        return 0;
+    case 'y':
+        return i == 0 ? 1 : !porter_cons(p, i - 1);
+    default:
+        return 1;
+    }
+}
+
+/* m, the number of vowel-consonant sequences in b[0, j] */
+static int porter_measure(const Porter *p)
+{
+    int n = 0, i = 0;
+    for (;;)
+    {
+        if (i > p->j)
+            return n;
+        if (!porter_cons(p, i))
+            break;
+        ++i;
+    }
+    ++i;
+    for (;;)
+    {
+        for (;;)
+        {
+            if (i > p->j)
+                return n;
+            if (porter_cons(p, i))
+                break;
+            ++i;
+        }
+        ++i;
+        ++n;
+        for (;;)
+        {
+            if (i > p->j)
+                return n;
+            if (!porter_cons(p, i))
+                break;
+            ++i;
+        }
+        ++i;
+    }
+}
+
+static int porter_vowel_in_stem(const Porter *p)
+{
+    int i;
+    for (i = 0; i <= p->j; ++i)
+        if (!porter_cons(p, i))
+            return 1;
+    return 0;
+}
+
+/* b[i - 1, i] is a double consonant */
+static int porter_double(const Porter *p, int i)
+{
+    return i >= 1 && p->b[i] == p->b[i - 1] && porter_cons(p, i);
+}
+
+/* b[i - 2, i] is consonant-vowel-consonant and the last is not w, x or y */
+static int porter_cvc(const Porter *p, int i)
+{
+    if (i < 2 || !porter_cons(p, i) || porter_cons(p, i - 1) || !porter_cons(p, i - 2))
+        return 0;
+    return p->b[i] != 'w' && p->b[i] != 'x' && p->b[i] != 'y';
+}
+
+static int porter_ends(Porter *p, const char *s)
+{
+    int len = (int)strlen(s);
+    if (len > p->k + 1 || memcmp(p->b + p->k - len + 1, s, (size_t)len) != 0)
+        return 0;
+    p->j = p->k - len;
+    return 1;
+}
+
+static void porter_set(Porter *p, const char *s)
+{
+    int len = (int)strlen(s);
+    memcpy(p->b + p->j + 1, s, (size_t)len);
+    p->k = p->j + len;
+}
+
+/* Suffix rules of steps 2 to 4, tried in order; the first suffix that
+ * matches decides, whether or not its condition holds */
+static const char *const PORTER_STEP2[][2] = {
+    {"ational", "ate"}, {"tional", "tion"}, {"enci", "ence"},   {"anci", "ance"},   {"izer", "ize"},
+    {"bli", "ble"},     {"alli", "al"},     {"entli", "ent"},   {"eli", "e"},       {"ousli", "ous"},
+    {"ization", "ize"}, {"ation", "ate"},   {"ator", "ate"},    {"alism", "al"},    {"iveness", "ive"},
+    {"fulness", "ful"}, {"ousness", "ous"}, {"aliti", "al"},    {"iviti", "ive"},   {"biliti", "ble"},
+    {"logi", "log"},    {NULL, NULL}};
+
+static const char *const PORTER_STEP3[][2] = {
+    {"icate", "ic"}, {"ative", ""}, {"alize", "al"}, {"iciti", "ic"},
+    {"ical", "ic"},  {"ful", ""},   {"ness", ""},    {NULL, NULL}};
+
+static const char *const PORTER_STEP4[] = {
+    "al",  "ance", "ence", "er",  "ic",  "able", "ible", "ant", "ement", "ment",
+    "ent", "ion",  "ou",   "ism", "ate", "iti",  "ous",  "ive", "ize",   NULL};
+
+static void porter_replace(Porter *p, const char *const (*rules)[2])
+{
+    for (; rules[0][0]; ++rules)
+    {
+        if (porter_ends(p, rules[0][0]))
+        {
+            if (porter_measure(p) > 0)
+                porter_set(p, rules[0][1]);
+            return;
+        }
+    }
+}
+
+/* plurals and -ed or -ing */
+static void porter_step1ab(Porter *p)
+{
+    if (p->b[p->k] == 's')
+    {
+        if (porter_ends(p, "sses"))
+            p->k -= 2;
+        else if (porter_ends(p, "ies"))
+            porter_set(p, "i");
+        else if (p->b[p->k - 1] != 's')
+            p->k -= 1;
+    }
+    if (porter_ends(p, "eed"))
+    {
+        if (porter_measure(p) > 0)
+            p->k -= 1;
+    }
+    else if ((porter_ends(p, "ed") || porter_ends(p, "ing")) && porter_vowel_in_stem(p))
+    {
+        p->k = p->j;
+        if (porter_ends(p, "at"))
+            porter_set(p, "ate");
+        else if (porter_ends(p, "bl"))
+            porter_set(p, "ble");
+        else if (porter_ends(p, "iz"))
+            porter_set(p, "ize");
+        else if (porter_double(p, p->k))
+        {
+            char c = p->b[p->k];
+            if (c != 'l' && c != 's' && c != 'z')
+                p->k -= 1;
+        }
+        else
+        {
+            p->j = p->k;
+            if (porter_measure(p) == 1 && porter_cvc(p, p->k))
+                porter_set(p, "e");
+        }
+    }
+}
+
+static void porter_step4(Porter *p)
+{
+    const char *const *s;
+    for (s = PORTER_STEP4; *s; ++s)
+    {
+        if (porter_ends(p, *s))
+        {
+            if (strcmp(*s, "ion") == 0 && (p->j < 0 || (p->b[p->j] != 's' && p->b[p->j] != 't')))
+                continue;
+            if (porter_measure(p) > 1)
+                p->k = p->j;
+            return;
+        }
+    }
+}
+
+/* a final -e, and -ll */
+static void porter_step5(Porter *p)
+{
+    p->j = p->k;
+    if (p->b[p->k] == 'e')
+    {
+        int m = porter_measure(p);
+        if (m > 1 || (m == 1 && !porter_cvc(p, p->k - 1)))
+            p->k -= 1;
+    }
+    if (p->b[p->k] == 'l' && porter_double(p, p->k) && porter_measure(p) > 1)
+        p->k -= 1;
+}
+
+/* English: Porter's stemmer, for words of ASCII letters only */
+static size_t stem_porter(char *word, size_t len)
+{
+    Porter p;
+    size_t i;
+    if (len <= 2)
+        return len;
+    for (i = 0; i < len; ++i)
+        if (word[i] < 'a' || word[i] > 'z')
+            return len;
+    p.b = word;
+    p.k = (int)len - 1;
+    p.j = 0;
+    porter_step1ab(&p);
+    if (p.k > 0)
+    {
+        if (porter_ends(&p, "y") && porter_vowel_in_stem(&p))
+            p.b[p.k] = 'i';
+        porter_replace(&p, PORTER_STEP2);
+        porter_replace(&p, PORTER_STEP3);
+        porter_step4(&p);
+        porter_step5(&p);
+    }
+    return (size_t)p.k + 1;
+}
+
+static const struct
+{
+    const char *lang;
+    StemFn stem;
+} STEMMERS[] = {{"en", stem_porter}, {NULL, NULL}};
+
+static StemFn stemmer; /* set by --stem */
+
+/* Stem a lower-case key in place (see above); returns the new length */
+static size_t stem_key(char *key, size_t len)
+{
+    if (!stemmer || stop_set_contains(&stop_words, hash_word(key, len), key, len))
+        return len;
+    return stemmer(key, len);
+}
+
+/* Memo of surface form -> stem, so every distinct form is stemmed once per
+ * run rather than once per occurrence.  Open addressing with linear
+ * probing; past STEM_CACHE_MAX forms new ones are stemmed without being
+ * kept, which bounds the memory --approx runs use. */
+#define STEM_CACHE_MAX (1u << 20)
+
+typedef struct
+{
+    const char *word; /* lower-case surface form, NULL in unused slots */
+    const char *stem;
+    uint64_t hash;      /* hash_word(word) */
+    uint64_t stem_hash; /* hash_word(stem) */
+    size_t len;
+    size_t stem_len;
+} StemSlot;
+
+typedef struct
+{
+    StemSlot *slots; /* NULL until the first word */
+    size_t mask;
+    size_t size;
+    Arena strings;
+    char *scratch; /* stem of a form that is not kept */
+    size_t scratch_cap;
+    StemSlot spare;
+} StemCache;
+
+static void stem_cache_free(StemCache *c)
+{
+    free(c->slots);
+    free(c->scratch);
+    arena_free(&c->strings);
+    memset(c, 0, sizeof(*c));
+}
+
+static void stem_cache_grow(StemCache *c)
+{
+    StemSlot *old = c->slots;
+    size_t old_cap = old ? c->mask + 1 : 0, i;
+    size_t cap = old ? old_cap * 2 : 1024;
+    c->slots = (StemSlot *)xcalloc(cap, sizeof(StemSlot));
+    c->mask = cap - 1;
+    for (i = 0; i < old_cap; ++i)
+    {
+        size_t j;
+        if (!old[i].word)
+            continue;
+        for (j = old[i].hash & c->mask; c->slots[j].word; j = (j + 1) & c->mask)
+            ;
+        c->slots[j] = old[i];
+    }
+    free(old);
+}
+
+/* The stem of a word given as a slice of any case, hash h */
+static const StemSlot *stem_lookup(StemCache *c, uint64_t h, const char *word, size_t len)
+{
+    StemSlot *slot;
+    char *stem;
+    size_t i;
+    if (c->slots)
+    {
+        for (i = h & c->mask; c->slots[i].word; i = (i + 1) & c->mask)
+        {
+            slot = &c->slots[i];
+            if (slot->hash == h && word_equal(slot->word, slot->len, word, len))
+                return slot;
+        }
+    }
+
+    if (c->size < STEM_CACHE_MAX)
+    {
+        char *form;
+        if (!c->slots || (c->size + 1) * 5 > (c->mask + 1) * 4)
+            stem_cache_grow(c);
+        for (i = h & c->mask; c->slots[i].word; i = (i + 1) & c->mask)
+            ;
+        slot = &c->slots[i];
+        form = arena_alloc(&c->strings, 2 * len + 2);
+        lower_copy(form, word, len);
+        form[len] = '\0';
+        stem = form + len + 1;
+        c->size += 1;
+        slot->word = form;
+    }
+    else
+    {
+        if (len + 1 > c->scratch_cap)
+        {
+            c->scratch_cap = 2 * (len + 1);
+            free(c->scratch);
+            c->scratch = (char *)xmalloc(c->scratch_cap);
+        }
+        slot = &c->spare;
+        stem = c->scratch;
+    }
+    lower_copy(stem, word, len);
+    slot->hash = h;
+    slot->len = len;
+    slot->stem = stem;
+    slot->stem_len = stem_key(stem, len);
+    stem[slot->stem_len] = '\0';
+    slot->stem_hash = hash_word(stem, slot->stem_len);
+    return slot;
+}
+
+/*
+ * Phrases and n-grams (multi-word topics, --ngrams N).  The lexer keeps a
+ * rolling polynomial hash over the hashes of the words it emits: prefix
+ * P(k) = P(k-1) * GRAM_BASE + h(k) (mod 2^64), so the last n words hash to
+ * P(k) - P(k-n) * GRAM_BASE^n for any n at once, and no phrase text is
+ * ever put together while counting.  Phrases end at sentence boundaries,
+ * which gives them the same sentence counts as single words.  Only the
+ * phrase topics, and every n-gram of the --ngrams size, are counted, each
+ * in a GramTable entry that keeps its words as hashes; the report looks
+ * the words up in the word table.
+ */
+#define NGRAM_MAX 4 /* words in a phrase topic or an n-gram */
+#define GRAM_BASE 0x9e3779b97f4a7c15ULL
+
+static unsigned gram_sizes;        /* bit n set: phrases of n words are counted */
+static int gram_report;            /* --ngrams N: count and report every N-gram */
+static uint64_t *gram_topics;      /* hashes of the phrase topics, 0 = free */
+static size_t gram_topics_mask;
+static uint64_t gram_base_pow[NGRAM_MAX + 1];
+
+typedef struct
+{
+    uint64_t hash; /* gram_hash(), 0 in unused slots */
+    uint64_t words[NGRAM_MAX];
+    unsigned n;
+    unsigned flags; /* WORD_TOPIC once a topic's row */
+    long count;
+    long sentence_count;
+    long first_sentence_id;
+    long last_sentence_id;
+} GramEntry;
+
+typedef struct
+{
+    GramEntry *slots;
+    size_t mask;
+    size_t size;
+} GramTable;
+
+/* final hash of the n words whose rolling hash is raw; never 0 */
+static uint64_t gram_hash(uint64_t raw, unsigned n)
+{
+    return hash_mix(raw ^ n, HASH_SECRET1) | 1;
+}
+
+/* gram_hash() of words given lower-cased, separated by single spaces */
+static uint64_t gram_hash_text(const char *key, unsigned *n)
+{
+    uint64_t raw = 0;
+    *n = 0;
+    for (;;)
+    {
+        size_t len = strcspn(key, " ");
+        raw = raw * GRAM_BASE + hash_word(key, len);
+        *n += 1;
+        if (!key[len])
+            break;
+        key += len + 1;
+    }
+    return gram_hash(raw, *n);
+}
+
+static void gram_init(void)
+{
+    int n;
+    gram_base_pow[0] = 1;
+    for (n = 1; n <= NGRAM_MAX; ++n)
+        gram_base_pow[n] = gram_base_pow[n - 1] * GRAM_BASE;
+}
+
+/* Count phrases of the n words whose hash is h.  The set is sized by
+ * gram_topics_init() for every phrase topic, at most a quarter full. */
+static void gram_topic_add(uint64_t h, unsigned n)
+{
+    size_t i;
+    for (i = h & gram_topics_mask; gram_topics[i] && gram_topics[i] != h; i = (i + 1) & gram_topics_mask)
+        ;
+    gram_topics[i] = h;
+    gram_sizes |= 1u << n;
+}
+
+static void gram_topics_init(size_t count)
+{
+    size_t cap = 16;
+    while (cap < count * 4)
+        cap *= 2;
+    gram_topics = (uint64_t *)xcalloc(cap, sizeof(uint64_t));
+    gram_topics_mask = cap - 1;
+}
+
+static int gram_topic_find(uint64_t h)
+{
+    size_t i;
+    for (i = h & gram_topics_mask; gram_topics[i]; i = (i + 1) & gram_topics_mask)
+        if (gram_topics[i] == h)
+            return 1;
+    return 0;
+}
+
+static GramTable *gram_table_new(void)
+{
+    GramTable *g = (GramTable *)xmalloc(sizeof(GramTable));
+    g->mask = 1023;
+    g->size = 0;
+    g->slots = (GramEntry *)xcalloc(g->mask + 1, sizeof(GramEntry));
+    return g;
+}
+
+static void gram_table_reset(GramTable *g)
+{
+    if (g->size > 0)
+        memset(g->slots, 0, (g->mask + 1) * sizeof(GramEntry));
+    g->size = 0;
+}
+
+static void gram_table_free(GramTable *g)
+{
+    if (!g)
+        return;
+    free(g->slots);
+    free(g);
+}
+
+static GramEntry *gram_find(const GramTable *g, uint64_t h)
+{
+    size_t i;
+    for (i = h & g->mask; g->slots[i].hash; i = (i + 1) & g->mask)
+        if (g->slots[i].hash == h)
+            return &g->slots[i];
+    return NULL;
+}
+
+static void gram_table_grow(GramTable *g)
+{
+    GramEntry *old = g->slots;
+    size_t old_cap = g->mask + 1, i, j;
+    g->mask = old_cap * 2 - 1;
+    g->slots = (GramEntry *)xcalloc(old_cap * 2, sizeof(GramEntry));
+    for (j = 0; j < old_cap; ++j)
+    {
+        if (!old[j].hash)
+            continue;
+        for (i = old[j].hash & g->mask; g->slots[i].hash; i = (i + 1) & g->mask)
+            ;
+        g->slots[i] = old[j];
+    }
+    free(old);
+}
+
+/* Obtain or create the entry for the n words (hashes, oldest first) that
+ * hash to h, without counting it */
+static GramEntry *gram_intern(GramTable *g, uint64_t h, const uint64_t *words, unsigned n)
+{
+    GramEntry *e;
+    size_t i;
+    for (i = h & g->mask; g->slots[i].hash; i = (i + 1) & g->mask)
+        if (g->slots[i].hash == h)
+            return &g->slots[i];
+    if ((g->size + 1) * 5 > (g->mask + 1) * 4)
+    {
+        gram_table_grow(g);
+        for (i = h & g->mask; g->slots[i].hash; i = (i + 1) & g->mask)
+            ;
+    }
+    e = &g->slots[i];
+    e->hash = h;
+    memcpy(e->words, words, n * sizeof(uint64_t));
+    e->n = n;
+    e->first_sentence_id = -1;
+    e->last_sentence_id = -1;
+    g->size += 1;
+    return e;
+}
+
+static void gram_count(GramEntry *e, long current_sentence)
+{
+    e->count += 1;
+    if (e->last_sentence_id != current_sentence)
+    {
+        if (e->sentence_count == 0)
+            e->first_sentence_id = current_sentence;
+        e->sentence_count += 1;
+        e->last_sentence_id = current_sentence;
+    }
+}
+
+/* Fold a chunk's n-gram counts into dst, as merge_word_table() does */
+static void merge_gram_table(GramTable *dst, const GramTable *src, long sentence_base)
+{
+    size_t i;
+    while ((dst->size + src->size) * 5 > (dst->mask + 1) * 4)
+        gram_table_grow(dst);
+    for (i = 0; i <= src->mask; ++i)
+    {
+        const GramEntry *e = &src->slots[i];
+        if (e->hash)
+        {
+            GramEntry *m = gram_intern(dst, e->hash, e->words, e->n);
+            long first = sentence_base + e->first_sentence_id;
+            m->count += e->count;
+            m->sentence_count += e->sentence_count;
+            if (m->last_sentence_id == first)
+                m->sentence_count -= 1;
+            if (m->first_sentence_id < 0)
+                m->first_sentence_id = first;
+            m->last_sentence_id = sentence_base + e->last_sentence_id;
+        }
+    }
+}
+
+/*
+ * Topic density by position (--window N[w|s|b]).  The text is cut into
+ * windows of N words, N sentences or N bytes, and each window keeps its
+ * word and sentence totals and one count per topic.  They are filled in
+ * the same pass as the word table, so memory grows with the number of
+ * windows, not with the number of occurrences.  A word or phrase counts
+ * in the window that holds its last word (or, for bytes, its last byte);
+ * a sentence counts in the window where it ends.
+ */
+enum
+{
+    WINDOW_WORDS,
+    WINDOW_SENTENCES,
+    WINDOW_BYTES
+};
+
+static const char *const window_unit_names[] = {"words", "sentences", "bytes"};
+
+static uint64_t window_size; /* 0 without --window */
+static int window_unit;      /* WINDOW_* */
+static size_t window_topics; /* counts per window: one per distinct topic */
+
+typedef struct
+{
+    uint64_t hash; /* hash_word() of a topic, gram_hash() of a phrase */
+    long column;   /* -1 in free slots */
+} WindowKey;
+
+static WindowKey *window_keys;
+static size_t window_keys_mask;
+
+/* N, a k/M/G multiple of N, and an optional unit: w (the default), s or b */
+static void window_parse(const char *val)
+{
+    char *endp;
+    unsigned long long v = strtoull(val, &endp, 10);
+    int shift = 0;
+    if (*endp == 'k' || *endp == 'K')
+        shift = 10;
+    else if (*endp == 'm' || *endp == 'M')
+        shift = 20;
+    else if (*endp == 'g' || *endp == 'G')
+        shift = 30;
+    if (shift)
+        ++endp;
+    window_unit = WINDOW_WORDS;
+    if (*endp == 's')
+        window_unit = WINDOW_SENTENCES;
+    else if (*endp == 'b' || *endp == 'B')
+        window_unit = WINDOW_BYTES;
+    if (*endp == 'w' || window_unit != WINDOW_WORDS)
+        ++endp;
+    if (*val < '0' || *val > '9' || *endp != '\0' || v == 0 || v > (~0ULL >> shift))
+    {
+        fprintf(stderr, "topic_index: --window expects a count such as 1000, 50s or 64kb\n");
+        exit(EXIT_FAILURE);
+    }
+    window_size = (uint64_t)v << shift;
+}
+
+/* Room for count topics, at most half full */
+static void window_keys_init(size_t count)
+{
+    size_t cap = 16, i;
+    while (cap < count * 2)
+        cap *= 2;
+    window_keys = (WindowKey *)xmalloc(cap * sizeof(WindowKey));
+    for (i = 0; i < cap; ++i)
+        window_keys[i].column = -1;
+    window_keys_mask = cap - 1;
+    window_topics = 0;
+}
+
+/* Column of the topic with hash h, given a new one the first time */
+static size_t window_key_add(uint64_t h)
+{
+    size_t i;
+    for (i = h & window_keys_mask; window_keys[i].column >= 0; i = (i + 1) & window_keys_mask)
+        if (window_keys[i].hash == h)
+            return (size_t)window_keys[i].column;
+    window_keys[i].hash = h;
+    window_keys[i].column = (long)window_topics;
+    return window_topics++;
+}
+
+static long window_key_find(uint64_t h)
+{
+    size_t i;
+    for (i = h & window_keys_mask; window_keys[i].column >= 0; i = (i + 1) & window_keys_mask)
+        if (window_keys[i].hash == h)
+            return window_keys[i].column;
+    return -1;
+}
+
+/* Tokenizer state carried across input blocks */
+typedef struct
+{
+    WordTable *table; /* where words are counted, NULL to only split them */
+    Approx *approx;   /* with --approx: counts instead of the table */
+    char *buf;        /* word that spans blocks, lower-cased */
+    size_t buf_cap;
+    size_t buf_len;
+    int buf_wide;              /* buf holds non-ASCII word bytes */
+    char *fold;                /* case-folded copy of a non-ASCII word */
+    size_t fold_cap;
+    unsigned char pend[4];     /* UTF-8 sequence cut by the end of the last block */
+    size_t pend_len;
+    long total_words;
+    long total_sentences;
+    long current_sentence_id;
+    int sent_state;       /* SENT_* of the terminators since the last word start */
+    uint64_t sent_at;     /* document offset of the last of them */
+    int sent_newline;     /* a line break follows it */
+    unsigned char last_byte; /* of the bytes lexer_scan() was last given */
+    unsigned char word_first; /* the current word's first byte, as written */
+    int word_cap;         /* the current word starts with an ASCII capital and a
+                             lower-case letter, 2 if the block ended after the capital */
+    unsigned names;       /* bit 0: the last word ended is capitalised (word_cap),
+                             bit 1: the one before it */
+    int keep_pending;     /* lexer_finish() leaves sent_state for an index */
+    uint64_t total_bytes; /* input fed through lex_block() */
+    unsigned long buf_grows;
+    unsigned char *block; /* read buffer for streamed input, kept between documents */
+    size_t block_size;
+    ReadAhead *ahead;     /* with --read-ahead: the ring and its reader thread, kept too */
+    StemCache *stems;       /* with --stem, created on the first word */
+    StemCache *chunk_stems; /* MAX_THREADS memos lent to lex_parallel() chunks */
+    GramTable *grams;       /* phrase and n-gram counts, NULL without them */
+    uint64_t gram_prefix[NGRAM_MAX]; /* rolling hash before each of the last words */
+    uint64_t gram_words[NGRAM_MAX];  /* hashes of the last words */
+    uint64_t gram_rolling;           /* rolling hash up to the last word */
+    unsigned long gram_len;          /* words in the sentence so far */
+    long *win_counts;    /* with --window: window_topics counts per window */
+    long *win_words;     /* words in each window */
+    long *win_sentences; /* sentence ends in each window */
+    size_t win_base;     /* number of the window in win_*[0] */
+    size_t win_len;      /* windows opened, the last is the current one */
+    size_t win_cap;
+    uint64_t win_end;    /* position where the current window ends */
+    uint64_t fed;        /* document offset of the next byte for lexer_feed() */
+    uint64_t origin;     /* document offset of the bytes lexer_scan() is on */
+    uint64_t at;         /* document offset of the last byte of the word emitted */
+    SharedWorker *shared; /* a lex_parallel() chunk counting into a SharedTable */
+    LiveTop *live;        /* with --every: the running top K and the snapshots */
+} Lexer;
+
+static void lexer_init(Lexer *lx, WordTable *table)
+{
+    lx->table = table;
+    lx->approx = NULL;
+    lx->buf = (char *)xmalloc(INITIAL_BUF_SIZE);
+    lx->buf_cap = INITIAL_BUF_SIZE;
+    lx->buf_len = 0;
+    lx->buf_wide = 0;
+    lx->fold = NULL;
+    lx->fold_cap = 0;
+    lx->pend_len = 0;
+    lx->total_words = 0;
+    lx->total_sentences = 0;
+    lx->current_sentence_id = 0;
+    lx->sent_state = SENT_NONE;
+    lx->sent_at = 0;
+    lx->sent_newline = 0;
+    lx->last_byte = 0;
+    lx->word_first = 0;
+    lx->word_cap = 0;
+    lx->names = 0;
+    lx->keep_pending = 0;
+    lx->total_bytes = 0;
+    lx->buf_grows = 0;
+    lx->block = NULL;
+    lx->block_size = 0;
+    lx->ahead = NULL;
+    lx->stems = NULL;
+    lx->chunk_stems = NULL;
+    lx->grams = table && gram_sizes ? gram_table_new() : NULL;
+    lx->gram_rolling = 0;
+    lx->gram_len = 0;
+    lx->win_counts = NULL;
+    lx->win_words = NULL;
+    lx->win_sentences = NULL;
+    lx->win_base = 0;
+    lx->win_len = 0;
+    lx->win_cap = 0;
+    lx->win_end = 0;
+    lx->fed = 0;
+    lx->origin = 0;
+    lx->at = 0;
+    lx->shared = NULL;
+    lx->live = NULL;
+}
+
+/* Start a new document, keeping the buffers */
+static void lexer_reset(Lexer *lx)
+{
+    lx->buf_len = 0;
+    lx->buf_wide = 0;
+    lx->pend_len = 0;
+    lx->total_words = 0;
+    lx->total_sentences = 0;
+    lx->current_sentence_id = 0;
+    lx->sent_state = SENT_NONE;
+    lx->names = 0;
+    lx->total_bytes = 0;
+    lx->gram_rolling = 0;
+    lx->gram_len = 0;
+    if (lx->grams)
+        gram_table_reset(lx->grams);
+    lx->win_base = 0;
+    lx->win_len = 0;
+    lx->win_end = 0;
+    lx->fed = 0;
+}
+
+/* append n word bytes, lower-casing them on the way in */
+static void lexer_append(Lexer *lx, const unsigned char *p, size_t n)
+{
+    if (lx->buf_len + n + 1 > lx->buf_cap)
+    {
+        while (lx->buf_len + n + 1 > lx->buf_cap)
+            lx->buf_cap *= 2;
+        lx->buf = (char *)realloc(lx->buf, lx->buf_cap);
+        lx->buf_grows += 1;
+        if (!lx->buf)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lower_copy(lx->buf + lx->buf_len, (const char *)p, n);
+    lx->buf_len += n;
+}
+
+/* Open windows until the current one holds position at (in window_unit) */
+static void lexer_window_to(Lexer *lx, uint64_t at)
+{
+    while (lx->win_len == 0 || at >= lx->win_end)
+    {
+        size_t w = lx->win_len, cols = window_topics ? window_topics : 1;
+        if (w == lx->win_cap)
+        {
+            lx->win_cap = lx->win_cap ? lx->win_cap * 2 : 64;
+            lx->win_counts = (long *)realloc(lx->win_counts, lx->win_cap * cols * sizeof(long));
+            lx->win_words = (long *)realloc(lx->win_words, lx->win_cap * sizeof(long));
+            lx->win_sentences = (long *)realloc(lx->win_sentences, lx->win_cap * sizeof(long));
+            if (!lx->win_counts || !lx->win_words || !lx->win_sentences)
+            {
+                fprintf(stderr, "topic_index: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        memset(lx->win_counts + w * cols, 0, cols * sizeof(long));
+        lx->win_words[w] = 0;
+        lx->win_sentences[w] = 0;
+        lx->win_end = w == 0 ? (lx->win_base + 1) * window_size : lx->win_end + window_size;
+        lx->win_len = w + 1;
+    }
+}
+
+/* count an occurrence of the word or phrase with hash h, if it is a topic,
+ * in the current window */
+static void lexer_window_hit(Lexer *lx, uint64_t h)
+{
+    long col = window_key_find(h);
+    if (col >= 0)
+        lx->win_counts[(lx->win_len - 1) * window_topics + (size_t)col] += 1;
+}
+
+static void lexer_window_word(Lexer *lx, uint64_t h)
+{
+    if (window_unit == WINDOW_WORDS)
+        lexer_window_to(lx, (uint64_t)lx->total_words);
+    else if (window_unit == WINDOW_SENTENCES)
+        lexer_window_to(lx, (uint64_t)lx->current_sentence_id);
+    else
+        lexer_window_to(lx, lx->at);
+    lx->win_words[lx->win_len - 1] += 1;
+    lexer_window_hit(lx, h);
+}
+
+/* a sentence ends with the terminator at document offset at */
+static void lexer_window_sentence(Lexer *lx, uint64_t at)
+{
+    if (window_unit == WINDOW_WORDS)
+        lexer_window_to(lx, lx->total_words > 0 ? (uint64_t)lx->total_words - 1 : 0);
+    else if (window_unit == WINDOW_SENTENCES)
+        lexer_window_to(lx, (uint64_t)lx->current_sentence_id);
+    else
+        lexer_window_to(lx, at);
+    lx->win_sentences[lx->win_len - 1] += 1;
+}
+
+/* Add the windows of a chunk's lexer to dst, whose windows all come
+ * before them or are the first of them */
+static void merge_windows(Lexer *dst, const Lexer *src)
+{
+    size_t i, j;
+    for (i = 0; i < src->win_len; ++i)
+    {
+        size_t w;
+        lexer_window_to(dst, (uint64_t)(src->win_base + i) * window_size);
+        w = dst->win_len - 1;
+        dst->win_words[w] += src->win_words[i];
+        dst->win_sentences[w] += src->win_sentences[i];
+        for (j = 0; j < window_topics; ++j)
+            dst->win_counts[w * window_topics + j] += src->win_counts[i * window_topics + j];
+    }
+}
+
+/* Roll the word with hash h into the phrase hash and count the phrases
+ * of every tracked size that end with it */
+static void lexer_gram(Lexer *lx, uint64_t h)
+{
+    unsigned long k = lx->gram_len;
+    uint64_t words[NGRAM_MAX];
+    unsigned n, i;
+    lx->gram_prefix[k % NGRAM_MAX] = lx->gram_rolling;
+    lx->gram_words[k % NGRAM_MAX] = h;
+    lx->gram_rolling = lx->gram_rolling * GRAM_BASE + h;
+    lx->gram_len = k + 1;
+    for (n = 2; n <= NGRAM_MAX && n <= k + 1; ++n)
+    {
+        unsigned long start = k + 1 - n;
+        uint64_t gh;
+        if (!(gram_sizes & (1u << n)))
+            continue;
+        gh = gram_hash(lx->gram_rolling - lx->gram_prefix[start % NGRAM_MAX] * gram_base_pow[n], n);
+        if ((int)n != gram_report && !gram_topic_find(gh))
+            continue;
+        for (i = 0; i < n; ++i)
+            words[i] = lx->gram_words[(start + i) % NGRAM_MAX];
+        gram_count(gram_intern(lx->grams, gh, words, n), lx->current_sentence_id);
+        if (window_size)
+            lexer_window_hit(lx, gh);
+    }
+}
+
+/* count the stem of a word instead of the word */
+static void lexer_emit_stem(Lexer *lx, const char *word, size_t len)
+{
+    const StemSlot *s;
+    if (!lx->stems)
+        lx->stems = (StemCache *)xcalloc(1, sizeof(StemCache));
+    s = stem_lookup(lx->stems, hash_word(word, len), word, len);
+    if (lx->approx)
+        approx_add_hashed(lx->approx, s->stem_hash, s->stem, s->stem_len, lx->current_sentence_id);
+    else if (lx->shared)
+        shared_count(lx->shared, s->stem_hash, s->stem, s->stem_len, lx->current_sentence_id);
+    else if (lx->table)
+    {
+        uint32_t id = intern_hashed(lx->table, s->stem_hash, s->stem, s->stem_len);
+        count_entry(lx->table, id, lx->current_sentence_id);
+        if (lx->live)
+            live_top_count(lx->live, lx->table, id);
+    }
+    if (window_size)
+        lexer_window_word(lx, s->stem_hash);
+    if (lx->grams)
+        lexer_gram(lx, s->stem_hash);
+    lx->total_words += 1;
+    if (lx->live && lx->total_words == lx->live->next)
+        lx->live->snapshot(lx->live->arg, 1);
+}
+
+static void lexer_emit(Lexer *lx, const char *word, size_t len)
+{
+    uint64_t h;
+    if (stemmer)
+    {
+        lexer_emit_stem(lx, word, len);
+        return;
+    }
+    h = hash_word(word, len);
+    if (lx->approx)
+        approx_add_hashed(lx->approx, h, word, len, lx->current_sentence_id);
+    else if (lx->shared)
+        shared_count(lx->shared, h, word, len, lx->current_sentence_id);
+    else if (lx->table)
+    {
+        uint32_t id = intern_hashed(lx->table, h, word, len);
+        count_entry(lx->table, id, lx->current_sentence_id);
+        if (lx->live)
+            live_top_count(lx->live, lx->table, id);
+    }
+    if (window_size)
+        lexer_window_word(lx, h);
+    if (lx->grams)
+        lexer_gram(lx, h);
+    lx->total_words += 1;
+    if (lx->live && lx->total_words == lx->live->next)
+        lx->live->snapshot(lx->live->arg, 1);
+}
+
+/* emit a word with non-ASCII bytes, case-folding it first */
+static void lexer_emit_wide(Lexer *lx, const char *word, size_t len)
+{
+    if (FOLD_ROOM(len) > lx->fold_cap)
+    {
+        lx->fold_cap = FOLD_ROOM(len) > 2 * lx->fold_cap ? FOLD_ROOM(len) : 2 * lx->fold_cap;
+        lx->fold = (char *)realloc(lx->fold, lx->fold_cap);
+        if (!lx->fold)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lexer_emit(lx, lx->fold, fold_word(lx->fold, word, len));
+}
+
+/* End the sentence at the terminator at lx->sent_at */
+static void lexer_sentence_end(Lexer *lx)
+{
+    if (window_size)
+        lexer_window_sentence(lx, lx->sent_at);
+    lx->total_sentences += 1;
+    lx->current_sentence_id = lx->total_sentences; /* next sentence id */
+    lx->gram_len = 0; /* phrases do not cross sentences */
+    lx->gram_rolling = 0;
+    lx->sent_state = SENT_NONE;
+}
+
+/* Where the bytes after the terminator at lx->sent_at start in p, the
+ * bytes lexer_scan() is on */
+static const unsigned char *lexer_after_terminator(const Lexer *lx, const unsigned char *p)
+{
+    int64_t d = (int64_t)(lx->sent_at - lx->origin); /* < 0 if before p, even from an index */
+    return d >= 0 ? p + d + 1 : p;
+}
+
+/* The next word starts at document offset at with the byte first, after
+ * the byte prev and the gap[0, len) of the bytes since the terminators
+ * that this block holds: settle the terminators before it */
+static void lexer_sentence_word(Lexer *lx, uint64_t at, unsigned prev, unsigned first, const unsigned char *gap,
+                                size_t len)
+{
+    int newline = lx->sent_newline || memchr(gap, '\n', len) != NULL;
+    if (at != lx->sent_at + 1 && sentence_ends(lx->sent_state, prev, first, newline))
+        lexer_sentence_end(lx);
+    lx->sent_state = SENT_NONE;
+}
+
+/* Tokenize one block of input.  Words that lie wholly inside the block are
+ * handed to the table as slices of it; a word touching the end of the block
+ * is copied into the buffer until the next block (or lexer_finish)
+ * terminates it.
+ *
+ * The block is classified CLASSIFY_WIDTH bytes at a time.  A word starts
+ * where a word bit follows a clear one and ends where a clear bit follows a
+ * set one, so the loop visits only word starts, word ends and terminators,
+ * in input order, rather than every byte.
+ *
+ * Windows with bytes above 0x7f get their word bits from the UTF-8
+ * decoder, and the words that contain such bytes are case-folded on the
+ * way out; sbit and wide keep track of whether the current word has any.
+ * The block must not end inside a sequence (lexer_feed() sees to that).
+ *
+ * A terminator only marks a candidate sentence end.  Its kind comes from
+ * the word right before it and the next word start decides it (see
+ * sentence_ends()), found in the window's start bits; only a terminator
+ * with no word after it in the window is carried to the next one.  Word
+ * starts and ends cost nothing extra. */
+static void lexer_scan(Lexer *lx, const unsigned char *p, size_t n)
+{
+    const unsigned char *start = p; /* start of the current word */
+    uint64_t carry = lx->buf_len > 0; /* a word runs in from the last block */
+    uint64_t sbit = 1;                /* first bit of the current word in the window */
+    uint64_t spill = 0;
+    int wide = lx->buf_wide;
+    size_t carried = 0; /* length of the word from the last block, once joined */
+    size_t off;
+    if (lx->word_cap == 2 && n > 0)
+        lx->word_cap = (unsigned)(p[0] - 'a') < 26u; /* the carried word's second letter */
+    for (off = 0; off < n; off += CLASSIFY_WIDTH)
+    {
+        const unsigned char *base = p + off;
+        size_t len = n - off < CLASSIFY_WIDTH ? n - off : CLASSIFY_WIDTH;
+        uint64_t word, term, high, prev, starts, ends, events;
+        if (len == CLASSIFY_WIDTH)
+        {
+            classify_block(base, &word, &term, &high);
+        }
+        else
+        {
+            /* zero padding is neither word nor terminator */
+            unsigned char tail[CLASSIFY_WIDTH];
+            memcpy(tail, base, len);
+            memset(tail + len, 0, CLASSIFY_WIDTH - len);
+            classify_block(tail, &word, &term, &high);
+        }
+        if (high)
+        {
+            word &= ~high;
+            if (utf8_words)
+                word |= utf8_word_bits(base, n - off, high, &spill);
+            high &= word;
+        }
+        prev = (word << 1) | carry;
+        starts = word & ~prev;
+        ends = ~word & prev;
+        if (len < CLASSIFY_WIDTH)
+            ends &= ((uint64_t)1 << len) - 1; /* the padding ends nothing */
+        if (lx->sent_state && starts && !(term & ((starts & -starts) - 1)))
+        {
+            /* the first word here follows terminators from before */
+            unsigned j = lowest_bit(starts);
+            const unsigned char *gap = lexer_after_terminator(lx, p);
+            lexer_sentence_word(lx, lx->origin + (uint64_t)(base + j - p), base + j > p ? *(base + j - 1) : lx->last_byte,
+                                base[j], gap, (size_t)(base + j - gap));
+        }
+        events = starts | ends | term;
+        while (events)
+        {
+            unsigned i = lowest_bit(events);
+            uint64_t bit = (uint64_t)1 << i;
+            events &= events - 1;
+            if (ends & bit)
+            {
+                /* Non-word character: finish word */
+                if (high & (bit - 1) & ~(sbit - 1))
+                    wide = 1;
+                if (window_size)
+                    lx->at = lx->origin + (uint64_t)(base + i - p) - 1;
+                if (lx->buf_len > 0)
+                {
+                    lexer_append(lx, start, (size_t)(base + i - start));
+                    if (wide)
+                        lexer_emit_wide(lx, lx->buf, lx->buf_len);
+                    else
+                        lexer_emit(lx, lx->buf, lx->buf_len);
+                    carried = lx->buf_len;
+                    lx->buf_len = 0;
+                }
+                else if (wide)
+                {
+                    lexer_emit_wide(lx, (const char *)start, (size_t)(base + i - start));
+                }
+                else
+                {
+                    lexer_emit(lx, (const char *)start, (size_t)(base + i - start));
+                }
+                lx->names = (lx->names << 1 | (lx->word_cap == 1)) & 3;
+            }
+            if (term & bit)
+            {
+                /* Candidate sentence end; a run of terminators is one */
+                uint64_t next = starts & ~(bit | (bit - 1));
+                int kind = SENT_END;
+                if ((ends & bit) && base[i] == '.' && !wide)
+                {
+                    if (start == p && carried) /* buf is lower-cased */
+                        kind = sentence_word_kind(carried == 1 ? (const char *)&lx->word_first : lx->buf, carried,
+                                                  lx->names >> 1);
+                    else
+                        kind = sentence_word_kind((const char *)start, (size_t)(base + i - start), lx->names >> 1);
+                }
+                lx->sent_state = lx->sent_state ? SENT_END : kind;
+                lx->sent_at = lx->origin + (uint64_t)(base + i - p);
+                lx->sent_newline = 0;
+                next &= -next; /* the next word start, if it is in this window */
+                if (next && !(term & (next - 1) & ~(bit | (bit - 1))))
+                {
+                    unsigned j = lowest_bit(next);
+                    lexer_sentence_word(lx, lx->origin + (uint64_t)(base + j - p), base[j - 1], base[j], base + i + 1,
+                                        j - i - 1);
+                }
+            }
+            if (starts & bit)
+            {
+                start = base + i;
+                sbit = bit;
+                wide = 0;
+                lx->word_first = base[i];
+                if ((unsigned)(base[i] - 'A') < 26u)
+                    lx->word_cap = base + i + 1 < p + n ? (unsigned)(base[i + 1] - 'a') < 26u : 2;
+                else
+                    lx->word_cap = 0;
+            }
+        }
+        carry = (word >> (len - 1)) & 1;
+        if (high & ~(sbit - 1))
+            wide = 1;
+        sbit = 1;
+    }
+    if (n > 0 && carry)
+        lexer_append(lx, start, (size_t)(p + n - start));
+    if (n > 0)
+    {
+        lx->buf_wide = carry ? wide : 0;
+        lx->last_byte = p[n - 1];
+    }
+    if (lx->sent_state)
+    {
+        /* the next word is in a later block */
+        const unsigned char *gap = lexer_after_terminator(lx, p);
+        if (gap < p + n && memchr(gap, '\n', (size_t)(p + n - gap)))
+            lx->sent_newline = 1;
+    }
+}
+
+/* bytes at the end of p[0, n) that start a UTF-8 sequence it cuts short */
+static size_t utf8_cut(const unsigned char *p, size_t n)
+{
+    size_t k;
+    for (k = 1; k <= 3 && k <= n; ++k)
+    {
+        unsigned c = p[n - k];
+        if ((c & 0xc0) != 0x80)
+            return utf8_seq_len(c) > k ? k : 0;
+    }
+    return 0;
+}
+
+/* Tokenize one block of input (see lexer_scan()).  A UTF-8 sequence that
+ * the end of the block cuts short is held back and completed from the
+ * start of the next one. */
+static void lexer_feed(Lexer *lx, const unsigned char *p, size_t n)
+{
+    uint64_t origin = lx->fed; /* of p */
+    size_t keep;
+    lx->fed += n;
+    if (lx->pend_len > 0)
+    {
+        unsigned char seq[4];
+        size_t need = utf8_seq_len(lx->pend[0]), len;
+        uint64_t held = origin - lx->pend_len;
+        while (lx->pend_len < need && n > 0 && (*p & 0xc0) == 0x80)
+        {
+            lx->pend[lx->pend_len++] = *p++;
+            --n;
+            ++origin;
+        }
+        if (lx->pend_len < need && n == 0)
+            return;
+        len = lx->pend_len;
+        memcpy(seq, lx->pend, len);
+        lx->pend_len = 0;
+        lx->origin = held;
+        lexer_scan(lx, seq, len);
+    }
+    keep = utf8_words ? utf8_cut(p, n) : 0;
+    lx->origin = origin;
+    lexer_scan(lx, p, n - keep);
+    memcpy(lx->pend, p + n - keep, keep);
+    lx->pend_len = keep;
+}
+
+/* The text is over: a pending terminator ends its sentence */
+static void lexer_end_text(Lexer *lx)
+{
+    if (lx->sent_state)
+        lexer_sentence_end(lx);
+}
+
+/* flush last buffered word.  With keep_pending a terminator still waiting
+ * for the next word stays pending, so that an index saved now can be
+ * appended to as if the text went on (see save_index()); the caller ends
+ * the text with lexer_end_text() once the index is written. */
+static void lexer_finish(Lexer *lx)
+{
+    if (lx->pend_len > 0)
+    {
+        /* a truncated sequence: not a word byte */
+        unsigned char seq[4];
+        size_t len = lx->pend_len;
+        memcpy(seq, lx->pend, len);
+        lx->pend_len = 0;
+        lx->origin = lx->fed - len;
+        lexer_scan(lx, seq, len);
+    }
+    if (lx->buf_len > 0)
+    {
+        lx->at = lx->fed - 1;
+        if (lx->buf_wide)
+            lexer_emit_wide(lx, lx->buf, lx->buf_len);
+        else
+            lexer_emit(lx, lx->buf, lx->buf_len);
+        lx->names = (lx->names << 1 | (lx->word_cap == 1)) & 3;
+        lx->buf_len = 0;
+        lx->buf_wide = 0;
+    }
+    if (!lx->keep_pending)
+        lexer_end_text(lx);
+}
+
+static void read_ahead_free(ReadAhead *r);
+
+static void lexer_free(Lexer *lx)
+{
+    free(lx->buf);
+    free(lx->fold);
+    free(lx->block);
+    if (lx->ahead)
+        read_ahead_free(lx->ahead);
+    lx->ahead = NULL;
+    if (lx->stems)
+        stem_cache_free(lx->stems);
+    free(lx->stems);
+    if (lx->chunk_stems)
+    {
+        int k;
+        for (k = 0; k < MAX_THREADS; ++k)
+            stem_cache_free(&lx->chunk_stems[k]);
+    }
+    free(lx->chunk_stems);
+    lx->buf = NULL;
+    lx->fold = NULL;
+    lx->block = NULL;
+    lx->stems = NULL;
+    lx->chunk_stems = NULL;
+    gram_table_free(lx->grams);
+    lx->grams = NULL;
+    free(lx->win_counts);
+    free(lx->win_words);
+    free(lx->win_sentences);
+    lx->win_counts = NULL;
+    lx->win_words = NULL;
+    lx->win_sentences = NULL;
+    lx->win_cap = 0;
+}
+
+/* Bounded selection of the K best-ranked words: a min-heap whose root is
+ * the weakest entry kept, so each candidate costs O(log K). */
+typedef struct
+{
+    uint32_t *items;
+    size_t len;
+    size_t cap; /* K */
+    const WordTable *table;
+} TopK;
+
+static void topk_init(TopK *h, size_t k, const WordTable *t)
+{
+    h->items = (uint32_t *)xmalloc((k ? k : 1) * sizeof(uint32_t));
+    h->len = 0;
+    h->cap = k;
+    h->table = t;
+}
+
+static void topk_sift_down(TopK *h, size_t i, size_t len)
+{
+    for (;;)
+    {
+        size_t weakest = i, l = 2 * i + 1, r = l + 1;
+        uint32_t tmp;
+        if (l < len && ranks_before(h->table, h->items[weakest], h->items[l]))
+            weakest = l;
+        if (r < len && ranks_before(h->table, h->items[weakest], h->items[r]))
+            weakest = r;
+        if (weakest == i)
+            return;
+        tmp = h->items[i];
+        h->items[i] = h->items[weakest];
+        h->items[weakest] = tmp;
+        i = weakest;
+    }
+}
+
+static void topk_offer(TopK *h, uint32_t e)
+{
+    size_t i;
+    if (h->len < h->cap)
+    {
+        /* sift up */
+        i = h->len++;
+        while (i > 0 && ranks_before(h->table, h->items[(i - 1) / 2], e))
+        {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->items[i] = e;
+    }
+    else if (h->cap > 0 && ranks_before(h->table, e, h->items[0]))
+    {
+        h->items[0] = e;
+        topk_sift_down(h, 0, h->len);
+    }
+}
+
+/* Turn the heap into best-first order (in place heap sort) */
+static void topk_sort(TopK *h)
+{
+    size_t n = h->len;
+    while (n > 1)
+    {
+        uint32_t tmp = h->items[0];
+        h->items[0] = h->items[--n];
+        h->items[n] = tmp;
+        topk_sift_down(h, 0, n);
+    }
+}
+
+static void topk_free(TopK *h)
+{
+    free(h->items);
+    h->items = NULL;
+}
+
+/* qsort() has no context argument: the table whose entries sort_ranked()
+ * is ordering */
+static const WordTable *rank_table;
+
+static int cmp_entry_rank(const void *a, const void *b)
+{
+    uint32_t ea = *(const uint32_t *)a;
+    uint32_t eb = *(const uint32_t *)b;
+    if (ranks_before(rank_table, ea, eb))
+        return -1;
+    return ranks_before(rank_table, eb, ea) ? 1 : 0;
+}
+
+/* Put n entries of t into report order */
+static void sort_ranked(const WordTable *t, uint32_t *ids, size_t n)
+{
+    rank_table = t;
+    qsort(ids, n, sizeof(uint32_t), cmp_entry_rank);
+}
+
+/* Bounded selection of the K best-ranked n-grams, as TopK does for words;
+ * ties compare the words, looked up in the table, one by one */
+typedef struct
+{
+    GramEntry **items;
+    size_t len;
+    size_t cap;
+    WordTable *words;
+} GramTop;
+
+static const char *gram_word(WordTable *t, uint64_t h)
+{
+    uint32_t e = find_hashed_entry(t, h);
+    return e != WORD_NONE ? word_text(t, e) : "";
+}
+
+static int gram_ranks_before(WordTable *t, const GramEntry *a, const GramEntry *b)
+{
+    unsigned i;
+    if (a->count != b->count)
+        return a->count > b->count;
+    for (i = 0; i < a->n; ++i)
+    {
+        int c = strcmp(gram_word(t, a->words[i]), gram_word(t, b->words[i]));
+        if (c != 0)
+            return c < 0;
+    }
+    return 0;
+}
+
+static void gram_top_sift_down(GramTop *h, size_t i, size_t len)
+{
+    for (;;)
+    {
+        size_t weakest = i, l = 2 * i + 1, r = l + 1;
+        GramEntry *tmp;
+        if (l < len && gram_ranks_before(h->words, h->items[weakest], h->items[l]))
+            weakest = l;
+        if (r < len && gram_ranks_before(h->words, h->items[weakest], h->items[r]))
+            weakest = r;
+        if (weakest == i)
+            return;
+        tmp = h->items[i];
+        h->items[i] = h->items[weakest];
+        h->items[weakest] = tmp;
+        i = weakest;
+    }
+}
+
+static void gram_top_offer(GramTop *h, GramEntry *e)
+{
+    size_t i;
+    if (h->len < h->cap)
+    {
+        i = h->len++;
+        while (i > 0 && gram_ranks_before(h->words, h->items[(i - 1) / 2], e))
+        {
+            h->items[i] = h->items[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->items[i] = e;
+    }
+    else if (h->cap > 0 && gram_ranks_before(h->words, e, h->items[0]))
+    {
+        h->items[0] = e;
+        gram_top_sift_down(h, 0, h->len);
+    }
+}
+
+static void gram_top_sort(GramTop *h)
+{
+    size_t n = h->len;
+    while (n > 1)
+    {
+        GramEntry *tmp = h->items[0];
+        h->items[0] = h->items[--n];
+        h->items[n] = tmp;
+        gram_top_sift_down(h, 0, n);
+    }
+}
+
+/* The topic words asked for, in command-line / file order */
+typedef struct
+{
+    const char *given; /* as given, for the report header */
+    char *key;         /* lower-cased, a phrase's words joined by single spaces */
+    size_t len;
+    WordRow *entry;    /* NULL until looked up, or if absent; else &row */
+    unsigned words;    /* more than one for a phrase */
+    uint64_t gram;     /* gram_hash() of a phrase */
+    WordRow row;       /* the counts once looked up */
+    size_t column;     /* with --window: its place in each window's counts */
+} Topic;
+
+typedef struct
+{
+    Topic *items;
+    size_t len;
+    size_t cap;
+    Arena strings;
+} TopicList;
+
+static void topic_list_add(void *ctx, const char *word, size_t len)
+{
+    TopicList *tl = (TopicList *)ctx;
+    Topic *t;
+    size_t i;
+    if (tl->len == tl->cap)
+    {
+        tl->cap = tl->cap ? tl->cap * 2 : 8;
+        tl->items = (Topic *)realloc(tl->items, tl->cap * sizeof(Topic));
+        if (!tl->items)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    t = &tl->items[tl->len++];
+    t->given = arena_alloc(&tl->strings, len + 1);
+    t->key = arena_alloc(&tl->strings, FOLD_ROOM(len) + 1);
+    memcpy((char *)t->given, word, len);
+    ((char *)t->given)[len] = '\0';
+    t->len = 0;
+    t->words = 0;
+    for (i = 0; i < len;)
+    {
+        size_t j;
+        if (isspace((unsigned char)word[i]))
+        {
+            ++i;
+            continue;
+        }
+        for (j = i; j < len && !isspace((unsigned char)word[j]); ++j)
+            ;
+        if (t->words++ > 0)
+            t->key[t->len++] = ' ';
+        t->len += fold_word(t->key + t->len, word + i, j - i);
+        i = j;
+    }
+    t->key[t->len] = '\0';
+    t->entry = NULL;
+    t->column = 0;
+}
+
+/* With --stem, topics are looked up by their stems (word by word) */
+static void topic_list_stem(TopicList *tl)
+{
+    size_t i;
+    for (i = 0; i < tl->len; ++i)
+    {
+        Topic *t = &tl->items[i];
+        char *src = t->key, *dst = t->key;
+        for (;;)
+        {
+            size_t len = strcspn(src, " "), n = stem_key(src, len);
+            int more = src[len] == ' ';
+            memmove(dst, src, n);
+            dst += n;
+            if (!more)
+                break;
+            *dst++ = ' ';
+            src += len + 1;
+        }
+        *dst = '\0';
+        t->len = (size_t)(dst - t->key);
+    }
+}
+
+/* Have every phrase topic counted (see lexer_gram()); fails if one has
+ * more than NGRAM_MAX words */
+static int topic_list_phrases(TopicList *tl)
+{
+    size_t i, count = 0;
+    for (i = 0; i < tl->len; ++i)
+        count += tl->items[i].words > 1;
+    if (count == 0)
+        return 1;
+    gram_topics_init(count);
+    for (i = 0; i < tl->len; ++i)
+    {
+        Topic *t = &tl->items[i];
+        unsigned n;
+        if (t->words < 2)
+            continue;
+        if (t->words > NGRAM_MAX)
+        {
+            fprintf(stderr, "topic_index: phrase '%s' has more than %d words\n", t->given, NGRAM_MAX);
+            return 0;
+        }
+        t->gram = gram_hash_text(t->key, &n);
+        gram_topic_add(t->gram, n);
+    }
+    return 1;
+}
+
+/* With --window, give every distinct topic a column in the window counts */
+static void topic_list_windows(TopicList *tl)
+{
+    size_t i;
+    window_keys_init(tl->len);
+    for (i = 0; i < tl->len; ++i)
+    {
+        Topic *t = &tl->items[i];
+        t->column = window_key_add(t->words > 1 ? t->gram : hash_word(t->key, t->len));
+    }
+}
+
+/* Look every topic up and tag its entry so it is kept out of the top K.
+ * A phrase's counts are copied from grams into the topic itself. */
+static void topic_list_resolve(TopicList *tl, WordTable *t, GramTable *grams)
+{
+    size_t i;
+    uint32_t e;
+    for (i = 0; i < tl->len; ++i)
+    {
+        Topic *tp = &tl->items[i];
+        if (tp->words > 1)
+        {
+            GramEntry *g = grams ? gram_find(grams, tp->gram) : NULL;
+            tp->entry = NULL;
+            if (g)
+            {
+                g->flags |= WORD_TOPIC;
+                tp->row.word = tp->key;
+                tp->row.len = tp->len;
+                tp->row.count = g->count;
+                tp->row.sentence_count = g->sentence_count;
+                tp->row.docs = 0;
+                tp->entry = &tp->row;
+            }
+            continue;
+        }
+        e = find_word_entry(t, tp->key, tp->len);
+        tp->entry = NULL;
+        if (e != WORD_NONE)
+        {
+            t->flags[e] |= WORD_TOPIC;
+            tp->row = word_row(t, e);
+            tp->entry = &tp->row;
+        }
+    }
+}
+
+static void topic_list_free(TopicList *tl)
+{
+    free(tl->items);
+    arena_free(&tl->strings);
+}
+
+#ifdef TOPIC_INDEX_HAVE_THREADS
+typedef struct
+{
+    const unsigned char *data;
+    size_t len;
+    WordTable *table; /* NULL with a shared table */
+    Lexer lx;
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+    SharedWorker shared;
+#endif
+} Chunk;
+
+static void *chunk_worker(void *arg)
+{
+    Chunk *c = (Chunk *)arg;
+    lexer_feed(&c->lx, c->data, c->len);
+    lexer_finish(&c->lx);
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+    if (c->lx.shared)
+        shared_done(c->shared.shared);
+#endif
+    return NULL;
+}
+
+/* The lexer's view of the character at data[i], of data[0, n): sets *len
+ * and returns 1 for a word character, 0 for any other, 2 for a stray byte
+ * (which also separates words), or -1 if its sequence runs past n */
+static int cut_char(const unsigned char *data, size_t i, size_t n, size_t *len)
+{
+    long cp;
+    *len = 1;
+    if (data[i] < 0x80 || !utf8_words)
+        return data[i] < 0x80 && (char_class[data[i]] & CC_WORD);
+    if (utf8_seq_len(data[i]) > n - i)
+        return -1;
+    cp = utf8_decode(data + i, n - i, len);
+    if (cp < 0)
+    {
+        *len = 1;
+        return 2;
+    }
+    return utf8_is_word((uint32_t)cp);
+}
+
+/* Where may a chunk start, after from and at most at limit?  Only where the
+ * lexer has settled every terminator before it: at a word start with no
+ * terminator since the last word, or, when phrases are counted or the
+ * table is shared (sentences), right after terminators that end a
+ * sentence, so that no word, phrase or sentence runs across a cut.  The
+ * text before from is not looked at, so nothing counts until a word or a
+ * kind of terminator (see sentence_word_kind()) has been seen whole; the
+ * rules are the lexer's own.  Nor is a chunk started right after a stray
+ * byte, which lexer_feed() would hold back as the start of a sequence.
+ * Reads up to data[n]; returns limit if there is no such place. */
+static size_t chunk_cut(const unsigned char *data, size_t from, size_t limit, size_t n, int sentences)
+{
+    size_t i = from, len, word = 0, t = 0; /* current word, last terminator */
+    int prev = -1;                        /* last character: 1 word, 0 other, -1 none yet */
+    int state = SENT_NONE, known = 0;     /* the lexer's sent_state, if known */
+    int whole = 0, wide = 0;              /* the current word started after from, has non-ASCII */
+    int name = -1, before = -1;           /* the last word ended, the one before the current
+                                             word: 1 if capitalised (Plan, not PLAN), -1 if
+                                             not known */
+    if (sentences)
+    {
+        /* a cut follows a terminator in [from, limit): skip the walk if none */
+        size_t k = from;
+        while (k < limit && k < n && !(char_class[data[k]] & CC_TERM))
+            ++k;
+        if (k >= limit || k >= n)
+            return limit;
+    }
+    while (i < n && data[i] >= 0x80)
+        ++i; /* start on a character */
+    for (;;)
+    {
+        int c;
+        if (i >= n || (i >= limit && (!sentences || state == SENT_NONE || !known || t + 1 >= limit)))
+            return limit;
+        c = cut_char(data, i, n, &len);
+        if (c < 0)
+            return limit;
+        if (c == 2)
+        {
+            c = 0;
+            known = 0;
+        }
+        if (c != 1 && prev == 1)
+            name = whole ? (unsigned)(data[word] - 'A') < 26u && (unsigned)(data[word + 1] - 'a') < 26u : -1;
+        if (c == 1 && prev != 1)
+        {
+            /* not before a letter and '.', which needs the word before it */
+            if (prev == 0 && known && i + 1 < n && data[i + 1] != '.')
+            {
+                if (!sentences && state == SENT_NONE)
+                    return i;
+                if (sentences && state != SENT_NONE && i != t + 1 &&
+                    sentence_ends(state, data[i - 1], data[i], memchr(data + t + 1, '\n', i - t - 1) != NULL))
+                    return t + 1;
+            }
+            before = name;
+            word = i;
+            whole = prev == 0;
+            wide = 0;
+        }
+        if (c == 1)
+        {
+            state = SENT_NONE;
+            known = 1;
+            wide |= len > 1;
+        }
+        else if (char_class[data[i]] & CC_TERM)
+        {
+            if (known && state == SENT_NONE && prev == 1 && data[i] == '.' && !wide)
+            {
+                if (!whole && i - word <= ABBREV_MAX_LEN)
+                    known = 0; /* the word may have begun before from */
+                else if (i - word == 1 && before < 0)
+                    known = 0;
+                else
+                    state = sentence_word_kind((const char *)data + word, i - word, before == 1);
+            }
+            else
+                state = SENT_END;
+            t = i;
+        }
+        prev = c;
+        i += len;
+    }
+}
+
+/* Count data with up to nthreads workers, then merge their tables into
+ * lx in input order.  Any partial word at either edge goes through lx
+ * itself, so this is a drop-in replacement for lexer_feed(lx, data, n). */
+static void lex_parallel(Lexer *lx, const unsigned char *data, size_t n, int nthreads)
+{
+    Chunk chunks[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    size_t head, tail, pos, back;
+    int nchunks, k, sentences = lx->grams != NULL || shared_table;
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+    SharedTable shared;
+#endif
+
+    /* leave what runs into the end of the block for the next one: take the
+     * last cut, looked for in ever larger spans going back from the end */
+    tail = 0;
+    for (pos = n, back = 4096; pos > 0 && tail == 0; pos -= back, back *= 2)
+    {
+        size_t q = pos > back ? pos - back : 0;
+        if (back > pos)
+            back = pos;
+        while ((q = chunk_cut(data, q, pos, n, sentences)) < pos)
+            tail = q;
+    }
+    /* finish what was carried in from the previous block */
+    head = tail > 0 ? chunk_cut(data, 0, tail, n, sentences) : n;
+    if (tail < head)
+        tail = head;
+
+    lexer_feed(lx, data, head);
+    if ((tail - head) / MIN_CHUNK_SIZE < (size_t)nthreads)
+        nthreads = (int)((tail - head) / MIN_CHUNK_SIZE);
+    if (nthreads <= 1)
+    {
+        lexer_feed(lx, data + head, n - head);
+        return;
+    }
+    if (lx->sent_state)
+        lexer_sentence_end(lx); /* chunk_cut() found that head ends it */
+
+    /* cut [head, tail) into chunks that each end on a separator */
+    pos = head;
+    for (nchunks = 0; nchunks < nthreads && pos < tail; ++nchunks)
+    {
+        size_t end = (nchunks == nthreads - 1) ? tail : pos + (tail - head) / (size_t)nthreads;
+        if (end > tail)
+            end = tail;
+        if (end < tail)
+            end = chunk_cut(data, end, tail, n, sentences);
+        chunks[nchunks].data = data + pos;
+        chunks[nchunks].len = end - pos;
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+        if (shared_table)
+        {
+            /* count straight into lx's table (see shared_count()) */
+            chunks[nchunks].table = NULL;
+            lexer_init(&chunks[nchunks].lx, lx->table);
+            shared_worker_init(&chunks[nchunks].shared, &shared);
+            chunks[nchunks].lx.shared = &chunks[nchunks].shared;
+        }
+        else
+#endif
+        {
+            chunks[nchunks].table = (WordTable *)xmalloc(sizeof(WordTable));
+            word_table_init(chunks[nchunks].table);
+            lexer_init(&chunks[nchunks].lx, chunks[nchunks].table);
+        }
+        chunks[nchunks].lx.fed = lx->fed + (pos - head);
+        if (window_size)
+            chunks[nchunks].lx.win_base = (size_t)(chunks[nchunks].lx.fed / window_size);
+        if (stemmer)
+        {
+            /* keep every chunk's memo for the next block */
+            if (!lx->chunk_stems)
+                lx->chunk_stems = (StemCache *)xcalloc(MAX_THREADS, sizeof(StemCache));
+            chunks[nchunks].lx.stems = &lx->chunk_stems[nchunks];
+        }
+        pos = end;
+    }
+
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+    if (shared_table)
+        shared_init(&shared, lx->table, nchunks);
+#endif
+    utf8_maps_init(); /* before the chunks can race to it */
+    for (k = 0; k < nchunks; ++k)
+    {
+        if (pthread_create(&tids[k], NULL, chunk_worker, &chunks[k]) != 0)
+        {
+            fprintf(stderr, "topic_index: cannot create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (k = 0; k < nchunks; ++k)
+    {
+        pthread_join(tids[k], NULL);
+    }
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+    if (shared_table)
+    {
+        shared_flush(&shared);
+        shared_free(&shared);
+        for (k = 0; k < nchunks; ++k)
+            shared_worker_free(&chunks[k].shared);
+    }
+#endif
+
+    /* deterministic merge: always in input order */
+    for (k = 0; k < nchunks; ++k)
+    {
+        Chunk *c = &chunks[k];
+        if (c->table)
+            merge_word_table(lx->table, c->table, lx->total_sentences);
+        if (lx->grams)
+            merge_gram_table(lx->grams, c->lx.grams, lx->total_sentences);
+        if (window_size)
+            merge_windows(lx, &c->lx);
+        lx->total_words += c->lx.total_words;
+        lx->total_sentences += c->lx.total_sentences;
+        lx->current_sentence_id = lx->total_sentences;
+        lx->buf_grows += c->lx.buf_grows;
+        c->lx.stems = NULL; /* lent */
+        lexer_free(&c->lx);
+        if (c->table)
+        {
+            lx->table->grows += c->table->grows;
+            lx->table->pool_grows += c->table->pool_grows;
+            free_word_table(c->table);
+            free(c->table);
+        }
+    }
+
+    lx->fed += tail - head;
+    lexer_feed(lx, data + tail, n - tail);
+}
+#endif
+
+/* Feed a block to the lexer, in parallel when asked to.  Where a window
+ * of words or sentences ends depends on all the text before it, so those
+ * are counted serially. */
+static void lex_block(Lexer *lx, const unsigned char *data, size_t n, int nthreads)
+{
+    lx->total_bytes += n;
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    if (nthreads > 1 && (!window_size || window_unit == WINDOW_BYTES))
+    {
+        lex_parallel(lx, data, n, nthreads);
+        return;
+    }
+#else
+    (void)nthreads;
+#endif
+    lexer_feed(lx, data, n);
+    if (lx->live)
+        lx->live->snapshot(lx->live->arg, 0);
+}
+
+/*
+ * Compressed input.  A document that starts with the gzip magic is
+ * inflated in-process by the decoder below (RFC 1951/1952, every member of
+ * a multi-member file, CRC and length checked); zstd needs libzstd and a
+ * build with -DTOPIC_INDEX_HAVE_ZSTD.  Decoders push their output through
+ * a Sink, which hands it to the lexer directly or, with --read-ahead, to
+ * the tokenizer thread through the ring, so decompression overlaps
+ * counting.  A mapped file made of independent blocks that record their
+ * decompressed size (bgzip members, zstd frames with a content size) is
+ * decoded in parallel with -j instead (see lex_frames()).
+ */
+#define GZIP_WINDOW 32768                 /* deflate history */
+#define GZIP_OUT_SIZE (2 * GZIP_WINDOW + READ_BLOCK_SIZE)
+#define HUFF_FAST_BITS 10                 /* codes decoded by one lookup */
+
+enum
+{
+    INPUT_PLAIN,
+    INPUT_GZIP,
+    INPUT_ZSTD
+};
+
+/* Where a decoder puts its output: begin() returns a buffer of *cap
+ * bytes, commit() passes on the first n of them. */
+typedef struct Sink Sink;
+struct Sink
+{
+    unsigned char *(*begin)(Sink *s, size_t *cap);
+    void (*commit)(Sink *s, size_t n);
+};
+
+/* A document being read from a stream; the first bytes were read to pick
+ * the format and are kept in magic[] */
+typedef struct
+{
+    FILE *fp;
+    const char *name; /* for messages */
+    unsigned char magic[4];
+    size_t nmagic;
+    int format;  /* INPUT_* */
+    int partial; /* take what each read returns, for a live pipe (--every) */
+    int error;   /* a partial read failed */
+} Input;
+
+/* CRC-32 tables for slicing by 4: crc_table[k][b] is the CRC of byte b
+ * followed by k zero bytes */
+static uint32_t crc_table[4][256];
+
+static void init_crc_table(void)
+{
+    uint32_t c, k;
+    for (k = 0; k < 256; ++k)
+    {
+        int i;
+        c = k;
+        for (i = 0; i < 8; ++i)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[0][k] = c;
+    }
+    for (k = 0; k < 256; ++k)
+    {
+        int i;
+        c = crc_table[0][k];
+        for (i = 1; i < 4; ++i)
+        {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[i][k] = c;
+        }
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n)
+{
+    crc = ~crc;
+    for (; n >= 4; n -= 4, p += 4)
+    {
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        crc = crc_table[3][crc & 0xff] ^ crc_table[2][(crc >> 8) & 0xff] ^ crc_table[1][(crc >> 16) & 0xff] ^
+              crc_table[0][crc >> 24];
+    }
+    while (n--)
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int input_format(const unsigned char *p, size_t n)
+{
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+        return INPUT_GZIP;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+        return INPUT_ZSTD;
+    return INPUT_PLAIN;
+}
+
+/* Read the first bytes of fp and pick its format */
+static void input_open(Input *in, FILE *fp, const char *name)
+{
+    in->fp = fp;
+    in->name = name;
+    in->nmagic = fread(in->magic, 1, sizeof(in->magic), fp);
+    in->format = input_format(in->magic, in->nmagic);
+    in->partial = 0;
+    in->error = 0;
+}
+
+/* Up to cap bytes of plain input: as many as fit, or with partial reads
+ * whatever the stream has (at least one byte, 0 at the end) so text from
+ * a live pipe is counted as it arrives */
+static size_t input_read(Input *in, unsigned char *buf, size_t cap)
+{
+#ifdef TOPIC_INDEX_HAVE_PARTIAL_READS
+    if (in->partial)
+    {
+        ssize_t n;
+        do
+            n = read(fileno(in->fp), buf, cap);
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+        {
+            in->error = 1;
+            return 0;
+        }
+        return (size_t)n;
+    }
+#endif
+    return fread(buf, 1, cap, in->fp);
+}
+
+/* Pass n bytes to s, in pieces as large as it takes */
+static void sink_write(Sink *s, const unsigned char *p, size_t n)
+{
+    while (n > 0)
+    {
+        size_t cap, k;
+        unsigned char *buf = s->begin(s, &cap);
+        k = n < cap ? n : cap;
+        memcpy(buf, p, k);
+        s->commit(s, k);
+        p += k;
+        n -= k;
+    }
+}
+
+/* LSB-first bit reader over a memory range, refilled from fp when set.
+ * Past the end it feeds zero bytes and counts them in pad. */
+typedef struct
+{
+    const unsigned char *next;
+    size_t avail;
+    FILE *fp;
+    unsigned char *buf; /* READ_BLOCK_SIZE bytes for refills */
+    uint64_t bits;
+    int nbits;
+    size_t pad;
+} BitReader;
+
+static int bits_fill(BitReader *b)
+{
+    if (!b->fp)
+        return 0;
+    b->avail = fread(b->buf, 1, READ_BLOCK_SIZE, b->fp);
+    b->next = b->buf;
+    return b->avail > 0;
+}
+
+static void bits_need(BitReader *b, int n)
+{
+    if (b->nbits >= n)
+        return;
+    if (b->avail >= 8)
+    {
+        /* top up to at least 57 bits in one go */
+        while (b->nbits <= 56)
+        {
+            b->bits |= (uint64_t)*b->next++ << b->nbits;
+            b->nbits += 8;
+            b->avail--;
+        }
+        return;
+    }
+    while (b->nbits < n)
+    {
+        unsigned c = 0;
+        if (b->avail || bits_fill(b))
+        {
+            c = *b->next++;
+            b->avail--;
+        }
+        else
+            b->pad++;
+        b->bits |= (uint64_t)c << b->nbits;
+        b->nbits += 8;
+    }
+}
+
+/* the next n (at most 32) bits */
+static unsigned bits_get(BitReader *b, int n)
+{
+    unsigned v;
+    if (n == 0)
+        return 0;
+    bits_need(b, n);
+    v = (unsigned)(b->bits & ((1ull << n) - 1));
+    b->bits >>= n;
+    b->nbits -= n;
+    return v;
+}
+
+/* true if the reader went past the end of its input */
+static int bits_overrun(const BitReader *b)
+{
+    return b->pad * 8 > (size_t)b->nbits;
+}
+
+/* true if real input is left (whole bytes only) */
+static int bits_more(BitReader *b)
+{
+    return (size_t)(b->nbits / 8) > b->pad || b->avail || bits_fill(b);
+}
+
+/* Canonical Huffman code: codes up to HUFF_FAST_BITS long are decoded by
+ * one lookup in fast[] (length << 9 | symbol, 0 for longer codes), the
+ * rest bit by bit from count[] and symbol[]. */
+typedef struct
+{
+    uint16_t fast[1 << HUFF_FAST_BITS];
+    uint16_t count[16];
+    uint16_t symbol[288];
+} Huffman;
+
+/* Returns 0 if the lengths over-subscribe the code space */
+static int huff_build(Huffman *h, const unsigned char *lengths, int n)
+{
+    uint16_t offs[16];
+    int len, sym, left = 1, idx = 0;
+    unsigned code = 0;
+    memset(h->count, 0, sizeof(h->count));
+    for (sym = 0; sym < n; ++sym)
+        h->count[lengths[sym]]++;
+    h->count[0] = 0;
+    for (len = 1; len < 16; ++len)
+    {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return 0;
+    }
+    offs[1] = 0;
+    for (len = 1; len < 15; ++len)
+        offs[len + 1] = (uint16_t)(offs[len] + h->count[len]);
+    for (sym = 0; sym < n; ++sym)
+        if (lengths[sym])
+            h->symbol[offs[lengths[sym]]++] = (uint16_t)sym;
+
+    memset(h->fast, 0, sizeof(h->fast));
+    for (len = 1; len <= HUFF_FAST_BITS; ++len)
+    {
+        int i;
+        for (i = 0; i < h->count[len]; ++i, ++code, ++idx)
+        {
+            unsigned rev = 0, c = code, j;
+            int k;
+            for (k = 0; k < len; ++k, c >>= 1)
+                rev = (rev << 1) | (c & 1);
+            for (j = rev; j < (1u << HUFF_FAST_BITS); j += 1u << len)
+                h->fast[j] = (uint16_t)(len << 9 | h->symbol[idx]);
+        }
+        code <<= 1;
+    }
+    return 1;
+}
+
+/* Returns the next symbol, or -1 for a code that is not in the table */
+static int huff_decode(BitReader *b, const Huffman *h)
+{
+    unsigned e;
+    uint64_t bits;
+    int len, code = 0, first = 0, index = 0;
+    bits_need(b, 15);
+    e = h->fast[b->bits & ((1u << HUFF_FAST_BITS) - 1)];
+    if (e)
+    {
+        b->bits >>= e >> 9;
+        b->nbits -= (int)(e >> 9);
+        return (int)(e & 511);
+    }
+    bits = b->bits;
+    for (len = 1; len < 16; ++len)
+    {
+        int count = h->count[len];
+        code |= (int)(bits & 1);
+        bits >>= 1;
+        if (code - count < first)
+        {
+            b->bits >>= len;
+            b->nbits -= len;
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+/* Inflater state.  With a sink, out is a window of cap bytes that is
+ * passed on and slid down as it fills; without one out is the whole
+ * destination and running out of room is an error.  Bytes before mark
+ * have been checksummed (and passed on). */
+typedef struct
+{
+    BitReader in;
+    unsigned char *out;
+    size_t pos, cap, mark;
+    uint32_t crc;
+    size_t size; /* bytes of the current member checksummed so far */
+    Sink *sink;
+    Huffman lit, dist;
+} Inflate;
+
+static const uint16_t LEN_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned char LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                            2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,    49,    65,    97,    129,
+                                       193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned char DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                             6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/* Checksum (and pass on) everything up to pos */
+static void inflate_flush(Inflate *z)
+{
+    z->crc = crc32_update(z->crc, z->out + z->mark, z->pos - z->mark);
+    z->size += z->pos - z->mark;
+    if (z->sink)
+        sink_write(z->sink, z->out + z->mark, z->pos - z->mark);
+    z->mark = z->pos;
+}
+
+/* Make room for need more output bytes, keeping the window */
+static int inflate_room(Inflate *z, size_t need)
+{
+    size_t keep;
+    if (z->cap - z->pos >= need)
+        return 1;
+    if (!z->sink)
+        return 0;
+    inflate_flush(z);
+    keep = z->pos < GZIP_WINDOW ? z->pos : GZIP_WINDOW;
+    memmove(z->out, z->out + z->pos - keep, keep);
+    z->pos = z->mark = keep;
+    return 1;
+}
+
+static int inflate_stored(Inflate *z)
+{
+    BitReader *b = &z->in;
+    unsigned len, nlen;
+    bits_get(b, b->nbits & 7);
+    len = bits_get(b, 16);
+    nlen = bits_get(b, 16);
+    if (len != (~nlen & 0xffff))
+        return 0;
+    while (len > 0)
+    {
+        size_t n = len;
+        if (!inflate_room(z, 1))
+            return 0;
+        if (b->nbits > 0)
+        {
+            z->out[z->pos++] = (unsigned char)bits_get(b, 8);
+            --len;
+            continue;
+        }
+        if (!b->avail && !bits_fill(b))
+            return 0;
+        if (n > b->avail)
+            n = b->avail;
+        if (n > z->cap - z->pos)
+            n = z->cap - z->pos;
+        memcpy(z->out + z->pos, b->next, n);
+        z->pos += n;
+        b->next += n;
+        b->avail -= n;
+        len -= (unsigned)n;
+    }
+    return 1;
+}
+
+static int inflate_codes(Inflate *z)
+{
+    for (;;)
+    {
+        int sym = huff_decode(&z->in, &z->lit);
+        size_t len, dist;
+        unsigned char *dst;
+        const unsigned char *src;
+        if (z->in.pad && bits_overrun(&z->in))
+            return 0; /* truncated: decoding the zero padding */
+        if (sym < 256)
+        {
+            if (sym < 0 || !inflate_room(z, 1))
+                return 0;
+            z->out[z->pos++] = (unsigned char)sym;
+            continue;
+        }
+        if (sym == 256)
+            return 1;
+        sym -= 257;
+        if (sym >= 29)
+            return 0;
+        len = LEN_BASE[sym] + bits_get(&z->in, LEN_EXTRA[sym]);
+        sym = huff_decode(&z->in, &z->dist);
+        if (sym < 0 || sym >= 30)
+            return 0;
+        dist = DIST_BASE[sym] + bits_get(&z->in, DIST_EXTRA[sym]);
+        if (!inflate_room(z, len) || dist > z->pos)
+            return 0;
+        dst = z->out + z->pos;
+        src = dst - dist;
+        z->pos += len;
+        if (dist >= len)
+            memcpy(dst, src, len);
+        else
+            while (len--)
+                *dst++ = *src++;
+    }
+}
+
+static int inflate_fixed(Inflate *z)
+{
+    unsigned char lengths[288 + 30];
+    int i;
+    for (i = 0; i < 144; ++i)
+        lengths[i] = 8;
+    for (; i < 256; ++i)
+        lengths[i] = 9;
+    for (; i < 280; ++i)
+        lengths[i] = 7;
+    for (; i < 288; ++i)
+        lengths[i] = 8;
+    for (; i < 288 + 30; ++i)
+        lengths[i] = 5;
+    huff_build(&z->lit, lengths, 288);
+    huff_build(&z->dist, lengths + 288, 30);
+    return inflate_codes(z);
+}
+
+static int inflate_dynamic(Inflate *z)
+{
+    static const unsigned char ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    BitReader *b = &z->in;
+    unsigned char lengths[286 + 30], cl[19];
+    int nlit, ndist, ncode, i, n = 0;
+    nlit = (int)bits_get(b, 5) + 257;
+    ndist = (int)bits_get(b, 5) + 1;
+    ncode = (int)bits_get(b, 4) + 4;
+    if (nlit > 286 || ndist > 30)
+        return 0;
+    memset(cl, 0, sizeof(cl));
+    for (i = 0; i < ncode; ++i)
+        cl[ORDER[i]] = (unsigned char)bits_get(b, 3);
+    if (!huff_build(&z->lit, cl, 19))
+        return 0;
+    while (n < nlit + ndist)
+    {
+        int sym = huff_decode(b, &z->lit), rep;
+        unsigned char v = 0;
+        if (sym < 0)
+            return 0;
+        if (sym < 16)
+        {
+            lengths[n++] = (unsigned char)sym;
+            continue;
+        }
+        if (sym == 16)
+        {
+            if (n == 0)
+                return 0;
+            v = lengths[n - 1];
+            rep = 3 + (int)bits_get(b, 2);
+        }
+        else if (sym == 17)
+            rep = 3 + (int)bits_get(b, 3);
+        else
+            rep = 11 + (int)bits_get(b, 7);
+        if (n + rep > nlit + ndist)
+            return 0;
+        while (rep--)
+            lengths[n++] = v;
+    }
+    if (lengths[256] == 0 || !huff_build(&z->lit, lengths, nlit) || !huff_build(&z->dist, lengths + nlit, ndist))
+        return 0;
+    return inflate_codes(z);
+}
+
+/* Decode one gzip member.  Returns 0 on corrupt or truncated data. */
+static int gzip_member(Inflate *z)
+{
+    BitReader *b = &z->in;
+    unsigned flags, last = 0;
+    uint32_t crc, size;
+    if (bits_get(b, 16) != 0x8b1f || bits_get(b, 8) != 8)
+        return 0;
+    flags = bits_get(b, 8);
+    bits_get(b, 16); /* MTIME */
+    bits_get(b, 16);
+    bits_get(b, 16); /* XFL, OS */
+    if (flags & 0x04)
+    {
+        unsigned xlen = bits_get(b, 16);
+        while (xlen-- && !bits_overrun(b))
+            bits_get(b, 8);
+    }
+    if (flags & 0x08) /* FNAME */
+        while (bits_get(b, 8) != 0 && !bits_overrun(b))
+            ;
+    if (flags & 0x10) /* FCOMMENT */
+        while (bits_get(b, 8) != 0 && !bits_overrun(b))
+            ;
+    if (flags & 0x02) /* FHCRC */
+        bits_get(b, 16);
+    z->crc = 0;
+    z->size = 0;
+    while (!last)
+    {
+        int ok;
+        if (bits_overrun(b))
+            return 0;
+        last = bits_get(b, 1);
+        switch (bits_get(b, 2))
+        {
+        case 0:
+            ok = inflate_stored(z);
+            break;
+        case 1:
+            ok = inflate_fixed(z);
+            break;
+        case 2:
+            ok = inflate_dynamic(z);
+            break;
+        default:
+            ok = 0;
+        }
+        if (!ok)
+            return 0;
+    }
+    inflate_flush(z);
+    bits_get(b, b->nbits & 7);
+    crc = bits_get(b, 16);
+    crc |= (uint32_t)bits_get(b, 16) << 16;
+    size = bits_get(b, 16);
+    size |= (uint32_t)bits_get(b, 16) << 16;
+    return !bits_overrun(b) && crc == z->crc && size == (uint32_t)z->size;
+}
+
+/* Inflate every member of a gzip stream into s.  Returns 0 on error. */
+static int input_gzip(Input *in, Sink *s)
+{
+    Inflate *z = (Inflate *)xmalloc(sizeof(Inflate));
+    int ok;
+    z->in.next = in->magic;
+    z->in.avail = in->nmagic;
+    z->in.fp = in->fp;
+    z->in.buf = (unsigned char *)xmalloc(READ_BLOCK_SIZE);
+    z->in.bits = 0;
+    z->in.nbits = 0;
+    z->in.pad = 0;
+    z->out = (unsigned char *)xmalloc(GZIP_OUT_SIZE);
+    z->pos = z->mark = 0;
+    z->cap = GZIP_OUT_SIZE;
+    z->sink = s;
+    for (;;)
+    {
+        ok = gzip_member(z);
+        if (!ok || !bits_more(&z->in))
+            break;
+        bits_need(&z->in, 16);
+        if ((z->in.bits & 0xffff) != 0x8b1f || bits_overrun(&z->in))
+        {
+            fprintf(stderr, "topic_index: %s: trailing garbage ignored\n", in->name);
+            break;
+        }
+    }
+    if (ferror(in->fp))
+        perror(in->name);
+    else if (!ok)
+        fprintf(stderr, "topic_index: %s: corrupt or truncated gzip data\n", in->name);
+    ok = ok && !ferror(in->fp);
+    free(z->out);
+    free(z->in.buf);
+    free(z);
+    return ok;
+}
+
+/* Inflate the single gzip member at src into dst, which must be exactly
+ * its decompressed size */
+static int gunzip_block(const unsigned char *src, size_t n, unsigned char *dst, size_t size)
+{
+    Inflate *z = (Inflate *)xmalloc(sizeof(Inflate));
+    int ok;
+    z->in.next = src;
+    z->in.avail = n;
+    z->in.fp = NULL;
+    z->in.bits = 0;
+    z->in.nbits = 0;
+    z->in.pad = 0;
+    z->out = dst;
+    z->pos = z->mark = 0;
+    z->cap = size;
+    z->sink = NULL;
+    ok = gzip_member(z) && z->pos == size;
+    free(z);
+    return ok;
+}
+
+/* One independently compressed piece of a mapped file */
+typedef struct
+{
+    size_t off, len; /* compressed bytes */
+    size_t size;     /* decompressed bytes */
+} Frame;
+
+static void frame_push(Frame **frames, size_t *count, size_t *cap, size_t off, size_t len, size_t size)
+{
+    if (*count == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 1024;
+        *frames = (Frame *)realloc(*frames, *cap * sizeof(Frame));
+        if (!*frames)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*frames)[*count].off = off;
+    (*frames)[*count].len = len;
+    (*frames)[*count].size = size;
+    ++*count;
+}
+
+/* Split a gzip file into bgzip members (each names its compressed size in
+ * a "BC" extra field and ends with its decompressed size).  Returns the
+ * number of members, or 0 if data is not entirely made of them. */
+static size_t bgzf_frames(const unsigned char *data, size_t n, Frame **frames)
+{
+    size_t off = 0, count = 0, cap = 0;
+    *frames = NULL;
+    while (off < n)
+    {
+        const unsigned char *p = data + off;
+        size_t xlen, x, bsize = 0;
+        if (n - off < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 0x04))
+            break;
+        xlen = (size_t)p[10] | (size_t)p[11] << 8;
+        if (12 + xlen > n - off)
+            break;
+        for (x = 12; x + 4 <= 12 + xlen; x += 4 + ((size_t)p[x + 2] | (size_t)p[x + 3] << 8))
+            if (p[x] == 'B' && p[x + 1] == 'C' && p[x + 2] == 2 && p[x + 3] == 0 && x + 6 <= 12 + xlen)
+                bsize = ((size_t)p[x + 4] | (size_t)p[x + 5] << 8) + 1;
+        if (bsize < 12 + xlen + 8 || bsize > n - off)
+            break;
+        p += bsize - 4;
+        frame_push(frames, &count, &cap, off, bsize,
+                   (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24);
+        off += bsize;
+    }
+    if (off != n)
+    {
+        free(*frames);
+        *frames = NULL;
+        return 0;
+    }
+    return count;
+}
+
+#ifdef TOPIC_INDEX_HAVE_ZSTD
+/* Decompress a zstd stream (any number of frames) into s */
+static int input_zstd(Input *in, Sink *s)
+{
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    size_t in_size = ZSTD_DStreamInSize(), ret = 0;
+    unsigned char *buf = (unsigned char *)xmalloc(in_size);
+    ZSTD_inBuffer ib;
+    int full = 0, ok = 1;
+    if (!ds)
+    {
+        fprintf(stderr, "topic_index: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    ZSTD_initDStream(ds);
+    ib.src = in->magic;
+    ib.size = in->nmagic;
+    ib.pos = 0;
+    for (;;)
+    {
+        ZSTD_outBuffer ob;
+        /* a full output buffer may leave more output behind */
+        if (ib.pos == ib.size && !full)
+        {
+            ib.size = fread(buf, 1, in_size, in->fp);
+            ib.src = buf;
+            ib.pos = 0;
+            if (ib.size == 0)
+                break;
+        }
+        ob.dst = s->begin(s, &ob.size);
+        ob.pos = 0;
+        ret = ZSTD_decompressStream(ds, &ob, &ib);
+        if (ZSTD_isError(ret))
+        {
+            fprintf(stderr, "topic_index: %s: %s\n", in->name, ZSTD_getErrorName(ret));
+            ok = 0;
+            break;
+        }
+        if (ob.pos > 0)
+            s->commit(s, ob.pos);
+        full = ob.pos == ob.size;
+    }
+    if (ok && ferror(in->fp))
+    {
+        perror(in->name);
+        ok = 0;
+    }
+    else if (ok && ret != 0)
+    {
+        fprintf(stderr, "topic_index: %s: truncated zstd data\n", in->name);
+        ok = 0;
+    }
+    ZSTD_freeDStream(ds);
+    free(buf);
+    return ok;
+}
+
+/* Split a zstd file into frames that record their content size; skippable
+ * frames (magic 0x184d2a5?) are dropped.  Returns 0 if any frame leaves its size out. */
+static size_t zstd_frames(const unsigned char *data, size_t n, Frame **frames)
+{
+    size_t off = 0, count = 0, cap = 0;
+    *frames = NULL;
+    while (off < n)
+    {
+        size_t len = ZSTD_findFrameCompressedSize(data + off, n - off);
+        unsigned long long size;
+        if (ZSTD_isError(len))
+            break;
+        size = ZSTD_getFrameContentSize(data + off, len);
+        if ((data[off] & 0xf0) != 0x50 || data[off + 1] != 0x2a || data[off + 2] != 0x4d || data[off + 3] != 0x18)
+        {
+            if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size > (unsigned long long)SIZE_MAX)
+                break;
+            frame_push(frames, &count, &cap, off, len, (size_t)size);
+        }
+        off += len;
+    }
+    if (off != n)
+    {
+        free(*frames);
+        *frames = NULL;
+        return 0;
+    }
+    return count;
+}
+#endif
+
+/* Decode a whole document from its stream into s.  Errors are reported
+ * here; returns 0 after one. */
+static int input_run(Input *in, Sink *s)
+{
+    size_t cap, n;
+    unsigned char *buf;
+    switch (in->format)
+    {
+    case INPUT_GZIP:
+        return input_gzip(in, s);
+    case INPUT_ZSTD:
+#ifdef TOPIC_INDEX_HAVE_ZSTD
+        return input_zstd(in, s);
+#else
+        fprintf(stderr, "topic_index: %s: zstd input needs a build with -DTOPIC_INDEX_HAVE_ZSTD and -lzstd\n", in->name);
+        return 0;
+#endif
+    default:
+        break;
+    }
+    buf = s->begin(s, &cap);
+    memcpy(buf, in->magic, in->nmagic);
+    n = in->nmagic + input_read(in, buf + in->nmagic, cap - in->nmagic);
+    while (n > 0)
+    {
+        s->commit(s, n);
+        buf = s->begin(s, &cap);
+        n = input_read(in, buf, cap);
+    }
+    if (ferror(in->fp) || in->error)
+    {
+        perror(in->name);
+        return 0;
+    }
+    return 1;
+}
+
+/* The sink without read-ahead: straight into the lexer */
+typedef struct
+{
+    Sink sink;
+    Lexer *lx;
+    int nthreads;
+} LexSink;
+
+static unsigned char *lex_sink_begin(Sink *s, size_t *cap)
+{
+    LexSink *ls = (LexSink *)s;
+    *cap = ls->lx->block_size;
+    return ls->lx->block;
+}
+
+static void lex_sink_commit(Sink *s, size_t n)
+{
+    LexSink *ls = (LexSink *)s;
+    lex_block(ls->lx, ls->lx->block, n, ls->nthreads);
+}
+
+#ifdef TOPIC_INDEX_HAVE_THREADS
+typedef struct
+{
+    const unsigned char *data;
+    const Frame *frames;
+    size_t first, last; /* frames [first, last) */
+    unsigned char *out; /* where frames[first] goes */
+    int format;
+    int ok;
+} FrameRun;
+
+static void *frame_worker(void *arg)
+{
+    FrameRun *run = (FrameRun *)arg;
+    unsigned char *dst = run->out;
+    size_t i;
+    run->ok = 1;
+    for (i = run->first; i < run->last && run->ok; ++i)
+    {
+        const Frame *f = &run->frames[i];
+        if (run->format == INPUT_GZIP)
+            run->ok = gunzip_block(run->data + f->off, f->len, dst, f->size);
+#ifdef TOPIC_INDEX_HAVE_ZSTD
+        else
+        {
+            size_t got = ZSTD_decompress(dst, f->size, run->data + f->off, f->len);
+            run->ok = !ZSTD_isError(got) && got == f->size;
+        }
+#endif
+        dst += f->size;
+    }
+    return NULL;
+}
+
+/* Decompress the independent frames of a mapped file on nthreads threads,
+ * up to nthreads * PARALLEL_BLOCK_SIZE bytes of output at a time, and
+ * count each batch in input order.  Returns 0 if the file is not made of
+ * such frames (nothing has been counted yet) and -1 on corrupt data. */
+static int lex_frames(Lexer *lx, const unsigned char *data, size_t n, int format, int nthreads, const char *name)
+{
+    size_t batch = (size_t)nthreads * PARALLEL_BLOCK_SIZE, count = 0, first = 0, i;
+    unsigned char *out = NULL;
+    Frame *frames = NULL;
+    int ok = 1;
+
+    if (format == INPUT_GZIP)
+        count = bgzf_frames(data, n, &frames);
+#ifdef TOPIC_INDEX_HAVE_ZSTD
+    else if (format == INPUT_ZSTD)
+        count = zstd_frames(data, n, &frames);
+#endif
+    for (i = 0; i < count && frames[i].size <= batch; ++i)
+        ;
+    if (count < 2 || i < count)
+    {
+        free(frames);
+        return 0; /* one frame, or too large a one: stream it */
+    }
+
+    out = (unsigned char *)xmalloc(batch);
+    while (first < count && ok)
+    {
+        FrameRun runs[MAX_THREADS];
+        pthread_t tids[MAX_THREADS];
+        size_t last = first, total = 0, share, pos = 0;
+        int nruns = 0, k;
+        while (last < count && total + frames[last].size <= batch)
+            total += frames[last++].size;
+
+        /* cut the batch into runs of about total / nthreads bytes */
+        share = total / (size_t)nthreads + 1;
+        for (i = first; i < last; ++nruns)
+        {
+            FrameRun *run = &runs[nruns];
+            size_t bytes = 0;
+            run->data = data;
+            run->frames = frames;
+            run->first = i;
+            run->out = out + pos;
+            run->format = format;
+            while (i < last && (bytes == 0 || nruns == nthreads - 1 || bytes + frames[i].size <= share))
+                bytes += frames[i++].size;
+            run->last = i;
+            pos += bytes;
+        }
+        for (k = 0; k < nruns; ++k)
+        {
+            if (pthread_create(&tids[k], NULL, frame_worker, &runs[k]) != 0)
+            {
+                fprintf(stderr, "topic_index: cannot create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (k = 0; k < nruns; ++k)
+        {
+            pthread_join(tids[k], NULL);
+            ok = ok && runs[k].ok;
+        }
+        if (ok)
+            lex_block(lx, out, total, nthreads);
+        first = last;
+    }
+    if (!ok)
+        fprintf(stderr, "topic_index: %s: corrupt %s data\n", name, format == INPUT_GZIP ? "gzip" : "zstd");
+    free(out);
+    free(frames);
+    return ok ? 1 : -1;
+}
+#endif
+
+#if defined(TOPIC_INDEX_HAVE_THREADS) && defined(__GNUC__)
+#define TOPIC_INDEX_HAVE_READ_AHEAD 1
+
+/*
+ * Read-ahead (--read-ahead N).  A reader thread keeps up to N buffers
+ * filled ahead of the tokenizer and hands them over through a
+ * single-producer, single-consumer ring: each side advances only its own
+ * index, so passing a buffer takes no lock.  A side that finds the ring
+ * empty (or full) raises its waiting flag and sleeps on a condition
+ * variable; the other side checks that flag after publishing its index
+ * and only then takes the mutex to wake it.  Indices grow without wrapping
+ * and select slot index % nbufs.  The reader thread also runs the
+ * decompressor, if any, filling the buffers through the ring's Sink.
+ * The ring and its thread belong to the lexer and serve every document it
+ * streams: between documents the thread sleeps until handed the next one.
+ */
+#define RING_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define RING_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+enum
+{
+    RING_CONSUMER,
+    RING_PRODUCER
+};
+
+struct ReadAhead
+{
+    Sink sink; /* the producer's end */
+    Input *in;
+    unsigned char **bufs;
+    size_t *lens;
+    size_t nbufs, block_size;
+    size_t head;    /* next buffer to tokenize, advanced by the consumer */
+    size_t tail;    /* next buffer to fill, advanced by the producer */
+    int done;       /* producer reached end of input (set after tail) */
+    int error;      /* the input failed (and was reported) */
+    int waiting[2]; /* RING_CONSUMER / RING_PRODUCER asleep */
+    int job;        /* in is a new document to read (under lock) */
+    int quit;       /* the thread is to exit (under lock) */
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t wake[2];
+    pthread_cond_t job_ready;
+};
+
+static int ring_ready(ReadAhead *r, int who)
+{
+    size_t head = RING_LOAD(&r->head), tail = RING_LOAD(&r->tail);
+    if (who == RING_CONSUMER)
+        return tail != head || RING_LOAD(&r->done);
+    return tail - head < r->nbufs;
+}
+
+static void ring_wait(ReadAhead *r, int who)
+{
+    pthread_mutex_lock(&r->lock);
+    RING_STORE(&r->waiting[who], 1);
+    while (!ring_ready(r, who))
+        pthread_cond_wait(&r->wake[who], &r->lock);
+    RING_STORE(&r->waiting[who], 0);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static void ring_wake(ReadAhead *r, int who)
+{
+    if (RING_LOAD(&r->waiting[who]))
+    {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->wake[who]);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* next free buffer, once the consumer has let go of one */
+static unsigned char *ring_begin(Sink *s, size_t *cap)
+{
+    ReadAhead *r = (ReadAhead *)s;
+    size_t tail = RING_LOAD(&r->tail);
+    if (tail - RING_LOAD(&r->head) == r->nbufs)
+        ring_wait(r, RING_PRODUCER);
+    *cap = r->block_size;
+    return r->bufs[tail % r->nbufs];
+}
+
+static void ring_commit(Sink *s, size_t n)
+{
+    ReadAhead *r = (ReadAhead *)s;
+    size_t tail = RING_LOAD(&r->tail);
+    r->lens[tail % r->nbufs] = n;
+    RING_STORE(&r->tail, tail + 1);
+    ring_wake(r, RING_CONSUMER);
+}
+
+/* Read every document handed over until told to quit */
+static void *read_ahead_worker(void *arg)
+{
+    ReadAhead *r = (ReadAhead *)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (!r->job && !r->quit)
+            pthread_cond_wait(&r->job_ready, &r->lock);
+        if (r->quit)
+        {
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+        r->job = 0;
+        pthread_mutex_unlock(&r->lock);
+        r->error = !input_run(r->in, &r->sink);
+        RING_STORE(&r->done, 1);
+        ring_wake(r, RING_CONSUMER);
+    }
+}
+
+/* A ring of nbufs buffers of block_size bytes with its thread started, or
+ * NULL if the thread could not be */
+static ReadAhead *read_ahead_new(size_t block_size, size_t nbufs)
+{
+    ReadAhead *r = (ReadAhead *)xmalloc(sizeof(ReadAhead));
+    size_t i;
+    r->sink.begin = ring_begin;
+    r->sink.commit = ring_commit;
+    r->in = NULL;
+    r->nbufs = nbufs;
+    r->block_size = block_size;
+    r->bufs = (unsigned char **)xmalloc(nbufs * sizeof(unsigned char *));
+    r->lens = (size_t *)xmalloc(nbufs * sizeof(size_t));
+    for (i = 0; i < nbufs; ++i)
+        r->bufs[i] = (unsigned char *)xmalloc(block_size);
+    r->head = r->tail = 0;
+    r->done = r->error = 0;
+    r->waiting[RING_CONSUMER] = r->waiting[RING_PRODUCER] = 0;
+    r->job = r->quit = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake[RING_CONSUMER], NULL);
+    pthread_cond_init(&r->wake[RING_PRODUCER], NULL);
+    pthread_cond_init(&r->job_ready, NULL);
+    if (pthread_create(&r->tid, NULL, read_ahead_worker, r) != 0)
+    {
+        r->quit = 1; /* no thread to join */
+        read_ahead_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/* Stop the thread, between documents, and free the ring */
+static void read_ahead_free(ReadAhead *r)
+{
+    size_t i;
+    if (!r->quit)
+    {
+        pthread_mutex_lock(&r->lock);
+        r->quit = 1;
+        pthread_cond_signal(&r->job_ready);
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->tid, NULL);
+    }
+    pthread_cond_destroy(&r->job_ready);
+    pthread_cond_destroy(&r->wake[RING_PRODUCER]);
+    pthread_cond_destroy(&r->wake[RING_CONSUMER]);
+    pthread_mutex_destroy(&r->lock);
+    for (i = 0; i < r->nbufs; ++i)
+        free(r->bufs[i]);
+    free(r->bufs);
+    free(r->lens);
+    free(r);
+}
+
+/* lex_stream() with the reads done nbufs buffers ahead on the lexer's
+ * reader thread, started on first use.  Returns -1 if the thread could
+ * not be started, before reading anything. */
+static int lex_read_ahead(Lexer *lx, Input *in, size_t block_size, int nthreads, size_t nbufs)
+{
+    ReadAhead *r = lx->ahead;
+    size_t head = 0;
+
+    if (r && (r->block_size != block_size || r->nbufs != nbufs))
+    {
+        read_ahead_free(r);
+        r = lx->ahead = NULL;
+    }
+    if (!r)
+    {
+        r = lx->ahead = read_ahead_new(block_size, nbufs);
+        if (!r)
+            return -1;
+    }
+    /* the thread is idle: it has finished with the last document */
+    r->head = r->tail = 0;
+    r->done = r->error = 0;
+    pthread_mutex_lock(&r->lock);
+    r->in = in;
+    r->job = 1;
+    pthread_cond_signal(&r->job_ready);
+    pthread_mutex_unlock(&r->lock);
+
+    for (;;)
+    {
+        size_t slot = head % nbufs;
+        if (RING_LOAD(&r->tail) == head)
+        {
+            ring_wait(r, RING_CONSUMER);
+            if (RING_LOAD(&r->tail) == head)
+                break; /* done, and nothing left */
+        }
+        lex_block(lx, r->bufs[slot], r->lens[slot], nthreads);
+        RING_STORE(&r->head, ++head);
+        ring_wake(r, RING_PRODUCER);
+    }
+    return !r->error;
+}
+#else
+static void read_ahead_free(ReadAhead *r)
+{
+    (void)r;
+}
+#endif
+
+/* Stream the input through the lexer in READ_BLOCK_SIZE pieces (or large
+ * enough pieces to keep nthreads busy), decompressing it on the way and
+ * read_ahead buffers ahead where threads are available.  Returns 0 on a
+ * read error or corrupt data, which has been reported. */
+static int lex_stream(Lexer *lx, FILE *fp, const char *name, int nthreads, int read_ahead)
+{
+    size_t block_size = (nthreads > 1) ? (size_t)nthreads * PARALLEL_BLOCK_SIZE : READ_BLOCK_SIZE;
+    LexSink ls;
+    Input in;
+#ifdef TOPIC_INDEX_HAVE_PARTIAL_READS
+    if (lx->live)
+        setvbuf(fp, NULL, _IONBF, 0); /* nothing held back from read() */
+#endif
+    input_open(&in, fp, name);
+    in.partial = lx->live != NULL;
+#ifdef TOPIC_INDEX_HAVE_READ_AHEAD
+    if (read_ahead > 0)
+    {
+        /* parallel blocks are large: double-buffer them */
+        int ok = lex_read_ahead(lx, &in, block_size, nthreads, nthreads > 1 ? 2 : (size_t)read_ahead);
+        if (ok >= 0)
+            return ok;
+    }
+#else
+    (void)read_ahead;
+#endif
+    if (lx->block_size != block_size)
+    {
+        free(lx->block);
+        lx->block = (unsigned char *)xmalloc(block_size);
+        lx->block_size = block_size;
+    }
+    ls.sink.begin = lex_sink_begin;
+    ls.sink.commit = lex_sink_commit;
+    ls.lx = lx;
+    ls.nthreads = nthreads;
+    return input_run(&in, &ls.sink);
+}
+
+#ifdef TOPIC_INDEX_HAVE_MMAP
+/* Map a regular file and tokenize it in place.  Returns 0 when the input
+ * is not a mappable regular file, or is compressed in a way only the
+ * stream decoder handles, so the caller can stream it instead; -1 when
+ * compressed frames turn out corrupt. */
+static int lex_mapped(Lexer *lx, FILE *fp, const char *name, int nthreads)
+{
+    struct stat st;
+    void *map;
+    size_t size;
+    int format;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+        return 0;
+    if ((uintmax_t)st.st_size > (uintmax_t)SIZE_MAX)
+        return 0;
+    size = (size_t)st.st_size;
+    if (size == 0)
+        return 1; /* nothing to map, nothing to count */
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED)
+        return 0;
+    posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+    format = input_format((const unsigned char *)map, size);
+    if (format != INPUT_PLAIN)
+    {
+        int ok = 0;
+#ifdef TOPIC_INDEX_HAVE_THREADS
+        if (nthreads > 1)
+            ok = lex_frames(lx, (const unsigned char *)map, size, format, nthreads, name);
+#else
+        (void)name;
+#endif
+        munmap(map, size);
+        return ok;
+    }
+    lex_block(lx, (const unsigned char *)map, size, nthreads);
+    munmap(map, size);
+    return 1;
+}
+#endif
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--mmap | --no-mmap] [--read-ahead N] [-j N] [--top K] [--stop-lang LANG[,LANG]]\n"
+            "       %*s [--stop-words FILE] <topic_word> [file]\n"
+            "       %s [options] (--topic WORD | --topics FILE)... [file]\n"
+            "       %s [options] --batch [--corpus | --tfidf] <topic_word> (file | dir)...\n"
+            "       %s [options] --list LIST <topic_word>\n"
+            "       %s [options] --load-index INDEX <topic_word>\n"
+            "       %s [options] --append FILE --index INDEX [<topic_word>]\n"
+            "       %s --gen-corpus SIZE [--gen-words N] [--zipf S] [--seed N]\n"
+            "       %s [options] --bench <topic_word> file\n"
+            "       %s [options] --serve SOCKET (file | INDEX)...\n"
+            "Output: [--format text|jsonl|tsv|bin] [--vocab] [--window N[w|s|b]] [--save-index INDEX]\n"
+            "        [--stats[=json]] [--every N | --every SECONDSs]\n"
+            "Words: [--ascii] [--stem[=LANG]] [--ngrams N]\n"
+            "Threads: [--shared-table]\n"
+            "Bounded memory: [--approx [--mem SIZE]]\n",
+            prog, (int)strlen(prog), "", prog, prog, prog, prog, prog, prog, prog, prog);
+}
+
+/* Match "--name VALUE" or "--name=VALUE" (or "-xVALUE" / "-x VALUE" for a
+ * short name) at argv[*argi].  Returns the value, or NULL if the
+ * argument is a different option. */
+static const char *option_value(const char *name, int argc, char *argv[], int *argi)
+{
+    const char *arg = argv[*argi];
+    size_t n = strlen(name);
+    if (strncmp(arg, name, n) != 0)
+        return NULL;
+    if (arg[n] == '\0')
+    {
+        if (*argi + 1 >= argc)
+        {
+            fprintf(stderr, "topic_index: %s needs a value\n", name);
+            exit(EXIT_FAILURE);
+        }
+        return argv[++*argi];
+    }
+    if (name[1] != '-')
+        return arg + n; /* -jN */
+    if (arg[n] == '=')
+        return arg + n + 1;
+    return NULL;
+}
+
+/* Parse a whole decimal number in [min, max] or exit with an error */
+static long parse_count(const char *name, const char *val, long min, long max)
+{
+    char *endp;
+    long v = strtol(val, &endp, 10);
+    if (*val == '\0' || *endp != '\0' || v < min || v > max)
+    {
+        fprintf(stderr, "topic_index: %s expects a number between %ld and %ld\n", name, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+/* a byte count with an optional k, M or G (binary) suffix */
+static uint64_t parse_size(const char *name, const char *val)
+{
+    char *endp;
+    unsigned long long v = strtoull(val, &endp, 10);
+    int shift = 0;
+    if (*endp == 'k' || *endp == 'K')
+        shift = 10;
+    else if (*endp == 'm' || *endp == 'M')
+        shift = 20;
+    else if (*endp == 'g' || *endp == 'G')
+        shift = 30;
+    if (shift)
+        ++endp;
+    if (*val < '0' || *val > '9' || *endp != '\0' || v == 0 || v > (~0ULL >> shift))
+    {
+        fprintf(stderr, "topic_index: %s expects a size such as 64M or 2G\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return (uint64_t)v << shift;
+}
+
+enum
+{
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_TSV,
+    FORMAT_BIN
+};
+
+/* Settings shared by every document of a run */
+typedef struct
+{
+    int use_mmap;
+    int nthreads;
+    size_t top_k;
+    int batch;  /* print "File:" in each report */
+    int format; /* FORMAT_* */
+    int vocab;  /* report the whole vocabulary too */
+    int bench;  /* time the stages (run_bench()) */
+    int read_ahead; /* buffers read ahead of the lexer, 0 for none */
+    int corpus; /* batch mode sums the documents into one report (run_corpus()) */
+    int tfidf;  /* ...and scores each document's topics against it */
+} Options;
+
+/*
+ * Run statistics (--stats).  The counters below are bumped only on rare
+ * events (a table doubling, a new arena block, a longer word buffer) and
+ * the clock is read only between stages, so they stay compiled in and
+ * cost nothing measurable when --stats is off.
+ */
+enum
+{
+    STAGE_OTHER,  /* options, stop lists, directory walks */
+    STAGE_COUNT,  /* reading and counting text */
+    STAGE_INDEX,  /* loading and saving index files */
+    STAGE_SELECT, /* topic lookup and top K */
+    STAGE_OUTPUT, /* writing reports */
+    STAGE_MAX
+};
+
+static const char *const stage_names[STAGE_MAX] = {"other", "count", "index", "select", "output"};
+
+enum
+{
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+typedef struct
+{
+    int mode; /* STATS_* */
+    int stage;
+    double mark; /* when the current stage began */
+    double seconds[STAGE_MAX];
+    uint64_t bytes;
+    long words;
+    unsigned long unique;
+    unsigned long probe_total; /* sum of every entry's probe distance */
+    unsigned long probe_max;
+} Stats;
+
+static Stats stats;
+
+/* wall-clock seconds from an arbitrary origin */
+static double now_seconds(void)
+{
+#ifdef TOPIC_INDEX_HAVE_CLOCK
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* peak resident set size in KiB, 0 where unknown */
+static long peak_rss_kib(void)
+{
+#ifdef TOPIC_INDEX_HAVE_CLOCK
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (long)(ru.ru_maxrss / 1024); /* bytes on macOS */
+#else
+    return (long)ru.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/* charge the time since the last call to the current stage and move on */
+static void stats_stage(int stage)
+{
+    double now;
+    if (stats.mode == STATS_OFF)
+        return;
+    now = now_seconds();
+    stats.seconds[stats.stage] += now - stats.mark;
+    stats.mark = now;
+    stats.stage = stage;
+}
+
+/* fold a counted document into the totals */
+static void stats_document(const Lexer *lx)
+{
+    const WordTable *t = lx->table;
+    size_t i;
+    if (stats.mode == STATS_OFF)
+        return;
+    stats.bytes += lx->total_bytes;
+    stats.words += lx->total_words;
+    stats.unique += (unsigned long)t->size;
+    for (i = 0; i <= t->mask; ++i)
+    {
+        const WordSlot *e = &t->slots[i];
+        size_t d;
+        if (!SLOT_LIVE(t, e))
+            continue;
+        d = PROBE_DISTANCE(t, e, i);
+        stats.probe_total += (unsigned long)d;
+        if (d > stats.probe_max)
+            stats.probe_max = (unsigned long)d;
+    }
+}
+
+/* print the totals to stderr; lx holds the run-long allocation counters */
+static void stats_print(const Lexer *lx)
+{
+    double total = 0;
+    int i;
+    stats_stage(STAGE_OTHER);
+    for (i = 0; i < STAGE_MAX; ++i)
+        total += stats.seconds[i];
+    if (stats.mode == STATS_JSON)
+    {
+        fprintf(stderr, "{\"seconds\":{");
+        for (i = 0; i < STAGE_MAX; ++i)
+            fprintf(stderr, "\"%s\":%.6f,", stage_names[i], stats.seconds[i]);
+        fprintf(stderr, "\"total\":%.6f},\"bytes\":%llu,\"words\":%ld,\"unique\":%lu,", total,
+                (unsigned long long)stats.bytes, stats.words, stats.unique);
+        fprintf(stderr, "\"probe_avg\":%.3f,\"probe_max\":%lu,", stats.unique ? (double)stats.probe_total / (double)stats.unique : 0.0,
+                stats.probe_max);
+        fprintf(stderr, "\"table_grows\":%lu,\"pool_grows\":%lu,\"buffer_grows\":%lu,\"peak_rss_kib\":%ld}\n",
+                lx->table->grows, lx->table->pool_grows, lx->buf_grows, peak_rss_kib());
+        return;
+    }
+    fprintf(stderr, "stats:");
+    for (i = 0; i < STAGE_MAX; ++i)
+        fprintf(stderr, " %s %.4f s,", stage_names[i], stats.seconds[i]);
+    fprintf(stderr, " total %.4f s\n", total);
+    fprintf(stderr, "stats: %llu bytes read (%.1f MB/s counting), %ld words, %lu unique\n", (unsigned long long)stats.bytes,
+            stats.seconds[STAGE_COUNT] > 0 ? (double)stats.bytes / 1e6 / stats.seconds[STAGE_COUNT] : 0.0, stats.words,
+            stats.unique);
+    fprintf(stderr, "stats: probe length avg %.3f, max %lu\n",
+            stats.unique ? (double)stats.probe_total / (double)stats.unique : 0.0, stats.probe_max);
+    fprintf(stderr, "stats: %lu table grows, %lu pool grows, %lu word buffer grows, peak RSS %ld KiB\n", lx->table->grows,
+            lx->table->pool_grows, lx->buf_grows, peak_rss_kib());
+}
+
+/* Count one document into lx (and its table): path NULL means stdin.
+ * Returns 0 if the input could not be read. */
+static int count_document(Lexer *lx, const char *path, const Options *o)
+{
+    FILE *fp = stdin;
+    int mapped = 0, ok = 1;
+    if (path)
+    {
+        fp = fopen(path, "r");
+        if (!fp)
+        {
+            perror(path);
+            return 0;
+        }
+    }
+#ifdef TOPIC_INDEX_HAVE_MMAP
+    if (o->use_mmap && fp != stdin)
+        mapped = lex_mapped(lx, fp, path, o->nthreads);
+#endif
+    if (mapped < 0)
+        ok = 0;
+    else if (!mapped)
+        ok = lex_stream(lx, fp, path ? path : "stdin", o->nthreads, o->read_ahead);
+    lexer_finish(lx);
+    if (lx->approx)
+        approx_finish(lx->approx, lx->table, lx->total_sentences + 1);
+    if (fp != stdin)
+        fclose(fp);
+    return ok;
+}
+
+/* One document of a --corpus run */
+typedef struct
+{
+    const char *path;
+    long total_words;
+    long total_sentences; /* as its own report would give it */
+    long *topics;         /* with --tfidf: count and sentences of each topic */
+    int ok;               /* counted; the others are left out of the corpus */
+} CorpusDoc;
+
+/* Everything a report needs about one counted document, or with --corpus
+ * about all of them */
+typedef struct
+{
+    const char *path; /* NULL for stdin and for a corpus */
+    long total_words;
+    long total_sentences;
+    WordRow *top;       /* best-first */
+    size_t top_len;
+    WordRow *grams;     /* top n-grams with --ngrams, best-first, words joined by spaces */
+    size_t grams_len;
+    Arena gram_strings;
+    WordRow *vocab;     /* whole table in report order, with --vocab */
+    size_t vocab_len;
+    size_t windows;     /* with --window: windows up to the last word */
+    const long *win_counts; /* window_topics per window, owned by the lexer */
+    const long *win_words;
+    const long *win_sentences;
+    int approx;         /* counts are estimates within the bounds below */
+    long approx_error;  /* a count exceeds the truth by at most this... */
+    double approx_confidence; /* ...with this probability */
+    long approx_floor;  /* every word counted more often is listed */
+    size_t documents;   /* with --corpus: documents counted, 0 in a document's report */
+    const CorpusDoc *docs; /* with --tfidf: every document given, in order */
+    size_t ndocs;
+    unsigned long snapshot; /* with --every: a snapshot's number from 1, 0 in the final report */
+} Report;
+
+/* The k most frequent n-grams of the --ngrams size that neither start nor
+ * end with a stop word, spelled out for the report.  Topics are left out. */
+static void report_grams(Report *r, Lexer *lx, size_t k)
+{
+    GramTable *g = lx->grams;
+    GramTop top;
+    size_t i;
+    r->grams = NULL;
+    r->grams_len = 0;
+    memset(&r->gram_strings, 0, sizeof(r->gram_strings));
+    if (!gram_report || !g || !lx->table)
+        return;
+    top.items = (GramEntry **)xmalloc((k ? k : 1) * sizeof(GramEntry *));
+    top.len = 0;
+    top.cap = k;
+    top.words = lx->table;
+    for (i = 0; i <= g->mask; ++i)
+    {
+        GramEntry *e = &g->slots[i];
+        uint32_t w0, w1;
+        if (!e->hash || (int)e->n != gram_report || (e->flags & WORD_TOPIC))
+            continue;
+        w0 = find_hashed_entry(lx->table, e->words[0]);
+        w1 = find_hashed_entry(lx->table, e->words[e->n - 1]);
+        if (w0 == WORD_NONE || w1 == WORD_NONE || (lx->table->flags[w0] & WORD_STOP) ||
+            (lx->table->flags[w1] & WORD_STOP))
+            continue;
+        gram_top_offer(&top, e);
+    }
+    gram_top_sort(&top);
+
+    r->grams = (WordRow *)xcalloc(top.len ? top.len : 1, sizeof(WordRow));
+    for (i = 0; i < top.len; ++i)
+    {
+        const GramEntry *e = top.items[i];
+        WordRow *row = &r->grams[i];
+        size_t len = 0, j;
+        char *text;
+        for (j = 0; j < e->n; ++j)
+            len += strlen(gram_word(lx->table, e->words[j])) + 1;
+        text = arena_alloc(&r->gram_strings, len);
+        row->len = 0;
+        for (j = 0; j < e->n; ++j)
+        {
+            const char *w = gram_word(lx->table, e->words[j]);
+            size_t n = strlen(w);
+            if (j > 0)
+                text[row->len++] = ' ';
+            memcpy(text + row->len, w, n);
+            row->len += n;
+        }
+        text[row->len] = '\0';
+        row->word = text;
+        row->count = e->count;
+        row->sentence_count = e->sentence_count;
+    }
+    r->grams_len = top.len;
+    free(top.items);
+}
+
+static void build_report(Report *r, const char *path, Lexer *lx, TopicList *topics, const Options *o)
+{
+    WordTable *t = lx->table;
+    TopK top;
+    uint32_t e;
+    size_t i;
+
+    r->path = path;
+    r->documents = 0;
+    r->docs = NULL;
+    r->ndocs = 0;
+    r->snapshot = 0;
+    r->approx = lx->approx != NULL;
+    if (lx->approx)
+        approx_bounds(lx->approx, &r->approx_error, &r->approx_floor, &r->approx_confidence);
+    r->total_words = lx->total_words;
+    r->total_sentences = lx->total_sentences;
+    if (r->total_sentences == 0 && r->total_words > 0)
+    {
+        /* treat entire text as one sentence if no terminator found */
+        r->total_sentences = 1;
+    }
+
+    /* Find topic entries */
+    topic_list_resolve(topics, t, lx->grams);
+    report_grams(r, lx, o->top_k);
+    r->windows = window_size ? lx->win_len : 0;
+    r->win_counts = lx->win_counts;
+    r->win_words = lx->win_words;
+    r->win_sentences = lx->win_sentences;
+
+    /* Gather the top K non-stop-words excluding topics in one pass over
+     * the dense arrays */
+    topk_init(&top, o->top_k < t->size ? o->top_k : t->size, t);
+    for (e = 0; e < t->size; ++e)
+    {
+        if (t->flags[e] & (WORD_TOPIC | WORD_STOP))
+            continue; /* skip the topics and stop words */
+        topk_offer(&top, e);
+    }
+    topk_sort(&top);
+    r->top = (WordRow *)xmalloc((top.len ? top.len : 1) * sizeof(WordRow));
+    r->top_len = top.len;
+    for (i = 0; i < top.len; ++i)
+        r->top[i] = word_row(t, top.items[i]);
+    topk_free(&top);
+
+    r->vocab = NULL;
+    r->vocab_len = 0;
+    if (o->vocab)
+    {
+        uint32_t *order = (uint32_t *)xmalloc((t->size ? t->size : 1) * sizeof(uint32_t));
+        for (e = 0; e < t->size; ++e)
+            order[e] = e;
+        sort_ranked(t, order, t->size);
+        r->vocab = (WordRow *)xmalloc((t->size ? t->size : 1) * sizeof(WordRow));
+        r->vocab_len = t->size;
+        for (i = 0; i < t->size; ++i)
+            r->vocab[i] = word_row(t, order[i]);
+        free(order);
+    }
+}
+
+static void free_report(Report *r)
+{
+    free(r->top);
+    free(r->vocab);
+    free(r->grams);
+    arena_free(&r->gram_strings);
+}
+
+/* One line per window: where it starts, its totals and a column per topic */
+static void print_windows(const Report *r, const TopicList *topics)
+{
+    size_t w, i;
+    printf("-------------------------------------------------------------------\n");
+    printf("Windows of %llu %s\n", (unsigned long long)window_size, window_unit_names[window_unit]);
+    printf("%8s %14s %8s %10s", "Window", "Start", "Words", "Sentences");
+    for (i = 0; i < topics->len; ++i)
+    {
+        const char *key = topics->items[i].key;
+        int width = (int)strlen(key) - utf8_extra_bytes(key);
+        printf(" %*s", (width < 8 ? 8 : width) + utf8_extra_bytes(key), key);
+    }
+    printf("\n");
+    for (w = 0; w < r->windows; ++w)
+    {
+        printf("%8lu %14llu %8ld %10ld", (unsigned long)w, (unsigned long long)w * window_size, r->win_words[w],
+               r->win_sentences[w]);
+        for (i = 0; i < topics->len; ++i)
+        {
+            const char *key = topics->items[i].key;
+            int width = (int)strlen(key) - utf8_extra_bytes(key);
+            printf(" %*ld", width < 8 ? 8 : width, r->win_counts[w * window_topics + topics->items[i].column]);
+        }
+        printf("\n");
+    }
+}
+
+/* tf * idf of topic i in a document of the corpus: its share of the
+ * document's words times ln(documents / documents containing it) */
+static double topic_tfidf(const Report *r, const CorpusDoc *d, const TopicList *topics, size_t i)
+{
+    const WordRow *row = topics->items[i].entry;
+    if (!row || row->docs <= 0 || d->total_words <= 0 || d->topics[2 * i] == 0)
+        return 0.0;
+    return (double)d->topics[2 * i] / (double)d->total_words * log((double)r->documents / (double)row->docs);
+}
+
+static void print_text(const Report *r, const TopicList *topics, const Options *o)
+{
+    long total_words = r->total_words;
+    long total_sentences = r->total_sentences;
+    size_t i;
+
+    printf("=============================\n");
+    printf("Topic index report\n");
+    if (r->documents)
+        printf("Corpus: %lu documents\n", (unsigned long)r->documents);
+    else if (o->batch)
+        printf("File: %s\n", r->path ? r->path : "-");
+    if (r->snapshot)
+        printf("Snapshot: %lu (still reading)\n", r->snapshot);
+    if (topics->len == 1)
+        printf("Topic word: '%s'\n", topics->items[0].given);
+    else
+    {
+        printf("Topic words:");
+        for (i = 0; i < topics->len; ++i)
+            printf("%s '%s'", i ? "," : "", topics->items[i].given);
+        printf("\n");
+    }
+    printf("Total words: %ld\n", total_words);
+    printf("Total sentences: %ld\n", total_sentences);
+    if (r->approx)
+    {
+        printf("Approximate: counts are at most %ld too high (%.1f%% confidence);\n", r->approx_error,
+               100.0 * r->approx_confidence);
+        printf("every word counted more than %ld times is listed; topics are exact\n", r->approx_floor);
+    }
+    printf("=============================\n");
+    printf("%-15s %8s %10s %15s %10s", "Word", "Count", "% Words", "Sentences", "% Sent");
+    printf(r->documents ? " %8s\n" : "\n", "Docs");
+    printf("-------------------------------------------------------------------\n");
+
+    /* helper macro for printing line */
+#define PRINT_LINE(entry)                                                                            \
+    do                                                                                               \
+    {                                                                                                \
+        if (entry)                                                                                   \
+        {                                                                                            \
+            double pct_w = (total_words > 0)                                                         \
+                               ? (100.0 * (double)(entry)->count / (double)total_words)              \
+                               : 0.0;                                                                \
+            double pct_s = (total_sentences > 0)                                                     \
+                               ? (100.0 * (double)(entry)->sentence_count / (double)total_sentences) \
+                               : 0.0;                                                                \
+            printf("%-*s %8ld %9.2f%%   %5ld/%-7ld %8.2f%%",                                         \
+                   15 + utf8_extra_bytes((entry)->word), (entry)->word, (entry)->count, pct_w,       \
+                   (entry)->sentence_count, total_sentences, pct_s);                                 \
+            if (r->documents)                                                                        \
+                printf(" %8ld", (entry)->docs);                                                      \
+            putchar('\n');                                                                           \
+        }                                                                                            \
+    } while (0)
+
+    for (i = 0; i < topics->len; ++i)
+    {
+        const Topic *tp = &topics->items[i];
+        WordRow none;
+        const WordRow *row = tp->entry;
+        if (topics->len > 1 && !row)
+        {
+            /* with several topics, report the absent ones as zero rows */
+            memset(&none, 0, sizeof(none));
+            none.word = tp->key;
+            row = &none;
+        }
+        PRINT_LINE(row);
+    }
+    for (i = 0; i < r->top_len; ++i)
+    {
+        PRINT_LINE(&r->top[i]);
+    }
+    if (r->grams_len)
+    {
+        printf("-------------------------------------------------------------------\n");
+        for (i = 0; i < r->grams_len; ++i)
+        {
+            PRINT_LINE(&r->grams[i]);
+        }
+    }
+    if (r->windows)
+        print_windows(r, topics);
+    if (r->vocab)
+    {
+        printf("-------------------------------------------------------------------\n");
+        for (i = 0; i < r->vocab_len; ++i)
+        {
+            PRINT_LINE(&r->vocab[i]);
+        }
+    }
+    if (r->docs)
+    {
+        printf("-------------------------------------------------------------------\n");
+        printf("%-15s %8s %10s  %s\n", "TF-IDF", "Count", "Score", "File");
+        for (i = 0; i < r->ndocs; ++i)
+        {
+            const CorpusDoc *d = &r->docs[i];
+            size_t j;
+            for (j = 0; d->ok && j < topics->len; ++j)
+                printf("%-*s %8ld %10.6f  %s\n", 15 + utf8_extra_bytes(topics->items[j].key), topics->items[j].key,
+                       d->topics[2 * j], topic_tfidf(r, d, topics, j), d->path);
+        }
+    }
+
+    printf("=============================\n");
+}
+
+/* JSON string, escaped */
+static void put_json_string(const char *s)
+{
+    size_t n = strlen(s), len;
+    putchar('"');
+    for (; *s; s += len, n -= len)
+    {
+        unsigned char c = (unsigned char)*s;
+        len = 1;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else if (c < 0x80)
+            putchar(c);
+        else if (utf8_decode((const unsigned char *)s, n, &len) >= 0)
+            fwrite(s, 1, len, stdout);
+        else
+            printf("\\u%04x", c); /* a byte that is not UTF-8, as Latin-1 */
+    }
+    putchar('"');
+}
+
+/* docs < 0 leaves the "docs" key out */
+static void put_json_row(const char *role, const char *word, long count, long sentences, long docs, int *first)
+{
+    printf("%s{\"role\":\"%s\",\"word\":", *first ? "" : ",", role);
+    put_json_string(word);
+    printf(",\"count\":%ld,\"sentences\":%ld", count, sentences);
+    if (docs >= 0)
+        printf(",\"docs\":%ld", docs);
+    putchar('}');
+    *first = 0;
+}
+
+/* One JSON object per document; a corpus is one with "documents" and
+ * "docs" in every row, then with --tfidf one "tfidf" object per document */
+static void print_jsonl(const Report *r, const TopicList *topics)
+{
+    size_t i;
+    int first = 1;
+    long docs = -1;
+    printf("{\"file\":");
+    if (r->path)
+        put_json_string(r->path);
+    else
+        printf("null");
+    printf(",\"total_words\":%ld,\"total_sentences\":%ld,", r->total_words, r->total_sentences);
+    if (r->documents)
+        printf("\"documents\":%lu,", (unsigned long)r->documents);
+    if (r->snapshot)
+        printf("\"snapshot\":%lu,", r->snapshot);
+    if (r->approx)
+        printf("\"approx\":{\"error\":%ld,\"confidence\":%.4f,\"floor\":%ld},", r->approx_error,
+               r->approx_confidence, r->approx_floor);
+    printf("\"rows\":[");
+    for (i = 0; i < topics->len; ++i)
+    {
+        const Topic *tp = &topics->items[i];
+        if (r->documents)
+            docs = tp->entry ? tp->entry->docs : 0;
+        put_json_row("topic", tp->key, tp->entry ? tp->entry->count : 0,
+                     tp->entry ? tp->entry->sentence_count : 0, docs, &first);
+    }
+    for (i = 0; i < r->top_len; ++i)
+        put_json_row("top", r->top[i].word, r->top[i].count, r->top[i].sentence_count,
+                     r->documents ? r->top[i].docs : -1, &first);
+    for (i = 0; i < r->grams_len; ++i)
+        put_json_row("ngram", r->grams[i].word, r->grams[i].count, r->grams[i].sentence_count, -1, &first);
+    for (i = 0; i < r->vocab_len; ++i)
+        put_json_row("vocab", r->vocab[i].word, r->vocab[i].count, r->vocab[i].sentence_count,
+                     r->documents ? r->vocab[i].docs : -1, &first);
+    printf("]");
+    if (r->windows)
+    {
+        size_t w;
+        printf(",\"windows\":{\"unit\":\"%s\",\"size\":%llu,\"words\":[", window_unit_names[window_unit],
+               (unsigned long long)window_size);
+        for (w = 0; w < r->windows; ++w)
+            printf("%s%ld", w ? "," : "", r->win_words[w]);
+        printf("],\"sentences\":[");
+        for (w = 0; w < r->windows; ++w)
+            printf("%s%ld", w ? "," : "", r->win_sentences[w]);
+        printf("],\"topics\":[");
+        for (i = 0; i < topics->len; ++i)
+        {
+            printf("%s{\"word\":", i ? "," : "");
+            put_json_string(topics->items[i].key);
+            printf(",\"counts\":[");
+            for (w = 0; w < r->windows; ++w)
+                printf("%s%ld", w ? "," : "", r->win_counts[w * window_topics + topics->items[i].column]);
+            printf("]}");
+        }
+        printf("]}");
+    }
+    printf("}\n");
+    for (i = 0; i < r->ndocs; ++i)
+    {
+        const CorpusDoc *d = &r->docs[i];
+        size_t j;
+        if (!d->ok)
+            continue;
+        printf("{\"file\":");
+        put_json_string(d->path);
+        printf(",\"total_words\":%ld,\"total_sentences\":%ld,\"tfidf\":[", d->total_words, d->total_sentences);
+        for (j = 0; j < topics->len; ++j)
+        {
+            printf("%s{\"word\":", j ? "," : "");
+            put_json_string(topics->items[j].key);
+            printf(",\"count\":%ld,\"sentences\":%ld,\"tfidf\":%.6f}", d->topics[2 * j], d->topics[2 * j + 1],
+                   topic_tfidf(r, d, topics, j));
+        }
+        printf("]}\n");
+    }
+}
+
+/* The file column: a tab, newline, carriage return or backslash in the
+ * path is written as \t, \n, \r or \\ so it cannot shift the columns */
+static void put_tsv_path(const char *path)
+{
+    if (!path)
+        path = "-";
+    for (; *path; ++path)
+    {
+        switch (*path)
+        {
+        case '\t':
+            fputs("\\t", stdout);
+            break;
+        case '\n':
+            fputs("\\n", stdout);
+            break;
+        case '\r':
+            fputs("\\r", stdout);
+            break;
+        case '\\':
+            fputs("\\\\", stdout);
+            break;
+        default:
+            putchar(*path);
+        }
+    }
+}
+
+/* A corpus's rows are filed under "*" and add the docs and tfidf columns */
+static void put_tsv_row(const Report *r, const char *role, const char *word, long count, long sentences, long docs)
+{
+    if (r->documents)
+    {
+        printf("*\t%s\t%s\t%ld\t%ld\t%ld\t%ld\t%ld\t-\n", role, word, count, sentences, r->total_words,
+               r->total_sentences, docs);
+    }
+    else
+    {
+        put_tsv_path(r->path);
+        printf("\t%s\t%s\t%ld\t%ld\t%ld\t%ld\n", role, word, count, sentences, r->total_words,
+               r->total_sentences);
+    }
+}
+
+/* One row per reported word; the header is printed once per run */
+static void print_tsv(const Report *r, const TopicList *topics)
+{
+    size_t i, w;
+    for (i = 0; i < topics->len; ++i)
+    {
+        const Topic *tp = &topics->items[i];
+        put_tsv_row(r, "topic", tp->key, tp->entry ? tp->entry->count : 0,
+                    tp->entry ? tp->entry->sentence_count : 0, tp->entry ? tp->entry->docs : 0);
+    }
+    for (i = 0; i < r->top_len; ++i)
+        put_tsv_row(r, "top", r->top[i].word, r->top[i].count, r->top[i].sentence_count, r->top[i].docs);
+    for (i = 0; i < r->grams_len; ++i)
+        put_tsv_row(r, "ngram", r->grams[i].word, r->grams[i].count, r->grams[i].sentence_count, 0);
+    for (i = 0; i < r->vocab_len; ++i)
+        put_tsv_row(r, "vocab", r->vocab[i].word, r->vocab[i].count, r->vocab[i].sentence_count, r->vocab[i].docs);
+    /* tfidf rows: a document's own counts and totals, the corpus docs */
+    for (w = 0; w < r->ndocs; ++w)
+    {
+        const CorpusDoc *d = &r->docs[w];
+        for (i = 0; d->ok && i < topics->len; ++i)
+        {
+            put_tsv_path(d->path);
+            printf("\ttfidf\t%s\t%ld\t%ld\t%ld\t%ld\t%ld\t%.6f\n", topics->items[i].key, d->topics[2 * i],
+                   d->topics[2 * i + 1], d->total_words, d->total_sentences,
+                   topics->items[i].entry ? topics->items[i].entry->docs : 0, topic_tfidf(r, d, topics, i));
+        }
+    }
+    /* window rows: the window's number in the sentences column and its own
+     * totals in the last two */
+    for (w = 0; w < r->windows; ++w)
+        for (i = 0; i < topics->len; ++i)
+        {
+            put_tsv_path(r->path);
+            printf("\twindow\t%s\t%ld\t%lu\t%ld\t%ld\n", topics->items[i].key,
+                   r->win_counts[w * window_topics + topics->items[i].column], (unsigned long)w, r->win_words[w],
+                   r->win_sentences[w]);
+        }
+}
+
+/* Growable byte buffer for binary records */
+typedef struct
+{
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} ByteBuf;
+
+static void bytebuf_put(ByteBuf *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap)
+    {
+        while (b->len + n > b->cap)
+            b->cap = b->cap ? b->cap * 2 : 256;
+        b->data = (unsigned char *)realloc(b->data, b->cap);
+        if (!b->data)
+        {
+            fprintf(stderr, "topic_index: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+/* unsigned LEB128: 7 bits per byte, high bit set on all but the last */
+static void bytebuf_varint(ByteBuf *b, unsigned long v)
+{
+    unsigned char tmp[10];
+    size_t n = 0;
+    do
+    {
+        tmp[n] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        if (v)
+            tmp[n] |= 0x80;
+        ++n;
+    } while (v);
+    bytebuf_put(b, tmp, n);
+}
+
+static void bytebuf_string(ByteBuf *b, const char *s, size_t len)
+{
+    bytebuf_varint(b, (unsigned long)len);
+    bytebuf_put(b, s, len);
+}
+
+/* row: role byte (0 topic, 1 top, 2 vocab, 3 ngram, 4 window), count,
+ * sentences (a window's number for role 4), word */
+static void bytebuf_row(ByteBuf *b, int role, const char *word, size_t len, long count, long sentences)
+{
+    unsigned char r = (unsigned char)role;
+    bytebuf_put(b, &r, 1);
+    bytebuf_varint(b, (unsigned long)count);
+    bytebuf_varint(b, (unsigned long)sentences);
+    bytebuf_string(b, word, len);
+}
+
+/* Binary record: an 8-byte little-endian length of the body, then the body:
+ * varint total_words, varint total_sentences, string path ("" for stdin),
+ * varint row count and the rows.  A stream starts with the magic "TIXR1\n".
+ * Strings are a varint length followed by the bytes. */
+static void print_bin(const Report *r, const TopicList *topics, ByteBuf *b)
+{
+    unsigned char len[8];
+    size_t i, w;
+    b->len = 0;
+    bytebuf_varint(b, (unsigned long)r->total_words);
+    bytebuf_varint(b, (unsigned long)r->total_sentences);
+    bytebuf_string(b, r->path ? r->path : "", r->path ? strlen(r->path) : 0);
+    bytebuf_varint(b, (unsigned long)(topics->len + r->top_len + r->grams_len + r->vocab_len +
+                                      r->windows * topics->len));
+    for (i = 0; i < topics->len; ++i)
+    {
+        const Topic *tp = &topics->items[i];
+        bytebuf_row(b, 0, tp->key, tp->len, tp->entry ? tp->entry->count : 0,
+                    tp->entry ? tp->entry->sentence_count : 0);
+    }
+    for (i = 0; i < r->top_len; ++i)
+        bytebuf_row(b, 1, r->top[i].word, r->top[i].len, r->top[i].count,
+                    r->top[i].sentence_count);
+    for (i = 0; i < r->grams_len; ++i)
+        bytebuf_row(b, 3, r->grams[i].word, r->grams[i].len, r->grams[i].count, r->grams[i].sentence_count);
+    for (i = 0; i < r->vocab_len; ++i)
+        bytebuf_row(b, 2, r->vocab[i].word, r->vocab[i].len, r->vocab[i].count, r->vocab[i].sentence_count);
+    for (w = 0; w < r->windows; ++w)
+        for (i = 0; i < topics->len; ++i)
+            bytebuf_row(b, 4, topics->items[i].key, topics->items[i].len,
+                        r->win_counts[w * window_topics + topics->items[i].column], (long)w);
+    for (i = 0; i < 8; ++i)
+        len[i] = (unsigned char)(((unsigned long long)b->len >> (8 * i)) & 0xff);
+    fwrite(len, 1, sizeof(len), stdout);
+    fwrite(b->data, 1, b->len, stdout);
+}
+
+static ByteBuf bin_buf;
+
+/* Once per run, before the first report */
+static void print_preamble(const Options *o)
+{
+    if (o->format == FORMAT_TSV)
+        printf("file\trole\tword\tcount\tsentences\ttotal_words\ttotal_sentences%s\n", o->corpus ? "\tdocs\ttfidf" : "");
+    else if (o->format == FORMAT_BIN)
+        fwrite("TIXR1\n", 1, 6, stdout);
+}
+
+/* Report the document just counted into lx in the chosen format.  Each
+ * report is flushed as soon as it is written so batch results stream. */
+static void write_report(const Report *r, const TopicList *topics, const Options *o)
+{
+    switch (o->format)
+    {
+    case FORMAT_JSONL:
+        print_jsonl(r, topics);
+        break;
+    case FORMAT_TSV:
+        print_tsv(r, topics);
+        break;
+    case FORMAT_BIN:
+        print_bin(r, topics, &bin_buf);
+        break;
+    default:
+        print_text(r, topics, o);
+        break;
+    }
+    fflush(stdout);
+}
+
+static void print_report(const char *path, Lexer *lx, TopicList *topics, const Options *o)
+{
+    Report r;
+    stats_stage(STAGE_SELECT);
+    build_report(&r, path, lx, topics, o);
+    stats_stage(STAGE_OUTPUT);
+    write_report(&r, topics, o);
+    free_report(&r);
+    stats_stage(STAGE_OTHER);
+}
+
+/* A --every run: the running top K, and when the next snapshot is due */
+typedef struct
+{
+    LiveTop top;
+    Lexer *lx;
+    TopicList *topics;
+    const Options *opt;
+    const char *path;
+    double seconds;   /* between snapshots, 0 if they come every top.every words */
+    double next_time;
+    unsigned long snapshots;
+} Live;
+
+/* The topics and the running top K as they stand: a report built without
+ * a pass over the table, so it costs O(K log K) plus the topic lookups */
+static void live_snapshot(void *arg, int due)
+{
+    Live *lv = (Live *)arg;
+    Lexer *lx = lv->lx;
+    uint32_t *ids;
+    Report r;
+    size_t i;
+    if (due)
+        lv->top.next += lv->top.every;
+    else if (lv->seconds <= 0 || now_seconds() < lv->next_time)
+        return;
+    else
+        lv->next_time = now_seconds() + lv->seconds;
+
+    memset(&r, 0, sizeof(r));
+    r.path = lv->path;
+    r.snapshot = ++lv->snapshots;
+    r.total_words = lx->total_words;
+    r.total_sentences = lx->total_sentences;
+    if (r.total_sentences == 0 && r.total_words > 0)
+        r.total_sentences = 1; /* as build_report() counts it */
+    topic_list_resolve(lv->topics, lx->table, lx->grams);
+    ids = (uint32_t *)xmalloc((lv->top.len ? lv->top.len : 1) * sizeof(uint32_t));
+    memcpy(ids, lv->top.heap, lv->top.len * sizeof(uint32_t));
+    sort_ranked(lx->table, ids, lv->top.len);
+    r.top = (WordRow *)xmalloc((lv->top.len ? lv->top.len : 1) * sizeof(WordRow));
+    r.top_len = lv->top.len;
+    for (i = 0; i < lv->top.len; ++i)
+        r.top[i] = word_row(lx->table, ids[i]);
+    free(ids);
+    write_report(&r, lv->topics, lv->opt);
+    free_report(&r);
+}
+
+/* Keep the top K of lx as it counts, and print a snapshot every `words`
+ * words or, checked after each block read, every `seconds` seconds */
+static void live_init(Live *lv, Lexer *lx, TopicList *topics, const Options *o, const char *path, long words,
+                      double seconds)
+{
+    size_t i;
+    live_top_init(&lv->top, o->top_k, topics->len);
+    for (i = 0; i < topics->len; ++i)
+        if (topics->items[i].words < 2)
+            live_top_topic(&lv->top, topics->items[i].key, topics->items[i].len);
+    lv->top.every = words;
+    lv->top.next = words ? lx->total_words + words : 0;
+    lv->top.snapshot = live_snapshot;
+    lv->top.arg = lv;
+    lv->lx = lx;
+    lv->topics = topics;
+    lv->opt = o;
+    lv->path = path;
+    lv->seconds = seconds;
+    lv->next_time = now_seconds() + seconds;
+    lv->snapshots = 0;
+    lx->live = &lv->top;
+}
+
+static void live_free(Live *lv)
+{
+    lv->lx->live = NULL;
+    live_top_free(&lv->top);
+}
+
+/*
+ * Index files (--save-index, --load-index).  An index keeps what a report
+ * needs from a document – the lexer totals and every word's counts – so
+ * topics can be queried again without re-reading the text.  The layout is
+ * native-endian and aligned for its fields, and a report is answered from
+ * the mapped file in place, without building a word table:
+ *
+ *     IndexHeader
+ *     IndexRecord[words]   best-first, as in the report (count, then word)
+ *     int64_t wide[2][wide] count and sentences of the leading records
+ *                          whose counts do not fit in 32 bits
+ *     uint32_t slots[slots] record + 1 (0: empty) at hash_word() of its
+ *                          word, probed linearly; slots is a power of two
+ *     char strings[]       NUL-terminated words, found by word_off
+ *
+ * A topic is a probe into slots, and the top K are the first K records
+ * that are neither stop words nor topics.  Only --append reads every
+ * record, into the table it counts on.  Stop-word flags are not stored;
+ * they follow the stop lists given when the index is read.  Nor is the
+ * end of the text taken as the end of a sentence: a terminator still
+ * waiting for the next word is kept with the lexer state that settles it,
+ * so --append carries on exactly where the indexed text stopped.
+ */
+#define INDEX_MAGIC "TIXIDX1\n"
+#define INDEX_BYTE_ORDER 0x01020304UL
+#define INDEX_VERSION 3
+#define INDEX_FIRST 0x80000000UL /* IndexRecord::len_flags: counted in sentence 0 */
+#define INDEX_OPEN 0x40000000UL  /* last counted in the sentence still open */
+#define INDEX_LEN 0x3fffffffUL
+
+typedef struct
+{
+    char magic[8];
+    uint32_t byte_order; /* INDEX_BYTE_ORDER as written */
+    uint32_t version;
+    int64_t total_words;
+    int64_t total_sentences; /* sentence ends counted, the next sentence id */
+    uint64_t words;
+    uint64_t strings_len;
+    uint32_t sent_state;     /* SENT_* of a terminator the text left pending */
+    uint8_t last_byte;       /* of the text */
+    uint8_t names;           /* Lexer::names */
+    uint8_t sent_newline;    /* a line break follows that terminator */
+    uint8_t reserved;        /* 0 */
+    uint64_t sent_back;      /* bytes from that terminator to the end of the text */
+    uint64_t slots;          /* 0 for an empty index */
+    uint64_t wide;
+} IndexHeader;
+
+typedef struct
+{
+    uint32_t word_off;
+    uint32_t len_flags;      /* length, INDEX_FIRST, INDEX_OPEN */
+    uint32_t count;          /* for records below IndexHeader::wide, see wide[] */
+    uint32_t sentence_count;
+} IndexRecord;
+
+/* A mapped (or read) index */
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    int mapped;
+    const IndexHeader *h;
+    const IndexRecord *recs;
+    const int64_t *wide;
+    const uint32_t *slots;
+    const char *strings;
+} Index;
+
+/* Write the table as an index.  The file is built next to its final name
+ * and renamed over it, so readers never see a half-written index. */
+static int save_index(const Lexer *lx, const char *path)
+{
+    const WordTable *t = lx->table;
+    uint32_t *order = (uint32_t *)xmalloc((t->size ? t->size : 1) * sizeof(uint32_t));
+    uint32_t *slots;
+    size_t n = t->size, i;
+    char *tmp = (char *)xmalloc(strlen(path) + 5);
+    IndexHeader h;
+    uint64_t off = 0;
+    FILE *fp;
+    int ok;
+
+    for (i = 0; i < n; ++i)
+        order[i] = (uint32_t)i;
+    sort_ranked(t, order, n);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.byte_order = INDEX_BYTE_ORDER;
+    h.version = INDEX_VERSION;
+    h.total_words = lx->total_words;
+    h.total_sentences = lx->total_sentences;
+    h.words = n;
+    for (i = 0; i < n; ++i)
+        h.strings_len += word_len(t, order[i]) + 1;
+    h.sent_state = (uint32_t)lx->sent_state;
+    h.last_byte = lx->last_byte;
+    h.names = (uint8_t)lx->names;
+    h.sent_newline = (uint8_t)lx->sent_newline;
+    h.sent_back = lx->sent_state ? lx->fed - lx->sent_at : 0;
+    /* counts only fall in rank order, so the wide ones come first */
+    while (h.wide < n && (uint64_t)word_counter(t, order[h.wide], COUNTER_WORDS) > UINT32_MAX)
+        ++h.wide;
+    if (h.strings_len > UINT32_MAX)
+    {
+        fprintf(stderr, "topic_index: %s: too many words for an index (%llu bytes of them)\n", path,
+                (unsigned long long)h.strings_len);
+        free(tmp);
+        free(order);
+        return 0;
+    }
+
+    /* at most 3/4 full */
+    for (h.slots = n ? 1 : 0; h.slots && h.slots * 3 < (uint64_t)n * 4; h.slots <<= 1)
+        ;
+    slots = (uint32_t *)xcalloc(h.slots ? h.slots : 1, sizeof(uint32_t));
+    for (i = 0; i < n; ++i)
+    {
+        size_t s = hash_word(word_text(t, order[i]), word_len(t, order[i])) & (h.slots - 1);
+        while (slots[s])
+            s = (s + 1) & (h.slots - 1);
+        slots[s] = (uint32_t)i + 1;
+    }
+
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (!fp)
+    {
+        perror(tmp);
+        free(slots);
+        free(tmp);
+        free(order);
+        return 0;
+    }
+    ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    for (i = 0; ok && i < n; ++i)
+    {
+        uint32_t e = order[i];
+        IndexRecord rec;
+        rec.word_off = (uint32_t)off;
+        rec.len_flags = (uint32_t)word_len(t, e);
+        if (t->flags[e] & WORD_FIRST)
+            rec.len_flags |= INDEX_FIRST;
+        if (t->last_sentence_ids[e] == lx->total_sentences)
+            rec.len_flags |= INDEX_OPEN;
+        rec.count = i < h.wide ? 0 : (uint32_t)word_counter(t, e, COUNTER_WORDS);
+        rec.sentence_count = i < h.wide ? 0 : (uint32_t)word_counter(t, e, COUNTER_SENTENCES);
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+        off += word_len(t, e) + 1;
+    }
+    for (i = 0; ok && i < h.wide; ++i)
+    {
+        int64_t wide[2];
+        wide[0] = word_counter(t, order[i], COUNTER_WORDS);
+        wide[1] = word_counter(t, order[i], COUNTER_SENTENCES);
+        ok = fwrite(wide, sizeof(wide), 1, fp) == 1;
+    }
+    if (ok && h.slots)
+        ok = fwrite(slots, sizeof(uint32_t), h.slots, fp) == h.slots;
+    for (i = 0; ok && i < n; ++i)
+        ok = fwrite(word_text(t, order[i]), word_len(t, order[i]) + 1, 1, fp) == 1;
+    if (fclose(fp) != 0)
+        ok = 0;
+    if (ok && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok)
+    {
+        perror(path);
+        remove(tmp);
+    }
+    free(slots);
+    free(tmp);
+    free(order);
+    return ok;
+}
+
+/* Read a whole index into memory, mapping it where the platform can */
+static unsigned char *index_read(FILE *fp, size_t *size, int *mapped)
+{
+    unsigned char *data = NULL;
+    size_t cap = 0, len = 0, got;
+    *mapped = 0;
+#ifdef TOPIC_INDEX_HAVE_MMAP
+    {
+        struct stat st;
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (uintmax_t)st.st_size <= (uintmax_t)SIZE_MAX)
+        {
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if (map != MAP_FAILED)
+            {
+                *size = (size_t)st.st_size;
+                *mapped = 1;
+                return (unsigned char *)map;
+            }
+        }
+    }
+#endif
+    do
+    {
+        if (len == cap)
+        {
+            cap = cap ? cap * 2 : READ_BLOCK_SIZE;
+            data = (unsigned char *)realloc(data, cap);
+            if (!data)
+            {
+                fprintf(stderr, "topic_index: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        got = fread(data + len, 1, cap - len, fp);
+        len += got;
+    } while (got > 0);
+    if (ferror(fp))
+    {
+        free(data);
+        return NULL;
+    }
+    *size = len;
+    return data;
+}
+
+static void index_close(Index *ix)
+{
+#ifdef TOPIC_INDEX_HAVE_MMAP
+    if (ix->mapped)
+        munmap(ix->data, ix->size);
+    else
+#endif
+        free(ix->data);
+    ix->data = NULL;
+}
+
+/* Do the sections the header gives take up the rest bytes after it? */
+static int index_fits(const IndexHeader *h, uint64_t rest)
+{
+    if (h->words > rest / sizeof(IndexRecord))
+        return 0;
+    rest -= h->words * sizeof(IndexRecord);
+    if (h->wide > h->words || h->wide > rest / (2 * sizeof(int64_t)))
+        return 0;
+    rest -= h->wide * 2 * sizeof(int64_t);
+    if (h->slots > rest / sizeof(uint32_t))
+        return 0;
+    return h->strings_len == rest - h->slots * sizeof(uint32_t);
+}
+
+/* Map an index and check that its sections add up; the records themselves
+ * are checked as they are read (index_row()).  With missing_ok a missing
+ * file opens as no index at all (ix->data NULL). */
+static int index_open(Index *ix, const char *path, int missing_ok)
+{
+    FILE *fp = fopen(path, "rb");
+    const IndexHeader *h;
+    int ok = 0;
+
+    memset(ix, 0, sizeof(*ix));
+    if (!fp)
+    {
+        if (missing_ok && errno == ENOENT)
+            return 1;
+        perror(path);
+        return 0;
+    }
+    ix->data = index_read(fp, &ix->size, &ix->mapped);
+    fclose(fp);
+    if (!ix->data)
+    {
+        perror(path);
+        return 0;
+    }
+    h = (const IndexHeader *)(const void *)ix->data;
+    if (ix->size < sizeof(IndexHeader) || memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) != 0)
+        fprintf(stderr, "topic_index: %s: not a topic index\n", path);
+    else if (h->byte_order != INDEX_BYTE_ORDER || h->version != INDEX_VERSION)
+        fprintf(stderr, "topic_index: %s: index from another version or byte order\n", path);
+    else if (!index_fits(h, ix->size - sizeof(IndexHeader)))
+        fprintf(stderr, "topic_index: %s: truncated index\n", path);
+    else if (h->sent_state > SENT_INITIAL || h->names > 3 || (h->sent_state && h->sent_back == 0) ||
+             h->words >= UINT32_MAX || (h->words ? h->slots <= h->words || (h->slots & (h->slots - 1)) : h->slots != 0))
+        fprintf(stderr, "topic_index: %s: corrupt index\n", path);
+    else
+        ok = 1;
+    if (!ok)
+    {
+        index_close(ix);
+        return 0;
+    }
+    ix->h = h;
+    ix->recs = (const IndexRecord *)(const void *)(ix->data + sizeof(IndexHeader));
+    ix->wide = (const int64_t *)(const void *)(ix->recs + h->words);
+    ix->slots = (const uint32_t *)(const void *)(ix->wide + 2 * h->wide);
+    ix->strings = (const char *)(ix->slots + h->slots);
+    return 1;
+}
+
+/* Record i as a report row; 0 if it points outside the strings */
+static int index_row(const Index *ix, uint64_t i, WordRow *row)
+{
+    const IndexRecord *rec = &ix->recs[i];
+    uint32_t len = rec->len_flags & INDEX_LEN;
+    if (rec->word_off >= ix->h->strings_len || len >= ix->h->strings_len - rec->word_off ||
+        ix->strings[rec->word_off + len] != '\0')
+        return 0;
+    row->word = ix->strings + rec->word_off;
+    row->len = len;
+    row->count = i < ix->h->wide ? (long)ix->wide[2 * i] : (long)rec->count;
+    row->sentence_count = i < ix->h->wide ? (long)ix->wide[2 * i + 1] : (long)rec->sentence_count;
+    row->docs = 0;
+    return 1;
+}
+
+/* Find a (folded) word: 1 with its record in *i and row, 0 if the index
+ * does not have it, -1 if the index is corrupt */
+static int index_find(const Index *ix, const char *word, size_t len, uint64_t *i, WordRow *row)
+{
+    uint64_t mask = ix->h->slots - 1, s, n;
+    if (!ix->h->slots)
+        return 0;
+    s = hash_word(word, len) & mask;
+    for (n = 0; n < ix->h->slots; ++n, s = (s + 1) & mask)
+    {
+        uint32_t rec = ix->slots[s];
+        if (!rec)
+            return 0;
+        if (rec > ix->h->words || !index_row(ix, rec - 1, row))
+            return -1;
+        if (row->len == len && memcmp(row->word, word, len) == 0)
+        {
+            *i = rec - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Fill an empty table and lexer from an index, as if the indexed text had
+ * just been counted and not yet ended (see lexer_end_text()), for --append
+ * to count on.  With missing_ok a missing file is an empty index. */
+static int load_index(Lexer *lx, const char *path, int missing_ok)
+{
+    WordTable *t = lx->table;
+    Index ix;
+    uint64_t i;
+    int ok = 1;
+
+    if (!index_open(&ix, path, missing_ok))
+        return 0;
+    if (!ix.data)
+        return 1;
+    word_table_reserve(t, t->size + ix.h->words);
+    for (i = 0; i < ix.h->words; ++i)
+    {
+        WordRow row;
+        uint32_t e;
+        if (!index_row(&ix, i, &row))
+        {
+            fprintf(stderr, "topic_index: %s: corrupt index\n", path);
+            ok = 0;
+            break;
+        }
+        e = intern_word(t, row.word, row.len);
+        set_word_counter(t, e, COUNTER_WORDS, row.count);
+        set_word_counter(t, e, COUNTER_SENTENCES, row.sentence_count);
+        if (ix.recs[i].len_flags & INDEX_FIRST)
+            t->flags[e] |= WORD_FIRST;
+        /* only the open sentence matters to the words still to come */
+        t->last_sentence_ids[e] = (ix.recs[i].len_flags & INDEX_OPEN) ? (long)ix.h->total_sentences : -1;
+    }
+    if (ok)
+    {
+        lx->total_words = (long)ix.h->total_words;
+        lx->total_sentences = (long)ix.h->total_sentences;
+        lx->current_sentence_id = lx->total_sentences;
+        /* offsets in the text that follows count from 0 */
+        lx->sent_state = (int)ix.h->sent_state;
+        lx->sent_at = lx->fed - ix.h->sent_back;
+        lx->last_byte = ix.h->last_byte;
+        lx->names = ix.h->names;
+        lx->sent_newline = ix.h->sent_newline;
+    }
+    index_close(&ix);
+    return ok;
+}
+
+/* The totals a report gives for an index: the text has ended, so a
+ * pending terminator ends its sentence (as lexer_end_text() would) */
+static void index_totals(const Index *ix, long *words, long *sentences)
+{
+    *words = (long)ix->h->total_words;
+    *sentences = (long)ix->h->total_sentences + (ix->h->sent_state != 0);
+    if (*sentences == 0 && *words > 0)
+        *sentences = 1; /* as in build_report() */
+}
+
+/* A record that is a stop word under the lists given for this run */
+static int index_stop(const WordRow *row)
+{
+    return stop_set_contains(&stop_words, hash_word(row->word, row->len), row->word, row->len);
+}
+
+/* build_report() for an index, read in place: the topics are looked up
+ * through its slots and the top K are the first records that qualify */
+static int build_index_report(Report *r, const char *path, const Index *ix, TopicList *topics, const Options *o)
+{
+    uint64_t *topic_recs = (uint64_t *)xmalloc((topics->len ? topics->len : 1) * sizeof(uint64_t));
+    uint64_t i;
+    size_t j, k, ntopics = 0;
+    int ok = 1;
+
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    index_totals(ix, &r->total_words, &r->total_sentences);
+    for (j = 0; ok && j < topics->len; ++j)
+    {
+        Topic *tp = &topics->items[j];
+        int found = tp->words > 1 ? 0 : index_find(ix, tp->key, tp->len, &topic_recs[ntopics], &tp->row);
+        tp->entry = found > 0 ? &tp->row : NULL;
+        ntopics += found > 0;
+        ok = found >= 0;
+    }
+
+    k = o->top_k < ix->h->words ? o->top_k : (size_t)ix->h->words;
+    r->top = (WordRow *)xmalloc((k ? k : 1) * sizeof(WordRow));
+    for (i = 0; ok && i < ix->h->words && r->top_len < k; ++i)
+    {
+        WordRow *row = &r->top[r->top_len];
+        if (!index_row(ix, i, row))
+            ok = 0;
+        else if (!index_stop(row))
+        {
+            for (j = 0; j < ntopics && topic_recs[j] != i; ++j)
+                ;
+            r->top_len += j == ntopics;
+        }
+    }
+
+    if (ok && o->vocab)
+    {
+        r->vocab = (WordRow *)xmalloc((ix->h->words ? ix->h->words : 1) * sizeof(WordRow));
+        for (i = 0; ok && i < ix->h->words; ++i)
+            ok = index_row(ix, i, &r->vocab[i]);
+        r->vocab_len = (size_t)ix->h->words;
+    }
+    if (!ok)
+        fprintf(stderr, "topic_index: %s: corrupt index\n", path);
+    free(topic_recs);
+    return ok;
+}
+
+/* print_report() for an index */
+static int print_index_report(const char *path, const Index *ix, TopicList *topics, const Options *o)
+{
+    Report r;
+    int ok;
+    stats_stage(STAGE_SELECT);
+    ok = build_index_report(&r, path, ix, topics, o);
+    stats_stage(STAGE_OUTPUT);
+    if (ok)
+        write_report(&r, topics, o);
+    free_report(&r);
+    stats_stage(STAGE_OTHER);
+    return ok;
+}
+
+/*
+ * Benchmarking (--gen-corpus, --bench).  The generator writes synthetic
+ * text whose word ranks follow a Zipf distribution, so runs can be sized
+ * from a few MB to tens of GB and from a thousand to tens of millions of
+ * distinct words.  --bench times the stages of a single-document run.
+ */
+
+/* splitmix64 */
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static double rng_unit(uint64_t *state)
+{
+    return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Zipf sampling by rejection-inversion (Hörmann and Derflinger), which
+ * needs O(1) memory however large the vocabulary is */
+typedef struct
+{
+    double s;   /* exponent */
+    double n;   /* number of ranks */
+    double hx1; /* H(1.5) - 1 */
+    double hn;  /* H(n + 0.5) */
+    double cut; /* accept without the second test below this distance */
+} Zipf;
+
+static double zipf_h(const Zipf *z, double x)
+{
+    return exp(-z->s * log(x));
+}
+
+/* integral of zipf_h; expm1(t)/t and log1p(t)/t keep s near 1 exact */
+static double zipf_big_h(const Zipf *z, double x)
+{
+    double lx = log(x), t = (1.0 - z->s) * lx;
+    return (fabs(t) > 1e-8 ? expm1(t) / t : 1.0 + t / 2.0) * lx;
+}
+
+static double zipf_big_h_inv(const Zipf *z, double x)
+{
+    double t = x * (1.0 - z->s);
+    if (t < -1.0)
+        t = -1.0;
+    return exp((fabs(t) > 1e-8 ? log1p(t) / t : 1.0 - t / 2.0) * x);
+}
+
+static void zipf_init(Zipf *z, double s, uint64_t n)
+{
+    z->s = s;
+    z->n = (double)n;
+    z->hx1 = zipf_big_h(z, 1.5) - 1.0;
+    z->hn = zipf_big_h(z, z->n + 0.5);
+    z->cut = 2.0 - zipf_big_h_inv(z, zipf_big_h(z, 2.5) - zipf_h(z, 2.0));
+}
+
+/* a rank in [1, n] */
+static uint64_t zipf_sample(const Zipf *z, uint64_t *rng)
+{
+    for (;;)
+    {
+        double u = z->hn + rng_unit(rng) * (z->hx1 - z->hn);
+        double x = zipf_big_h_inv(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1.0)
+            k = 1.0;
+        else if (k > z->n)
+            k = z->n;
+        if (k - x <= z->cut || u >= zipf_big_h(z, k + 0.5) - zipf_h(z, k))
+            return (uint64_t)k;
+    }
+}
+
+/* Spell rank r in bijective base 26 ("a", "b", ... "z", "aa", ...), so
+ * frequent words are short as in natural text */
+static size_t spell_rank(uint64_t r, char *out)
+{
+    char rev[16];
+    size_t n = 0, i;
+    while (r > 0)
+    {
+        r -= 1;
+        rev[n++] = (char)('a' + r % 26);
+        r /= 26;
+    }
+    for (i = 0; i < n; ++i)
+        out[i] = rev[n - 1 - i];
+    return n;
+}
+
+/* Write about size bytes of Zipf text to fp: sentences of 4 to 24 words,
+ * the first capitalised, ended by '.', '!' or '?' and now and then a line
+ * break */
+static int generate_corpus(FILE *fp, uint64_t size, uint64_t words, double s, uint64_t seed)
+{
+    static const char ends[] = "..........!?";
+    char *buf = (char *)xmalloc(READ_BLOCK_SIZE + 64);
+    size_t len = 0;
+    uint64_t written = 0, rng = seed;
+    Zipf z;
+    int ok = 1;
+
+    zipf_init(&z, s, words);
+    while (ok && written + len < size)
+    {
+        unsigned n = 4 + (unsigned)(rng_next(&rng) % 21), i;
+        for (i = 0; i < n; ++i)
+        {
+            size_t wl;
+            if (len + 32 > READ_BLOCK_SIZE)
+            {
+                ok = fwrite(buf, 1, len, fp) == len;
+                written += len;
+                len = 0;
+            }
+            wl = spell_rank(zipf_sample(&z, &rng), buf + len);
+            if (i == 0)
+                buf[len] = (char)(buf[len] - 'a' + 'A');
+            len += wl;
+            buf[len++] = i + 1 < n ? ' ' : ends[rng_next(&rng) % (sizeof(ends) - 1)];
+        }
+        buf[len++] = rng_next(&rng) % 8 == 0 ? '\n' : ' ';
+    }
+    if (ok && len > 0)
+        ok = fwrite(buf, 1, len, fp) == len;
+    if (fflush(fp) != 0)
+        ok = 0;
+    free(buf);
+    if (!ok)
+        perror("topic_index: --gen-corpus");
+    return ok;
+}
+
+static void bench_row(const char *stage, double secs, uint64_t bytes, long words)
+{
+    fprintf(stderr, "%-8s %10.4f %10.1f %10.2f\n", stage, secs, secs > 0 ? (double)bytes / 1e6 / secs : 0.0,
+            words > 0 ? secs * 1e9 / (double)words : 0.0);
+}
+
+/* Time a single-document run stage by stage and print the table to
+ * stderr; the report itself still goes to stdout.  The lexing stage is a
+ * serial pass that only splits words (run twice, the faster kept, so the
+ * input is in the page cache); counting is the full pass minus that. */
+static int run_bench(Lexer *lx, const char *path, TopicList *topics, const Options *o)
+{
+    Lexer scan;
+    Report r;
+    Options serial = *o;
+    double t0, lex = 0, full, select, output;
+    int pass;
+
+    serial.nthreads = 1;
+    lexer_init(&scan, NULL);
+    for (pass = 0; pass < 2; ++pass)
+    {
+        double secs;
+        lexer_reset(&scan);
+        scan.total_bytes = 0;
+        t0 = now_seconds();
+        if (!count_document(&scan, path, &serial))
+        {
+            lexer_free(&scan);
+            return 0;
+        }
+        secs = now_seconds() - t0;
+        if (pass == 0 || secs < lex)
+            lex = secs;
+    }
+    lexer_free(&scan);
+
+    t0 = now_seconds();
+    if (!count_document(lx, path, o))
+        return 0;
+    full = now_seconds() - t0;
+
+    t0 = now_seconds();
+    build_report(&r, path, lx, topics, o);
+    select = now_seconds() - t0;
+    t0 = now_seconds();
+    write_report(&r, topics, o);
+    output = now_seconds() - t0;
+    free_report(&r);
+
+    fprintf(stderr, "bench: %s, %llu bytes, %ld words, %lu unique, -j %d\n", path,
+            (unsigned long long)lx->total_bytes, lx->total_words, (unsigned long)lx->table->size, o->nthreads);
+    fprintf(stderr, "%-8s %10s %10s %10s\n", "stage", "seconds", "MB/s", "ns/word");
+    bench_row("lex", lex, lx->total_bytes, lx->total_words);
+    bench_row("count", full > lex ? full - lex : 0.0, lx->total_bytes, lx->total_words);
+    bench_row("select", select, lx->total_bytes, lx->total_words);
+    bench_row("output", output, lx->total_bytes, lx->total_words);
+    bench_row("total", full + select + output, lx->total_bytes, lx->total_words);
+    fprintf(stderr, "peak RSS: %ld KiB\n", peak_rss_kib());
+    return 1;
+}
+
+/* Batch mode: count and report one document after another, reusing the
+ * table and lexer buffers between them */
+typedef struct
+{
+    Lexer *lx;
+    TopicList *topics;
+    const Options *opt;
+    int failed;
+    int collect;  /* only gather the paths, for run_corpus() */
+    char **paths;
+    size_t npaths;
+    size_t paths_cap;
+} Batch;
+
+static void batch_document(Batch *b, const char *path)
+{
+    int ok;
+    if (b->collect)
+    {
+        if (b->npaths == b->paths_cap)
+        {
+            b->paths_cap = b->paths_cap ? b->paths_cap * 2 : 64;
+            b->paths = (char **)realloc(b->paths, b->paths_cap * sizeof(char *));
+            if (!b->paths)
+            {
+                fprintf(stderr, "topic_index: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        b->paths[b->npaths] = (char *)xmalloc(strlen(path) + 1);
+        strcpy(b->paths[b->npaths++], path);
+        return;
+    }
+    word_table_reset(b->lx->table);
+    lexer_reset(b->lx);
+    stats_stage(STAGE_COUNT);
+    ok = count_document(b->lx, path, b->opt);
+    stats_stage(STAGE_OTHER);
+    stats_document(b->lx);
+    if (ok)
+        print_report(path, b->lx, b->topics, b->opt);
+    else
+        b->failed = 1;
+}
+
+static int cmp_string(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* A file, or every file below a directory in name order.  Symbolic links
+ * to directories are followed only when given (top), so a link back up
+ * the tree cannot walk it again. */
+static void batch_walk(Batch *b, const char *path, int top)
+{
+#ifdef TOPIC_INDEX_HAVE_DIRENT
+    struct stat st;
+    DIR *dir;
+    struct dirent *de;
+    char **names = NULL;
+    size_t n = 0, cap = 0, i;
+
+    if (!top && lstat(path, &st) == 0 && S_ISLNK(st.st_mode) && stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        return;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        batch_document(b, path);
+        return;
+    }
+    dir = opendir(path);
+    if (!dir)
+    {
+        perror(path);
+        b->failed = 1;
+        return;
+    }
+    while ((de = readdir(dir)) != NULL)
+    {
+        size_t len;
+        if (de->d_name[0] == '.')
+            continue; /* ".", ".." and hidden files */
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            names = (char **)realloc(names, cap * sizeof(char *));
+            if (!names)
+            {
+                fprintf(stderr, "topic_index: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        len = strlen(path) + strlen(de->d_name) + 2;
+        names[n] = (char *)xmalloc(len);
+        sprintf(names[n], "%s/%s", path, de->d_name);
+        ++n;
+    }
+    closedir(dir);
+    qsort(names, n, sizeof(char *), cmp_string);
+    for (i = 0; i < n; ++i)
+    {
+        batch_walk(b, names[i], 0);
+        free(names[i]);
+    }
+    free(names);
+#else
+    (void)top;
+    batch_document(b, path);
+#endif
+}
+
+static void batch_path(Batch *b, const char *path)
+{
+    batch_walk(b, path, 1);
+}
+
+/* One path per line from a list file ("-" for stdin) */
+static void batch_list(Batch *b, const char *list)
+{
+    FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    char *line = NULL;
+    size_t len = 0, cap = 0;
+    int c;
+    if (!fp)
+    {
+        perror(list);
+        b->failed = 1;
+        return;
+    }
+    do
+    {
+        c = fgetc(fp);
+        if (c == EOF || c == '\n')
+        {
+            while (len > 0 && line[len - 1] == '\r')
+                --len;
+            if (len > 0)
+            {
+                line[len] = '\0';
+                batch_path(b, line);
+            }
+            len = 0;
+            continue;
+        }
+        if (len + 2 > cap)
+        {
+            cap = cap ? cap * 2 : 256;
+            line = (char *)realloc(line, cap);
+            if (!line)
+            {
+                fprintf(stderr, "topic_index: out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        line[len++] = (char)c;
+    } while (c != EOF);
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+}
+
+/*
+ * Corpus mode (--corpus with --batch or --list): the documents are summed
+ * into one report whose words also carry how many documents use them, and
+ * with --tfidf each document's topics are scored against it.  With -j N,
+ * N workers take documents in turn, each counting its document serially
+ * into a table of its own before adding it to a corpus table of its own;
+ * the workers' corpus tables are then merged pairwise, a level of the tree
+ * at a time, so a run of N workers ends after log2(N) merge steps.
+ */
+typedef struct
+{
+    CorpusDoc *docs;
+    size_t ndocs;
+    size_t next; /* next document to hand out */
+    const TopicList *topics;
+    Options opt; /* as given, but each document counted serially */
+    int failed;
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+} CorpusJob;
+
+typedef struct
+{
+    CorpusJob *job;
+    Lexer lx;
+    WordTable table;  /* the document being counted */
+    WordTable corpus; /* the documents this worker counted, summed */
+    long total_words;
+    long total_sentences;
+    WordTable *from;  /* merge step: the table to add to corpus */
+} CorpusWorker;
+
+static void corpus_lock(CorpusJob *job)
+{
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_mutex_lock(&job->lock);
+#else
+    (void)job;
+#endif
+}
+
+static void corpus_unlock(CorpusJob *job)
+{
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_mutex_unlock(&job->lock);
+#else
+    (void)job;
+#endif
+}
+
+static void *corpus_worker(void *arg)
+{
+    CorpusWorker *w = (CorpusWorker *)arg;
+    CorpusJob *job = w->job;
+    for (;;)
+    {
+        CorpusDoc *d;
+        size_t i;
+        corpus_lock(job);
+        d = job->next < job->ndocs ? &job->docs[job->next++] : NULL;
+        corpus_unlock(job);
+        if (!d)
+            break;
+        word_table_reset(&w->table);
+        lexer_reset(&w->lx);
+        d->ok = count_document(&w->lx, d->path, &job->opt);
+        corpus_lock(job);
+        stats_document(&w->lx);
+        if (!d->ok)
+            job->failed = 1;
+        corpus_unlock(job);
+        if (!d->ok)
+            continue;
+        d->total_words = w->lx.total_words;
+        d->total_sentences = w->lx.total_sentences;
+        if (d->total_sentences == 0 && d->total_words > 0)
+            d->total_sentences = 1; /* as build_report() counts it */
+        w->total_words += d->total_words;
+        w->total_sentences += d->total_sentences;
+        add_word_table(&w->corpus, &w->table);
+        for (i = 0; d->topics && i < job->topics->len; ++i)
+        {
+            const Topic *tp = &job->topics->items[i];
+            uint32_t e = find_word_entry(&w->table, tp->key, tp->len);
+            if (e != WORD_NONE)
+            {
+                d->topics[2 * i] = word_counter(&w->table, e, COUNTER_WORDS);
+                d->topics[2 * i + 1] = word_counter(&w->table, e, COUNTER_SENTENCES);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void *corpus_merge(void *arg)
+{
+    CorpusWorker *w = (CorpusWorker *)arg;
+    add_word_table(&w->corpus, w->from);
+    free_word_table(w->from);
+    return NULL;
+}
+
+/* Run fn over workers[k] for every k in ks (n of them), in parallel
+ * where there are threads */
+static void corpus_run(void *(*fn)(void *), CorpusWorker *workers, const int *ks, int n)
+{
+    int k;
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_t tids[MAX_THREADS];
+    if (n > 1)
+    {
+        for (k = 0; k < n; ++k)
+            if (pthread_create(&tids[k], NULL, fn, &workers[ks[k]]) != 0)
+            {
+                fprintf(stderr, "topic_index: cannot create thread\n");
+                exit(EXIT_FAILURE);
+            }
+        for (k = 0; k < n; ++k)
+            pthread_join(tids[k], NULL);
+        return;
+    }
+#endif
+    for (k = 0; k < n; ++k)
+        fn(&workers[ks[k]]);
+}
+
+/* Count and report the documents collected in b as one corpus */
+static void run_corpus(Batch *b)
+{
+    CorpusJob job;
+    CorpusWorker *workers;
+    int ks[MAX_THREADS];
+    int nworkers = b->opt->nthreads, k, n, step;
+    TopicList *topics = b->topics;
+    Lexer view;
+    Report r;
+    size_t i, ok = 0;
+
+    job.ndocs = b->npaths;
+    job.docs = (CorpusDoc *)xcalloc(b->npaths ? b->npaths : 1, sizeof(CorpusDoc));
+    for (i = 0; i < b->npaths; ++i)
+    {
+        job.docs[i].path = b->paths[i];
+        if (b->opt->tfidf)
+            job.docs[i].topics = (long *)xcalloc(2 * topics->len, sizeof(long));
+    }
+    job.next = 0;
+    job.topics = topics;
+    job.opt = *b->opt;
+    job.opt.nthreads = 1;
+    job.failed = 0;
+    if ((size_t)nworkers > b->npaths)
+        nworkers = b->npaths ? (int)b->npaths : 1;
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_mutex_init(&job.lock, NULL);
+#endif
+
+    workers = (CorpusWorker *)xcalloc((size_t)nworkers, sizeof(CorpusWorker));
+    for (k = 0; k < nworkers; ++k)
+    {
+        CorpusWorker *w = &workers[k];
+        w->job = &job;
+        word_table_init(&w->table);
+        word_table_init(&w->corpus);
+        word_table_count_docs(&w->corpus);
+        lexer_init(&w->lx, &w->table);
+        ks[k] = k;
+    }
+    utf8_maps_init(); /* before the workers can race to it */
+    stats_stage(STAGE_COUNT);
+    corpus_run(corpus_worker, workers, ks, nworkers);
+
+    /* tree reduction: at each level worker k takes in worker k + step */
+    for (step = 1; step < nworkers; step *= 2)
+    {
+        for (n = 0, k = 0; k + step < nworkers; k += 2 * step)
+        {
+            workers[k].from = &workers[k + step].corpus;
+            workers[k].total_words += workers[k + step].total_words;
+            workers[k].total_sentences += workers[k + step].total_sentences;
+            ks[n++] = k;
+        }
+        corpus_run(corpus_merge, workers, ks, n);
+    }
+    stats_stage(STAGE_OTHER);
+
+    for (i = 0; i < job.ndocs; ++i)
+        ok += job.docs[i].ok != 0;
+    if (ok)
+    {
+        /* a lexer over the corpus table, for build_report() */
+        lexer_init(&view, &workers[0].corpus);
+        view.total_words = workers[0].total_words;
+        view.total_sentences = workers[0].total_sentences;
+        stats_stage(STAGE_SELECT);
+        build_report(&r, NULL, &view, topics, b->opt);
+        r.documents = ok;
+        if (b->opt->tfidf)
+        {
+            r.docs = job.docs;
+            r.ndocs = job.ndocs;
+        }
+        stats_stage(STAGE_OUTPUT);
+        write_report(&r, topics, b->opt);
+        free_report(&r);
+        stats_stage(STAGE_OTHER);
+        lexer_free(&view);
+    }
+
+    for (k = 0; k < nworkers; ++k)
+    {
+        CorpusWorker *w = &workers[k];
+        b->lx->buf_grows += w->lx.buf_grows;
+        b->lx->table->grows += w->table.grows + w->corpus.grows;
+        b->lx->table->pool_grows += w->table.pool_grows + w->corpus.pool_grows;
+        lexer_free(&w->lx);
+        free_word_table(&w->table);
+        free_word_table(&w->corpus); /* a no-op if it went in a merge */
+    }
+    free(workers);
+    for (i = 0; i < job.ndocs; ++i)
+        free(job.docs[i].topics);
+    free(job.docs);
+#ifdef TOPIC_INDEX_HAVE_THREADS
+    pthread_mutex_destroy(&job.lock);
+#endif
+    if (job.failed)
+        b->failed = 1;
+}
+
+#ifdef TOPIC_INDEX_HAVE_SERVE
+/*
+ * Server mode (--serve SOCKET doc...).  Every text document, compressed
+ * or not, is counted once into a word table of its own, with its non-stop
+ * words ranked best first; a saved index is mapped and read in place.
+ * Nothing changes them after that: connection threads read them without
+ * any locking.
+ * A client sends one request per line on the Unix socket and gets one
+ * JSON object per line back, or {"error":...}:
+ *
+ *     docs                  every document with its totals
+ *     topic DOC WORD...     {"doc","total_words","total_sentences","rows"}
+ *                           with a topic row per WORD, as in --format jsonl
+ *     top DOC [K]           the same with the K (default --top) most-used
+ *                           non-stop words as top rows
+ *
+ * DOC is a path as given on the command line, or its position from 0.
+ */
+#define SERVE_LINE_MAX 4096 /* longest request line */
+#define SERVE_MAX_WORDS 256 /* words in one topic request */
+
+typedef struct
+{
+    const char *name;
+    WordTable table;    /* a text's counts... */
+    Index index;        /* ...or a saved index (index.data set) */
+    long total_words;
+    long total_sentences;
+    uint32_t *ranked;   /* a text's non-stop words in report order */
+    size_t nranked;
+} ServeDoc;
+
+typedef struct
+{
+    ServeDoc *docs;
+    size_t ndocs;
+    size_t top_k;
+    /* open connections, so shutdown can close them; only touched when a
+     * client comes or goes, never by a query */
+    int *fds;
+    size_t nfds, fds_cap;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} Server;
+
+typedef struct
+{
+    Server *srv;
+    int fd;
+} Client;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/* Count and rank one document, or map it if it is an index */
+static int serve_load(ServeDoc *d, const char *path, const Options *o)
+{
+    Lexer lx;
+    char magic[sizeof(INDEX_MAGIC) - 1];
+    FILE *fp = strcmp(path, "-") == 0 ? NULL : fopen(path, "rb");
+    int is_index = 0, ok;
+    size_t i;
+    if (fp)
+    {
+        is_index = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0;
+        fclose(fp);
+    }
+    d->name = path;
+    word_table_init(&d->table);
+    if (is_index)
+    {
+        ok = index_open(&d->index, path, 0);
+        if (ok)
+            index_totals(&d->index, &d->total_words, &d->total_sentences);
+        return ok;
+    }
+    lexer_init(&lx, &d->table);
+    ok = count_document(&lx, strcmp(path, "-") == 0 ? NULL : path, o);
+    d->total_words = lx.total_words;
+    d->total_sentences = lx.total_sentences;
+    if (d->total_sentences == 0 && d->total_words > 0)
+        d->total_sentences = 1; /* as in build_report() */
+    lexer_free(&lx);
+
+    d->ranked = (uint32_t *)xmalloc((d->table.size ? d->table.size : 1) * sizeof(uint32_t));
+    d->nranked = 0;
+    for (i = 0; i < d->table.size; ++i)
+        if (!(d->table.flags[i] & WORD_STOP))
+            d->ranked[d->nranked++] = (uint32_t)i;
+    sort_ranked(&d->table, d->ranked, d->nranked);
+    return ok;
+}
+
+static void bytebuf_text(ByteBuf *b, const char *text)
+{
+    bytebuf_put(b, text, strlen(text));
+}
+
+static void bytebuf_long(ByteBuf *b, long v)
+{
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%ld", v);
+    bytebuf_text(b, tmp);
+}
+
+/* JSON string, escaped (see put_json_string()) */
+static void bytebuf_json_string(ByteBuf *b, const char *s)
+{
+    size_t n = strlen(s), len;
+    bytebuf_put(b, "\"", 1);
+    for (; *s; s += len, n -= len)
+    {
+        unsigned char c = (unsigned char)*s;
+        char tmp[8];
+        len = 1;
+        if (c == '"' || c == '\\')
+        {
+            tmp[0] = '\\';
+            tmp[1] = (char)c;
+            bytebuf_put(b, tmp, 2);
+        }
+        else if (c < 0x20 || (c >= 0x80 && utf8_decode((const unsigned char *)s, n, &len) < 0))
+        {
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            bytebuf_text(b, tmp);
+            len = 1;
+        }
+        else
+            bytebuf_put(b, s, len);
+    }
+    bytebuf_put(b, "\"", 1);
+}
+
+static void serve_error(ByteBuf *out, const char *what, const char *arg)
+{
+    bytebuf_text(out, "{\"error\":");
+    if (arg)
+    {
+        char tmp[96];
+        snprintf(tmp, sizeof(tmp), "%s '%.40s'", what, arg);
+        bytebuf_json_string(out, tmp);
+    }
+    else
+        bytebuf_json_string(out, what);
+    bytebuf_text(out, "}\n");
+}
+
+static void serve_doc_head(ByteBuf *out, const ServeDoc *d)
+{
+    bytebuf_text(out, "{\"doc\":");
+    bytebuf_json_string(out, d->name);
+    bytebuf_text(out, ",\"total_words\":");
+    bytebuf_long(out, d->total_words);
+    bytebuf_text(out, ",\"total_sentences\":");
+    bytebuf_long(out, d->total_sentences);
+}
+
+static void serve_row(ByteBuf *out, const char *role, const char *word, long count, long sentences, int *first)
+{
+    bytebuf_text(out, *first ? "{\"role\":\"" : ",{\"role\":\"");
+    bytebuf_text(out, role);
+    bytebuf_text(out, "\",\"word\":");
+    bytebuf_json_string(out, word);
+    bytebuf_text(out, ",\"count\":");
+    bytebuf_long(out, count);
+    bytebuf_text(out, ",\"sentences\":");
+    bytebuf_long(out, sentences);
+    bytebuf_put(out, "}", 1);
+    *first = 0;
+}
 
-    /* Output report */
-    printf("=============================\n");
-    printf("Topic index report\n");
-    printf("Topic word: '%s'\n", topic);
-    printf("Total words: %ld\n", total_words);
-    printf("Total sentences: %ld\n", total_sentences);
-    printf("=============================\n");
-    printf("%-15s %8s %10s %15s %10s\n", "Word", "Count", "% Words", "Sentences", "% Sent");
-    printf("-------------------------------------------------------------------\n");
+static const ServeDoc *serve_find(const Server *s, const char *name)
+{
+    size_t i;
+    char *endp;
+    unsigned long n;
+    for (i = 0; i < s->ndocs; ++i)
+        if (strcmp(s->docs[i].name, name) == 0)
+            return &s->docs[i];
+    n = strtoul(name, &endp, 10);
+    if (endp != name && *endp == '\0' && n < s->ndocs)
+        return &s->docs[n];
+    return NULL;
+}
 
-    /* helper macro for printing line */
-#define PRINT_LINE(entry)                                                                            \
-    do                                                                                               \
-    {                                                                                                \
-        if (entry)                                                                                   \
-        {                                                                                            \
-            double pct_w = (total_words > 0)                                                         \
-                               ? (100.0 * (double)(entry)->count / (double)total_words)              \
-                               : 0.0;                                                                \
-            double pct_s = (total_sentences > 0)                                                     \
-                               ? (100.0 * (double)(entry)->sentence_count / (double)total_sentences) \
-                               : 0.0;                                                                \
-            printf("%-15s %8ld %9.2f%%   %5ld/%-7ld %8.2f%%\n",                                      \
-                   (entry)->word, (entry)->count, pct_w,                                             \
-                   (entry)->sentence_count, total_sentences, pct_s);                                 \
-        }                                                                                            \
-    } while (0)
+/* Answer one request line (modified in place) into out */
+static void serve_request(const Server *s, char *line, ByteBuf *out)
+{
+    char *words[SERVE_MAX_WORDS + 2];
+    const ServeDoc *d;
+    size_t n = 0, i, k, start = out->len;
+    int first = 1, is_topic, corrupt = 0;
+    char *p = line;
 
-    PRINT_LINE(topic_entry);
-    for (i = 0; i < 4; ++i)
+    while (*p)
     {
-        PRINT_LINE(top4[i]);
+        while (*p == ' ' || *p == '\t')
+            *p++ = '\0';
+        if (!*p)
+            break;
+        if (n == sizeof(words) / sizeof(words[0]))
+        {
+            serve_error(out, "too many words", NULL);
+            return;
+        }
+        words[n++] = p;
+        while (*p && *p != ' ' && *p != '\t')
+            ++p;
     }
+    if (n == 0)
+        return; /* blank line: nothing to answer */
 
-    printf("=============================\n");
+    if (strcmp(words[0], "docs") == 0 && n == 1)
+    {
+        bytebuf_text(out, "{\"docs\":[");
+        for (i = 0; i < s->ndocs; ++i)
+        {
+            if (i)
+                bytebuf_put(out, ",", 1);
+            serve_doc_head(out, &s->docs[i]);
+            bytebuf_text(out, ",\"unique\":");
+            bytebuf_long(out, s->docs[i].index.data ? (long)s->docs[i].index.h->words : (long)s->docs[i].table.size);
+            bytebuf_put(out, "}", 1);
+        }
+        bytebuf_text(out, "]}\n");
+        return;
+    }
+    is_topic = strcmp(words[0], "topic") == 0;
+    if (!is_topic && strcmp(words[0], "top") != 0)
+    {
+        serve_error(out, "unknown request", words[0]);
+        return;
+    }
+    if (n < 2 || (is_topic && n < 3) || (!is_topic && n > 3))
+    {
+        serve_error(out, "usage: topic DOC WORD... | top DOC [K] | docs", NULL);
+        return;
+    }
+    d = serve_find(s, words[1]);
+    if (!d)
+    {
+        serve_error(out, "no such document", words[1]);
+        return;
+    }
+    k = s->top_k;
+    if (!is_topic && n == 3)
+    {
+        char *endp;
+        unsigned long v;
+        errno = 0;
+        v = strtoul(words[2], &endp, 10);
+        /* strtoul() would take "-1" as ULONG_MAX */
+        if (words[2][0] == '-' || errno == ERANGE || endp == words[2] || *endp != '\0')
+        {
+            serve_error(out, "not a count", words[2]);
+            return;
+        }
+        k = (size_t)v;
+    }
+
+    serve_doc_head(out, d);
+    bytebuf_text(out, ",\"rows\":[");
+    if (is_topic)
+    {
+        for (i = 2; i < n; ++i)
+        {
+            size_t len = strlen(words[i]);
+            char *key = (char *)xmalloc(FOLD_ROOM(len) + 1);
+            WordRow row;
+            uint64_t rec;
+            int found = 0;
+            uint32_t e;
+            len = stem_key(key, fold_word(key, words[i], len));
+            key[len] = '\0';
+            row.count = row.sentence_count = 0;
+            if (d->index.data)
+                found = index_find(&d->index, key, len, &rec, &row);
+            else if ((e = find_word_entry(&d->table, key, len)) != WORD_NONE)
+                row = word_row(&d->table, e);
+            if (found < 0)
+                corrupt = 1;
+            else
+                serve_row(out, "topic", key, row.count, row.sentence_count, &first);
+            free(key);
+        }
+    }
+    else if (d->index.data)
+    {
+        /* the records are ranked already; pass over the stop words */
+        uint64_t rec;
+        for (rec = 0, i = 0; i < k && rec < d->index.h->words; ++rec)
+        {
+            WordRow row;
+            if (!index_row(&d->index, rec, &row))
+            {
+                corrupt = 1;
+                break;
+            }
+            if (!index_stop(&row))
+            {
+                serve_row(out, "top", row.word, row.count, row.sentence_count, &first);
+                ++i;
+            }
+        }
+    }
+    else
+    {
+        for (i = 0; i < k && i < d->nranked; ++i)
+        {
+            WordRow row = word_row(&d->table, d->ranked[i]);
+            serve_row(out, "top", row.word, row.count, row.sentence_count, &first);
+        }
+    }
+    if (corrupt)
+    {
+        out->len = start;
+        serve_error(out, "corrupt index", d->name);
+        return;
+    }
+    bytebuf_text(out, "]}\n");
+}
+
+static int serve_write(int fd, const unsigned char *p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return 0;
+        p += put;
+        n -= (size_t)put;
+    }
+    return 1;
+}
+
+/* One connection: read request lines, answer each batch in one write */
+static void *serve_client(void *arg)
+{
+    Client *c = (Client *)arg;
+    Server *s = c->srv;
+    char buf[SERVE_LINE_MAX];
+    ByteBuf out = {NULL, 0, 0};
+    size_t len = 0, i;
+
+    for (;;)
+    {
+        ssize_t got = read(c->fd, buf + len, sizeof(buf) - 1 - len);
+        size_t start = 0;
+        char *nl;
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        len += (size_t)got;
+        while ((nl = (char *)memchr(buf + start, '\n', len - start)) != NULL)
+        {
+            *nl = '\0';
+            if (nl > buf + start && nl[-1] == '\r')
+                nl[-1] = '\0';
+            serve_request(s, buf + start, &out);
+            start = (size_t)(nl - buf) + 1;
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+        if (len == sizeof(buf) - 1)
+            serve_error(&out, "request line too long", NULL);
+        if (out.len > 0 && !serve_write(c->fd, out.data, out.len))
+            break;
+        if (len == sizeof(buf) - 1)
+            break;
+        out.len = 0;
+    }
+    if (len > 0 && len < sizeof(buf) - 1)
+    {
+        /* a last request without its newline */
+        out.len = 0;
+        buf[len] = '\0';
+        serve_request(s, buf, &out);
+        serve_write(c->fd, out.data, out.len);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    for (i = 0; i < s->nfds; ++i)
+    {
+        if (s->fds[i] == c->fd)
+        {
+            s->fds[i] = s->fds[--s->nfds];
+            break;
+        }
+    }
+    close(c->fd);
+    if (s->nfds == 0)
+        pthread_cond_signal(&s->idle);
+    pthread_mutex_unlock(&s->lock);
+    free(out.data);
+    free(c);
+    return NULL;
+}
+
+/* Load the documents, then answer queries on the socket at path until
+ * SIGINT or SIGTERM.  Returns 0 if a document or the socket failed. */
+static int serve(const char *path, char *const *names, size_t ndocs, const Options *o)
+{
+    Server s;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    sigset_t block, old;
+    int fd = -1, ok = 1;
+    size_t i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "topic_index: socket path too long: %s\n", path);
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+    utf8_maps_init(); /* client threads fold query words */
+
+    s.docs = (ServeDoc *)xcalloc(ndocs, sizeof(ServeDoc));
+    s.ndocs = ndocs;
+    s.top_k = o->top_k;
+    s.fds = NULL;
+    s.nfds = s.fds_cap = 0;
+    for (i = 0; i < ndocs && ok; ++i)
+        ok = serve_load(&s.docs[i], names[i], o);
+
+    if (ok)
+    {
+        /* replace a stale socket, but nothing else */
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0)
+        {
+            perror(path);
+            ok = 0;
+        }
+    }
+    if (ok)
+    {
+        pthread_mutex_init(&s.lock, NULL);
+        pthread_cond_init(&s.idle, NULL);
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = serve_signal; /* no SA_RESTART: accept() returns */
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGTERM);
+        fprintf(stderr, "topic_index: serving %lu document%s on %s\n", (unsigned long)ndocs, ndocs == 1 ? "" : "s",
+                path);
+
+        while (!serve_stop)
+        {
+            pthread_t tid;
+            Client *c;
+            int cfd = accept(fd, NULL, NULL);
+            if (cfd < 0)
+            {
+                if (errno != EINTR)
+                    perror("accept");
+                continue;
+            }
+            c = (Client *)xmalloc(sizeof(Client));
+            c->srv = &s;
+            c->fd = cfd;
+            pthread_mutex_lock(&s.lock);
+            if (s.nfds == s.fds_cap)
+            {
+                s.fds_cap = s.fds_cap ? s.fds_cap * 2 : 16;
+                s.fds = (int *)realloc(s.fds, s.fds_cap * sizeof(int));
+                if (!s.fds)
+                {
+                    fprintf(stderr, "topic_index: out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            s.fds[s.nfds++] = cfd;
+            pthread_mutex_unlock(&s.lock);
+            /* signals go to this thread only, so they interrupt accept() */
+            pthread_sigmask(SIG_BLOCK, &block, &old);
+            if (pthread_create(&tid, NULL, serve_client, c) != 0)
+            {
+                fprintf(stderr, "topic_index: cannot create thread\n");
+                exit(EXIT_FAILURE);
+            }
+            pthread_detach(tid);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+        }
+
+        /* hang up on every client and wait for their threads to finish */
+        pthread_mutex_lock(&s.lock);
+        for (i = 0; i < s.nfds; ++i)
+            shutdown(s.fds[i], SHUT_RDWR);
+        while (s.nfds > 0)
+            pthread_cond_wait(&s.idle, &s.lock);
+        pthread_mutex_unlock(&s.lock);
+        pthread_cond_destroy(&s.idle);
+        pthread_mutex_destroy(&s.lock);
+        unlink(path);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    for (i = 0; i < ndocs; ++i)
+    {
+        free(s.docs[i].ranked);
+        if (s.docs[i].index.data)
+            index_close(&s.docs[i].index);
+        if (s.docs[i].name)
+            free_word_table(&s.docs[i].table);
+    }
+    free(s.docs);
+    free(s.fds);
+    return ok;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    TopicList topics = {NULL, 0, 0, {NULL}};
+    Options opt = {1, 1, DEFAULT_TOP_K, 0, FORMAT_TEXT, 0, 0, DEFAULT_READ_AHEAD, 0, 0};
+    const char *stop_lang = "en";
+    const char *list = NULL;
+    const char *save_path = NULL, *load_path = NULL;
+    const char *index_path = NULL, *append_path = NULL;
+    const char *serve_path = NULL;
+    Approx approx;
+    int use_approx = 0;
+    uint64_t approx_mem = 0;
+    uint64_t gen_size = 0, gen_words = 50000, gen_seed = 1;
+    double gen_zipf = 1.0;
+    long every_words = 0;
+    double every_seconds = 0;
+    Lexer lx;
+    int status = EXIT_SUCCESS;
+    int argi;
+
+    init_char_tables();
+    init_crc_table();
+    gram_init();
+    stats.mark = now_seconds();
+
+    for (argi = 1; argi < argc; ++argi)
+    {
+        const char *arg = argv[argi];
+        const char *val;
+        if (strcmp(arg, "--mmap") == 0)
+            opt.use_mmap = 1;
+        else if (strcmp(arg, "--no-mmap") == 0)
+            opt.use_mmap = 0;
+        else if (strcmp(arg, "--ascii") == 0)
+            utf8_words = 0;
+        else if (strcmp(arg, "--shared-table") == 0)
+        {
+#ifdef TOPIC_INDEX_HAVE_SHARED_TABLE
+            shared_table = 1;
+#else
+            fprintf(stderr, "topic_index: --shared-table needs threads and atomics\n");
+            return EXIT_FAILURE;
+#endif
+        }
+        else if (strcmp(arg, "--stem") == 0 || strncmp(arg, "--stem=", 7) == 0)
+        {
+            const char *lang = arg[6] ? arg + 7 : "en";
+            size_t i;
+            for (i = 0; STEMMERS[i].lang && strcmp(STEMMERS[i].lang, lang) != 0; ++i)
+                ;
+            if (!STEMMERS[i].lang)
+            {
+                fprintf(stderr, "topic_index: no stemmer for '%s' (have en)\n", lang);
+                return EXIT_FAILURE;
+            }
+            stemmer = STEMMERS[i].stem;
+        }
+        else if (strcmp(arg, "--batch") == 0)
+            opt.batch = 1;
+        else if (strcmp(arg, "--vocab") == 0)
+            opt.vocab = 1;
+        else if (strcmp(arg, "--corpus") == 0)
+            opt.corpus = 1;
+        else if (strcmp(arg, "--tfidf") == 0)
+            opt.corpus = opt.tfidf = 1;
+        else if (strcmp(arg, "--bench") == 0)
+            opt.bench = 1;
+        else if (strcmp(arg, "--approx") == 0)
+            use_approx = 1;
+        else if ((val = option_value("--mem", argc, argv, &argi)) != NULL)
+            approx_mem = parse_size("--mem", val);
+        else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=text") == 0)
+            stats.mode = STATS_TEXT;
+        else if (strcmp(arg, "--stats=json") == 0)
+            stats.mode = STATS_JSON;
+        else if ((val = option_value("--gen-corpus", argc, argv, &argi)) != NULL)
+            gen_size = parse_size("--gen-corpus", val);
+        else if ((val = option_value("--gen-words", argc, argv, &argi)) != NULL)
+            gen_words = (uint64_t)parse_count("--gen-words", val, 1, 1000000000L);
+        else if ((val = option_value("--seed", argc, argv, &argi)) != NULL)
+            gen_seed = (uint64_t)parse_count("--seed", val, 0, 2147483647L);
+        else if ((val = option_value("--zipf", argc, argv, &argi)) != NULL)
+        {
+            char *endp;
+            gen_zipf = strtod(val, &endp);
+            if (*endp != '\0' || !(gen_zipf > 0.0 && gen_zipf <= 10.0))
+            {
+                fprintf(stderr, "topic_index: --zipf expects an exponent in (0, 10]\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((val = option_value("--format", argc, argv, &argi)) != NULL)
+        {
+            if (strcmp(val, "text") == 0)
+                opt.format = FORMAT_TEXT;
+            else if (strcmp(val, "jsonl") == 0)
+                opt.format = FORMAT_JSONL;
+            else if (strcmp(val, "tsv") == 0)
+                opt.format = FORMAT_TSV;
+            else if (strcmp(val, "bin") == 0)
+                opt.format = FORMAT_BIN;
+            else
+            {
+                fprintf(stderr, "topic_index: unknown format '%s' (have text, jsonl, tsv, bin)\n", val);
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((val = option_value("--list", argc, argv, &argi)) != NULL)
+        {
+            list = val;
+            opt.batch = 1;
+        }
+        else if ((val = option_value("--save-index", argc, argv, &argi)) != NULL)
+            save_path = val;
+        else if ((val = option_value("--load-index", argc, argv, &argi)) != NULL)
+            load_path = val;
+        else if ((val = option_value("--index", argc, argv, &argi)) != NULL)
+            index_path = val;
+        else if ((val = option_value("--append", argc, argv, &argi)) != NULL)
+            append_path = val;
+        else if ((val = option_value("--serve", argc, argv, &argi)) != NULL)
+            serve_path = val;
+        else if ((val = option_value("--read-ahead", argc, argv, &argi)) != NULL)
+            opt.read_ahead = (int)parse_count("--read-ahead", val, 0, 64);
+        else if ((val = option_value("-j", argc, argv, &argi)) != NULL)
+            opt.nthreads = (int)parse_count("-j", val, 1, MAX_THREADS);
+        else if ((val = option_value("--top", argc, argv, &argi)) != NULL)
+            opt.top_k = (size_t)parse_count("--top", val, 0, 1000000L);
+        else if ((val = option_value("--ngrams", argc, argv, &argi)) != NULL)
+        {
+            gram_report = (int)parse_count("--ngrams", val, 2, NGRAM_MAX);
+            gram_sizes |= 1u << gram_report;
+        }
+        else if ((val = option_value("--window", argc, argv, &argi)) != NULL)
+            window_parse(val);
+        else if ((val = option_value("--every", argc, argv, &argi)) != NULL)
+        {
+            /* N words, or Ns seconds */
+            char *endp;
+            every_words = strtol(val, &endp, 10);
+            if (*endp == 's' || *endp == '.')
+            {
+                every_words = 0;
+                every_seconds = strtod(val, &endp);
+                if (*endp++ != 's' || !(every_seconds > 0.0 && every_seconds <= 86400.0))
+                    endp = (char *)val;
+            }
+            else if (every_words <= 0)
+                endp = (char *)val;
+            if (*val < '0' || *val > '9' || endp == val || *endp != '\0')
+            {
+                fprintf(stderr, "topic_index: --every expects a word count such as 10000 or seconds such as 5s\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if ((val = option_value("--stop-lang", argc, argv, &argi)) != NULL)
+            stop_lang = val;
+        else if ((val = option_value("--stop-words", argc, argv, &argi)) != NULL)
+            stop_add_file(&stop_words, val);
+        else if ((val = option_value("--topics", argc, argv, &argi)) != NULL)
+            read_word_list(val, 1, topic_list_add, &topics);
+        else if ((val = option_value("--topic", argc, argv, &argi)) != NULL)
+            topic_list_add(&topics, val, strlen(val));
+        else if (strcmp(arg, "--") == 0)
+        {
+            ++argi;
+            break;
+        }
+        else if (arg[0] == '-' && arg[1] == '-')
+        {
+            fprintf(stderr, "topic_index: unknown option '%s'\n", arg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else
+            break;
+    }
+    if (gen_size)
+    {
+        /* synthetic corpus to stdout, nothing else */
+        status = generate_corpus(stdout, gen_size, gen_words, gen_zipf, gen_seed) ? EXIT_SUCCESS : EXIT_FAILURE;
+        topic_list_free(&topics);
+        stop_set_free(&stop_words);
+        return status;
+    }
+    if (serve_path)
+    {
+        if (opt.batch || opt.bench || use_approx || save_path || load_path || append_path || index_path ||
+            topics.len > 0 || argi >= argc)
+        {
+            fprintf(stderr, "topic_index: --serve SOCKET takes documents and indexes; topics come with each query\n");
+            return EXIT_FAILURE;
+        }
+    }
+    else if (!append_path != !index_path)
+    {
+        fprintf(stderr, "topic_index: --append and --index go together\n");
+        return EXIT_FAILURE;
+    }
+    if (append_path && (save_path || load_path))
+    {
+        fprintf(stderr, "topic_index: --append rewrites --index; drop --save-index and --load-index\n");
+        return EXIT_FAILURE;
+    }
+    if (topics.len == 0 && !serve_path && (argi < argc || !append_path))
+    {
+        if (argi >= argc)
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        topic_list_add(&topics, argv[argi], strlen(argv[argi]));
+        ++argi;
+    }
+    if (append_path)
+    {
+        /* load, count the new text on top, and write back */
+        load_path = save_path = index_path;
+    }
+    if ((save_path || load_path) && opt.batch)
+    {
+        fprintf(stderr, "topic_index: --save-index and --load-index take a single document\n");
+        return EXIT_FAILURE;
+    }
+    if ((every_words || every_seconds > 0) &&
+        (opt.batch || opt.bench || serve_path || use_approx || load_path || append_path || opt.nthreads > 1))
+    {
+        fprintf(stderr, "topic_index: --every reports on one stream counted serially; drop batch, bench, serve, index, --approx and -j options\n");
+        return EXIT_FAILURE;
+    }
+    if (every_words || every_seconds > 0)
+        opt.use_mmap = 0; /* read the input block by block */
+    if (opt.corpus && !opt.batch)
+    {
+        fprintf(stderr, "topic_index: --corpus and --tfidf sum a batch; add --batch or --list\n");
+        return EXIT_FAILURE;
+    }
+    if (opt.corpus && opt.format == FORMAT_BIN)
+    {
+        fprintf(stderr, "topic_index: --corpus reports as text, jsonl or tsv\n");
+        return EXIT_FAILURE;
+    }
+    if (opt.bench && (opt.batch || load_path || append_path || argi >= argc))
+    {
+        fprintf(stderr, "topic_index: --bench times one file: --bench <topic_word> FILE\n");
+        return EXIT_FAILURE;
+    }
+    if (approx_mem && !use_approx)
+    {
+        fprintf(stderr, "topic_index: --mem sizes --approx\n");
+        return EXIT_FAILURE;
+    }
+    if (use_approx && gram_report)
+    {
+        fprintf(stderr, "topic_index: --ngrams needs exact counts; drop --approx\n");
+        return EXIT_FAILURE;
+    }
+    if (use_approx && (opt.batch || opt.bench || load_path || save_path || append_path || opt.nthreads > 1))
+    {
+        fprintf(stderr, "topic_index: --approx counts one document serially; drop batch, index, bench and -j options\n");
+        return EXIT_FAILURE;
+    }
+    if (use_approx && approx_mem < (1UL << 20))
+    {
+        if (approx_mem)
+        {
+            fprintf(stderr, "topic_index: --mem needs at least 1M\n");
+            return EXIT_FAILURE;
+        }
+        approx_mem = DEFAULT_APPROX_MEM;
+    }
+    if ((load_path || append_path) && argi < argc)
+    {
+        fprintf(stderr, "topic_index: unexpected argument '%s' (the text comes from the index)\n", argv[argi]);
+        return EXIT_FAILURE;
+    }
+
+    /* stop-word packs: comma-separated, "none" for no built-in list */
+    while (*stop_lang)
+    {
+        char lang[16];
+        size_t n = strcspn(stop_lang, ",");
+        if (n >= sizeof(lang))
+            n = sizeof(lang) - 1;
+        memcpy(lang, stop_lang, n);
+        lang[n] = '\0';
+        if (strcmp(lang, "none") != 0 && !stop_add_pack(&stop_words, lang))
+        {
+            fprintf(stderr, "topic_index: no stop-word pack for '%s' (have en, de, fr, none)\n", lang);
+            return EXIT_FAILURE;
+        }
+        stop_lang += strcspn(stop_lang, ",");
+        if (*stop_lang == ',')
+            ++stop_lang;
+    }
+    stop_set_build(&stop_words);
+    abbreviations_build();
+    if (stemmer)
+        topic_list_stem(&topics);
+    if (!topic_list_phrases(&topics))
+        return EXIT_FAILURE;
+    if (gram_sizes && (load_path || append_path))
+    {
+        fprintf(stderr, "topic_index: phrase topics and --ngrams need the text, not an index\n");
+        return EXIT_FAILURE;
+    }
+    if (window_size && (serve_path || load_path || append_path))
+    {
+        fprintf(stderr, "topic_index: --window needs the text of a report; drop --serve, --load-index and --append\n");
+        return EXIT_FAILURE;
+    }
+    if (opt.corpus && (gram_sizes || window_size))
+    {
+        fprintf(stderr, "topic_index: --corpus counts words; drop phrase topics, --ngrams and --window\n");
+        return EXIT_FAILURE;
+    }
+    if (window_size)
+        topic_list_windows(&topics);
+
+    word_table_init(&word_table);
+    lexer_init(&lx, &word_table);
+    if (use_approx)
+    {
+        size_t i;
+        approx_init(&approx, approx_mem, 4 * (opt.top_k + 1));
+        for (i = 0; i < topics.len; ++i)
+            if (topics.items[i].words < 2)
+                approx_exact(&approx, topics.items[i].key, topics.items[i].len);
+        lx.approx = &approx;
+    }
+    if (topics.len > 0)
+        print_preamble(&opt);
+    if (serve_path)
+    {
+#ifdef TOPIC_INDEX_HAVE_SERVE
+        if (!serve(serve_path, argv + argi, (size_t)(argc - argi), &opt))
+            status = EXIT_FAILURE;
+#else
+        fprintf(stderr, "topic_index: --serve needs Unix sockets\n");
+        status = EXIT_FAILURE;
+#endif
+    }
+    else if (opt.batch)
+    {
+        Batch b;
+        b.lx = &lx;
+        b.topics = &topics;
+        b.opt = &opt;
+        b.failed = 0;
+        b.collect = opt.corpus;
+        b.paths = NULL;
+        b.npaths = b.paths_cap = 0;
+        if (list)
+            batch_list(&b, list);
+        for (; argi < argc; ++argi)
+            batch_path(&b, argv[argi]);
+        if (opt.corpus)
+        {
+            size_t i;
+            run_corpus(&b);
+            for (i = 0; i < b.npaths; ++i)
+                free(b.paths[i]);
+            free(b.paths);
+        }
+        if (b.failed)
+            status = EXIT_FAILURE;
+    }
+    else if (opt.bench)
+    {
+        if (!run_bench(&lx, argv[argi], &topics, &opt))
+            status = EXIT_FAILURE;
+    }
+    else if (load_path && !save_path)
+    {
+        /* answered from the index in place, without a table */
+        Index ix;
+        stats_stage(STAGE_INDEX);
+        if (!index_open(&ix, load_path, 0))
+            status = EXIT_FAILURE;
+        else
+        {
+            if (stats.mode != STATS_OFF)
+            {
+                stats.words += (long)ix.h->total_words;
+                stats.unique += (unsigned long)ix.h->words;
+            }
+            if (topics.len > 0 && !print_index_report(load_path, &ix, &topics, &opt))
+                status = EXIT_FAILURE;
+            index_close(&ix);
+        }
+        stats_stage(STAGE_OTHER);
+    }
+    else
+    {
+        const char *path = load_path ? load_path : argi < argc ? argv[argi] : NULL;
+        int ok = 1;
+        Live live;
+        if (every_words || every_seconds > 0)
+            live_init(&live, &lx, &topics, &opt, path, every_words, every_seconds);
+        stats_stage(STAGE_INDEX);
+        lx.keep_pending = save_path != NULL;
+        if (load_path)
+            ok = load_index(&lx, load_path, append_path != NULL);
+        stats_stage(STAGE_COUNT);
+        if (ok && append_path)
+            ok = count_document(&lx, strcmp(append_path, "-") == 0 ? NULL : append_path, &opt);
+        else if (ok && !load_path)
+            ok = count_document(&lx, path, &opt);
+        stats_stage(STAGE_INDEX);
+        if (every_words || every_seconds > 0)
+            live_free(&live);
+        if (ok && save_path)
+            ok = save_index(&lx, save_path);
+        lexer_end_text(&lx); /* only now, for the report */
+        stats_stage(STAGE_OTHER);
+        if (ok)
+            stats_document(&lx);
+        if (ok && topics.len > 0)
+            print_report(path, &lx, &topics, &opt);
+        else if (!ok)
+            status = EXIT_FAILURE;
+    }
+
+    if (stats.mode != STATS_OFF)
+        stats_print(&lx);
 
     /* cleanup */
-    free(array);
-    free(topic_lc);
-    free_hash_table();
+    if (use_approx)
+        approx_free(&approx);
+    lexer_free(&lx);
+    topic_list_free(&topics);
+    free_word_table(&word_table);
+    stop_set_free(&stop_words);
+    free(bin_buf.data);
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return status;
+}